@@ -0,0 +1,415 @@
+/**
+ * @file bench.c
+ *
+ * Parse and query benchmark. Generates documents of a few shapes, the same
+ * bytes on every run, loads each and times a fixed set of queries on it.
+ * Every document is measured in a process of its own, so that peak RSS is
+ * its own too.
+ *
+ * usage: bench [-j] [-s MB,MB...] [-k kind,kind...] [-t seconds]
+ *
+ * -j prints a JSON object per line instead of a table, -s the sizes (1 to
+ * 1024 MB, 1 and 16 by default), -k the kinds (all of wide, deep, attrs,
+ * text and names by default) and -t the time each query runs for.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "xml.h"
+
+
+struct buffer {
+
+	char* data;
+	size_t len;
+	size_t max_len;
+};
+
+
+static void put ( struct buffer* buf, const char* format, ... ) {
+
+	va_list args;
+
+	if ( buf->max_len - buf->len < 4096 ) {
+
+		buf->max_len = 2 * buf->max_len + 4096;
+		buf->data = realloc( buf->data, buf->max_len );
+
+		if ( !buf->data ) {
+			fprintf( stderr, "bench: out of memory\n" );
+			exit( 1 );
+		}
+	}
+
+	va_start( args, format );
+	buf->len += vsnprintf( buf->data + buf->len, buf->max_len - buf->len,
+	                       format, args );
+	va_end( args );
+}
+
+
+/*
+ * the same numbers on every run and machine
+ */
+static uint32_t seed = 1;
+
+static uint32_t next_random ( void ) {
+
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+
+/*
+ * Generators. All of them use item elements with an id attribute and name
+ * and value sons somewhere, for the queries to find.
+ */
+static void gen_wide ( struct buffer* buf, size_t size ) {
+
+	for ( int i = 0; buf->len < size; i++ )
+		put( buf, "<item id=\"%d\"><name>Item %d</name>"
+		          "<value>%u</value></item>\n", i, i, next_random() % 1000 );
+}
+
+
+static void gen_deep ( struct buffer* buf, size_t size ) {
+
+	for ( int i = 0; buf->len < size; ) {
+
+		int depth = 64 + next_random() % 448;
+
+		for ( int j = 0; j < depth; j++, i++ )
+			put( buf, "<item id=\"%d\"><name>Level %d</name>", i, j );
+
+		put( buf, "<value>%d</value>", i );
+
+		for ( int j = 0; j < depth; j++ )
+			put( buf, "</item>" );
+
+		put( buf, "\n" );
+	}
+}
+
+
+static void gen_attrs ( struct buffer* buf, size_t size ) {
+
+	for ( int i = 0; buf->len < size; i++ ) {
+
+		put( buf, "<item id=\"%d\"", i );
+
+		for ( int j = 0, n = 8 + next_random() % 16; j < n; j++ )
+			put( buf, " a%d=\"%u\"", j, next_random() );
+
+		put( buf, "><name n=\"%d\"/></item>\n", i );
+	}
+}
+
+
+static void gen_text ( struct buffer* buf, size_t size ) {
+
+	static const char* words[] = { "lorem", "ipsum", "dolor", "sit", "amet",
+	                               "consectetur", "adipiscing", "elit", "sed",
+	                               "do", "&amp;", "eiusmod", "tempor" };
+
+	for ( int i = 0; buf->len < size; i++ ) {
+
+		put( buf, "<item id=\"%d\"><name>Item %d</name><value>", i, i );
+
+		for ( int j = 0, n = 32 + next_random() % 320; j < n; j++ )
+			put( buf, "%s ", words[ next_random() % 13 ] );
+
+		put( buf, "</value></item>\n" );
+	}
+}
+
+
+static void gen_names ( struct buffer* buf, size_t size ) {
+
+	for ( int i = 0; buf->len < size; i++ ) {
+
+		unsigned name = next_random() % 50000;
+
+		if ( i % 10 == 0 )
+			put( buf, "<item id=\"%d\"><name>Item %d</name></item>\n", i, i );
+		else
+			put( buf, "<n%u id=\"%d\"><value>%d</value></n%u>\n",
+			     name, i, i, name );
+	}
+}
+
+
+static const struct {
+
+	const char* name;
+	void (*generate)( struct buffer* buf, size_t size );
+
+} kinds[] = {
+
+	{ "wide", gen_wide },
+	{ "deep", gen_deep },
+	{ "attrs", gen_attrs },
+	{ "text", gen_text },
+	{ "names", gen_names }
+};
+
+#define KINDS  (int)( sizeof( kinds ) / sizeof( *kinds ) )
+
+
+static const char* queries[] = {
+
+	"/*/item",
+	"//name",
+	"//item[@id='1000']",
+	"//item/@id",
+	"//value/ancestor::item",
+	"/*/item[last()]/preceding-sibling::item[1]",
+	"//*[name]"
+};
+
+#define QUERIES  (int)( sizeof( queries ) / sizeof( *queries ) )
+
+
+static double now ( void ) {
+
+	struct timespec t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static long peak_rss_kb ( void ) {
+
+	struct rusage usage;
+
+	getrusage( RUSAGE_SELF, &usage );
+
+	return usage.ru_maxrss;
+}
+
+
+static int cmp_double ( const void* a, const void* b ) {
+
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return ( x > y ) - ( x < y );
+}
+
+
+static double percentile ( const double* sorted, int len, double p ) {
+
+	return sorted[ (int)( p * ( len - 1 ) + 0.5 ) ];
+}
+
+
+/*
+ * runs in a child process: generates the document, loads it and times
+ * the queries
+ */
+static void bench_case ( int kind, int mb, double seconds, bool json ) {
+
+	struct buffer buf = { NULL, 0, 0 };
+	size_t size = (size_t)mb << 20;
+
+	seed = 1;
+
+	put( &buf, "<root>\n" );
+	kinds[ kind ].generate( &buf, size );
+	put( &buf, "</root>\n" );
+
+	long rss = peak_rss_kb();
+
+	// the best of a few loads, fewer the larger the document
+	int loads = mb >= 64 ? 1 : 3;
+	double load = 1e30, postings = 1e30, release = 0;
+
+	struct xml_load_stats stats;
+	struct xml_options opt;
+	memset( &opt, 0, sizeof( opt ) );
+	opt.postings = 1;
+	opt.stats = &stats;
+
+	for ( int i = 0; i < loads; i++ ) {
+
+		struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len,
+		                                                &opt );
+
+		if ( !root ) {
+			fprintf( stderr, "bench: %s %d MB does not load\n",
+			         kinds[ kind ].name, mb );
+			exit( 1 );
+		}
+
+		if ( stats.postings_time < postings ) postings = stats.postings_time;
+
+		free_xml( root );
+
+		double start = now();
+		root = load_xml_buffer( buf.data, buf.len );
+		double end = now();
+
+		if ( end - start < load ) load = end - start;
+
+		if ( i < loads - 1 ) {
+			free_xml( root );
+			continue;
+		}
+
+		rss = peak_rss_kb() - rss;
+
+		if ( json )
+			printf( "{\"kind\":\"%s\",\"mb\":%d,\"bytes\":%zu,"
+			        "\"parse_mb_s\":%.1f,\"load_ms\":%.3f,"
+			        "\"postings_ms\":%.3f,\"rss_kb\":%ld}\n",
+			        kinds[ kind ].name, mb, buf.len,
+			        buf.len / load / 1e6, load * 1e3,
+			        postings * 1e3, rss );
+		else
+			printf( "%-6s %5d MB  %8.1f MB/s  load %9.3f ms  "
+			        "postings %8.3f ms  rss %8ld kB\n",
+			        kinds[ kind ].name, mb, buf.len / load / 1e6, load * 1e3,
+			        postings * 1e3, rss );
+
+		for ( int q = 0; q < QUERIES; q++ ) {
+
+			int max_runs = 100000, runs = 0, found = 0;
+			double* times = malloc( max_runs * sizeof( double ) );
+			double total = 0;
+
+			if ( !times ) {
+				fprintf( stderr, "bench: out of memory\n" );
+				exit( 1 );
+			}
+
+			// the list and its release are part of the query
+			while ( runs < max_runs && ( runs < 5 || total < seconds ) ) {
+
+				double t = now();
+				void** list = xml_get( root, queries[q] );
+
+				if ( !list ) {
+					fprintf( stderr, "bench: %s fails\n", queries[q] );
+					exit( 1 );
+				}
+
+				for ( found = 0; list[ found ]; found++ ) ;
+				free_xml_list( list );
+
+				times[ runs ] = now() - t;
+				total += times[ runs++ ];
+			}
+
+			qsort( times, runs, sizeof( double ), cmp_double );
+
+			if ( json )
+				printf( "{\"kind\":\"%s\",\"mb\":%d,\"query\":\"%s\","
+				        "\"results\":%d,\"runs\":%d,\"p50_us\":%.1f,"
+				        "\"p90_us\":%.1f,\"p99_us\":%.1f}\n",
+				        kinds[ kind ].name, mb, queries[q], found, runs,
+				        percentile( times, runs, 0.5 ) * 1e6,
+				        percentile( times, runs, 0.9 ) * 1e6,
+				        percentile( times, runs, 0.99 ) * 1e6 );
+			else
+				printf( "    %-44s %8d  p50 %11.1f us  p90 %11.1f us  "
+				        "p99 %11.1f us\n", queries[q], found,
+				        percentile( times, runs, 0.5 ) * 1e6,
+				        percentile( times, runs, 0.9 ) * 1e6,
+				        percentile( times, runs, 0.99 ) * 1e6 );
+
+			free( times );
+		}
+
+		start = now();
+		free_xml( root );
+		release = now() - start;
+	}
+
+	if ( json )
+		printf( "{\"kind\":\"%s\",\"mb\":%d,\"free_ms\":%.3f}\n",
+		        kinds[ kind ].name, mb, release * 1e3 );
+	else
+		printf( "    free %.3f ms\n\n", release * 1e3 );
+
+	free( buf.data );
+}
+
+
+static bool listed ( const char* list, const char* name ) {
+
+	size_t len = strlen( name );
+
+	for ( const char* p = list; p; p = strchr( p, ',' ), p = p ? p + 1 : p )
+		if ( strncmp( p, name, len ) == 0 && ( !p[len] || p[len] == ',' ) )
+			return true;
+
+	return false;
+}
+
+
+int main ( int argc, char** argv ) {
+
+	const char* sizes = "1,16";
+	const char* only = NULL;
+	double seconds = 0.2;
+	bool json = false;
+	int opt;
+
+	while ( ( opt = getopt( argc, argv, "js:k:t:" ) ) != -1 ) {
+
+		switch ( opt ) {
+			case 'j': json = true; break;
+			case 's': sizes = optarg; break;
+			case 'k': only = optarg; break;
+			case 't': seconds = atof( optarg ); break;
+			default:
+				fprintf( stderr, "usage: %s [-j] [-s MB,MB...] "
+				                 "[-k kind,kind...] [-t seconds]\n", argv[0] );
+				return 1;
+		}
+	}
+
+	int failed = 0;
+
+	for ( const char* s = sizes; s; s = strchr( s, ',' ), s = s ? s + 1 : s ) {
+
+		int mb = atoi( s );
+
+		if ( mb < 1 || mb > 1024 ) {
+			fprintf( stderr, "bench: sizes go from 1 to 1024 MB\n" );
+			return 1;
+		}
+
+		for ( int kind = 0; kind < KINDS; kind++ ) {
+
+			if ( only && !listed( only, kinds[ kind ].name ) ) continue;
+
+			fflush( stdout );
+
+			pid_t pid = fork();
+
+			if ( pid == 0 ) {
+				bench_case( kind, mb, seconds, json );
+				fflush( stdout );
+				_exit( 0 );
+			}
+
+			int status = 1;
+
+			if ( pid < 0 || waitpid( pid, &status, 0 ) < 0 || status != 0 )
+				failed = 1;
+		}
+	}
+
+	return failed;
+}
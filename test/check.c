@@ -0,0 +1,1770 @@
+/**
+ * @file check.c
+ *
+ * Regression checks, run by make check. It builds the library with a tiny
+ * XML_MIN_CHUNK, so that parallel loads cut small documents in many chunks.
+ * Prints every failed check and exits with 1 if there was any.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "xml.h"
+
+
+static int checks, failures;
+
+#define CHECK( cond, ... ) check( cond, __FILE__, __LINE__, __VA_ARGS__ )
+
+static void check ( bool ok, const char* file, int line,
+                    const char* format, ... ) {
+
+	va_list args;
+
+	checks++;
+	if ( ok ) return;
+
+	failures++;
+	printf( "%s:%d: ", file, line );
+
+	va_start( args, format );
+	vprintf( format, args );
+	va_end( args );
+
+	putchar( '\n' );
+}
+
+
+struct buffer {
+
+	char* data;
+	size_t len;
+	size_t max_len;
+};
+
+
+static void put ( struct buffer* buf, const char* format, ... ) {
+
+	va_list args;
+
+	if ( buf->max_len - buf->len < 4096 ) {
+
+		buf->max_len = 2 * buf->max_len + 4096;
+		buf->data = realloc( buf->data, buf->max_len );
+
+		if ( !buf->data ) {
+			fprintf( stderr, "check: out of memory\n" );
+			exit( 1 );
+		}
+	}
+
+	va_start( args, format );
+	buf->len += vsnprintf( buf->data + buf->len, buf->max_len - buf->len,
+	                       format, args );
+	va_end( args );
+}
+
+
+static unsigned seed = 1;
+
+static unsigned next_random ( void ) {
+
+	seed = seed * 1664525u + 1013904223u;
+	return seed >> 8;
+}
+
+
+/*
+ * Random documents, with what tends to fool a chunk that starts at a
+ * guessed '<': markup characters in attribute values and comments, and
+ * tags cut anywhere.
+ */
+static void gen_element ( struct buffer* buf, int depth ) {
+
+	static const char* names[] = { "a", "b", "item", "name", "value", "x" };
+	static const char* texts[] = { "text", " spaced  ", "a &amp; b", "&#65;",
+	                               "1 &gt; 0", "" };
+	static const char* values[] = { "1", "<a>", "x > y", "&lt;b/&gt;", "",
+	                                "'", "</a>" };
+
+	const char* name = names[ next_random() % 6 ];
+
+	put( buf, "<%s", name );
+
+	for ( int i = 0, n = next_random() % 4; i < n; i++ )
+		put( buf, " a%d%s=%s\"%s\"", i, next_random() % 2 ? " " : "",
+		     next_random() % 2 ? " " : "", values[ next_random() % 7 ] );
+
+	if ( next_random() % 5 == 0 ) {
+		put( buf, next_random() % 2 ? "/>" : " />" );
+		return;
+	}
+
+	put( buf, ">" );
+
+	switch ( next_random() % 4 ) {
+		case 0: put( buf, "%s", texts[ next_random() % 6 ] ); break;
+		case 1: put( buf, "<!-- <%s> -->", name ); break;
+		case 2: put( buf, "<?pi <x> ?>" ); break;
+	}
+
+	int sons = depth > 12 ? 0 : next_random() % ( depth < 3 ? 12 : 4 );
+
+	for ( int i = 0; i < sons; i++ ) {
+
+		gen_element( buf, depth + 1 );
+		if ( next_random() % 3 == 0 ) put( buf, "\n  " );
+	}
+
+	put( buf, "</%s>", name );
+}
+
+
+static void gen_document ( struct buffer* buf, size_t size ) {
+
+	buf->len = 0;
+
+	put( buf, "<?xml version=\"1.0\"?>\n<root>" );
+
+	while ( buf->len < size )
+		gen_element( buf, 1 );
+
+	put( buf, "</root>\n" );
+}
+
+
+/*
+ * whether two trees are the same, node by node, numbers included
+ */
+static bool same_attrs ( const struct xml_attribute* x,
+                         const struct xml_attribute* y ) {
+
+	for ( ; x && y; x = x->next, y = y->next )
+		if ( strcmp( x->name, y->name ) != 0 || x->name_id != y->name_id ||
+		     x->order != y->order || x->value_len != y->value_len ||
+		     x->pending != y->pending ||
+		     memcmp( x->value, y->value, x->value_len ) != 0 )
+			return false;
+
+	return !x && !y;
+}
+
+
+static bool same_tree ( const struct xml_element* x,
+                        const struct xml_element* y ) {
+
+	for ( ; x && y; x = x->next, y = y->next ) {
+
+		if ( ( x->name || y->name ) &&
+		     ( !x->name || !y->name || strcmp( x->name, y->name ) != 0 ) )
+			return false;
+
+		if ( x->name_id != y->name_id || x->order != y->order ||
+		     x->end != y->end || x->status != y->status ||
+		     x->value_len != y->value_len || x->pending != y->pending ||
+		     ( x->value_len &&
+		       memcmp( x->value, y->value, x->value_len ) != 0 ) )
+			return false;
+
+		if ( !same_attrs( x->attr, y->attr ) ||
+		     !same_tree( x->son, y->son ) )
+			return false;
+	}
+
+	return !x && !y;
+}
+
+
+/*
+ * Parallel loads build the very tree a sequential one does, whatever the
+ * chunks, and fail where it fails.
+ */
+static void check_parallel ( void ) {
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+
+	for ( int doc = 0; doc < 8; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 4096 );
+
+		for ( int mode = 0; mode < 3; mode++ ) {
+
+			memset( &opt, 0, sizeof( opt ) );
+			opt.decode = mode == 1 ? XML_DECODE : 0;
+			opt.lazy_values = mode == 2;
+
+			// and cut short, which must fail the same way
+			size_t len = doc % 4 == 3 ? buf.len / 2 : buf.len;
+
+			struct xml_element* base = load_xml_buffer_opt( buf.data, len,
+			                                                &opt );
+
+			CHECK( base || len < buf.len, "document %d does not load", doc );
+
+			for ( int threads = 2; threads <= 40; threads++ ) {
+
+				opt.threads = threads;
+
+				struct xml_element* root = load_xml_buffer_opt( buf.data, len,
+				                                                &opt );
+
+				CHECK( !base == !root && ( !root ||
+				       same_tree( base, root ) ),
+				       "document %d, mode %d, %d threads: trees differ",
+				       doc, mode, threads );
+
+				free_xml( root );
+			}
+
+			free_xml( base );
+		}
+	}
+
+	// a negative thread count loads on the calling thread
+	struct xml_load_stats stats;
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.threads = -1;
+	opt.stats = &stats;
+
+	struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len, &opt );
+
+	CHECK( root && stats.merge_time == 0, "-1 threads load in parallel" );
+
+	free_xml( root );
+	free( buf.data );
+}
+
+
+static char* read_file ( const char* path, long* len ) {
+
+	FILE* f = fopen( path, "rb" );
+	if ( !f ) return NULL;
+
+	fseek( f, 0, SEEK_END );
+	*len = ftell( f );
+	rewind( f );
+
+	char* data = malloc( *len );
+
+	if ( data && fread( data, 1, *len, f ) != (size_t)*len ) {
+		free( data );
+		data = NULL;
+	}
+
+	fclose( f );
+	return data;
+}
+
+
+static void write_file ( const char* path, const char* data, long len ) {
+
+	FILE* f = fopen( path, "wb" );
+
+	if ( f ) {
+		fwrite( data, 1, len, f );
+		fclose( f );
+	}
+}
+
+
+/*
+ * Truncated snapshots, and those with any section offset or count of the
+ * header changed, are refused. The header is 32 bytes of magic, sizes and
+ * base, then 14 words of offsets and counts.
+ */
+static void check_snapshot ( void ) {
+
+	static const char* path = "check.snap";
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+	long len;
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.postings = 1;
+
+	gen_document( &buf, 4096 );
+
+	struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len, &opt );
+
+	xml_count( root, "//item/name" );
+
+	CHECK( root && xml_save_snapshot( root, path ) == 0, "snapshot not saved" );
+	free_xml( root );
+
+	char* image = read_file( path, &len );
+	CHECK( image != NULL, "snapshot not read back" );
+	if ( !image ) return;
+
+	root = xml_open_snapshot( path );
+	CHECK( root && xml_count( root, "//item/name" ) > 0, "snapshot not opened" );
+	free_xml( root );
+
+	uint64_t size = len / 2;
+	char* copy = malloc( len );
+
+	memcpy( copy, image, len );
+	memcpy( copy + 24, &size, sizeof( size ) );
+	write_file( path, copy, size );
+
+	CHECK( !xml_open_snapshot( path ), "truncated snapshot opened" );
+
+	for ( int i = 0; i < 14; i++ ) {
+
+		static const uint64_t garbage[] = { 0, 1, 8, 1u << 20, UINT64_MAX / 8 };
+
+		for ( int j = 0; j < 5; j++ ) {
+
+			uint64_t word;
+
+			memcpy( copy, image, len );
+			memcpy( &word, copy + 32 + 8 * i, sizeof( word ) );
+
+			if ( word == garbage[j] ) continue;
+			if ( i == 13 && !word ) continue; // no postings
+
+			memcpy( copy + 32 + 8 * i, &garbage[j], sizeof( word ) );
+			write_file( path, copy, len );
+
+			root = xml_open_snapshot( path );
+			CHECK( !root, "snapshot with word %d set to %llu opened", i,
+			       (unsigned long long)garbage[j] );
+			free_xml( root );
+		}
+	}
+
+	remove( path );
+	free( copy );
+	free( image );
+	free( buf.data );
+}
+
+
+/*
+ * Loads buf with every loader but the snapshot one: load_root those that
+ * build a tree, and load_count gets the number of elements named a, or of
+ * table nodes, or -1 when loading fails.
+ */
+enum loader { SEQUENTIAL, PARALLEL, MARKS, PUSH, TABLE, LOADERS };
+
+static const char* loaders[] = { "sequential", "parallel", "marks", "push",
+                                 "table" };
+
+static struct xml_element* load_root ( enum loader loader,
+                                       const struct buffer* buf,
+                                       struct xml_options* opt ) {
+
+	struct xml_element* root = NULL;
+
+	opt->threads = loader == PARALLEL ? 4 : 0;
+
+	switch ( loader ) {
+
+		case MARKS: {
+
+			struct xml_marks* marks = xml_mark( buf->data, buf->len );
+
+			if ( marks ) root = load_xml_marks( marks, opt );
+			free_xml_marks( marks );
+			break;
+		}
+
+		case PUSH: {
+
+			struct xml_parser* parser = new_xml_parser( opt );
+			int failed = 0;
+
+			for ( size_t i = 0; i < buf->len && !failed; i += 4096 )
+				failed = xml_parser_feed( parser, buf->data + i,
+				                          buf->len - i < 4096 ? buf->len - i
+				                                              : 4096 );
+
+			if ( !failed && xml_parser_finish( parser ) == 0 )
+				root = xml_parser_root( parser );
+
+			free_xml_parser( parser );
+			break;
+		}
+
+		default:
+			root = load_xml_buffer_opt( buf->data, buf->len, opt );
+			break;
+	}
+
+	return root;
+}
+
+
+static long load_count ( enum loader loader, const struct buffer* buf,
+                         int max_depth ) {
+
+	struct xml_options opt;
+	long count = -1;
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.max_depth = max_depth;
+
+	if ( loader == TABLE ) {
+
+		struct xml_table* table = load_xml_table( buf->data, buf->len,
+		                                          &opt );
+		if ( table ) count = table->len;
+		free_xml_table( table );
+		return count;
+	}
+
+	struct xml_element* root = load_root( loader, buf, &opt );
+
+	if ( root ) count = xml_count( root, "//a" );
+	free_xml( root );
+
+	return count;
+}
+
+
+/*
+ * Nothing recurses on the depth or the width of a document: these run on
+ * a thread with a 256 kB stack.
+ */
+static void* check_shapes ( void* arg ) {
+
+	struct buffer buf = { NULL, 0, 0 };
+	const int deep = 100000, wide = 1000000, attrs = 200000;
+
+	(void)arg;
+
+	for ( int i = 0; i < deep; i++ ) put( &buf, "<a>" );
+	for ( int i = 0; i < deep; i++ ) put( &buf, "</a>" );
+
+	for ( int l = 0; l < LOADERS; l++ ) {
+
+		long expected = l == TABLE ? deep + 1 : deep;
+
+		CHECK( load_count( l, &buf, 0 ) == expected,
+		       "%s: %d nested elements", loaders[l], deep );
+		CHECK( load_count( l, &buf, deep ) == expected,
+		       "%s: %d nested elements, max_depth %d", loaders[l], deep, deep );
+		CHECK( load_count( l, &buf, deep - 1 ) == -1,
+		       "%s: %d nested elements, max_depth %d", loaders[l], deep,
+		       deep - 1 );
+	}
+
+	buf.len = 0;
+	put( &buf, "<r>" );
+	for ( int i = 0; i < wide; i++ ) put( &buf, "<a/>" );
+	put( &buf, "</r>" );
+
+	for ( int l = 0; l < LOADERS; l++ )
+		CHECK( load_count( l, &buf, 2 ) == ( l == TABLE ? wide + 2 : wide ),
+		       "%s: %d siblings", loaders[l], wide );
+
+	buf.len = 0;
+	put( &buf, "<a" );
+	for ( int i = 0; i < attrs; i++ ) put( &buf, " x%d='%d'", i, i );
+	put( &buf, "/>" );
+
+	for ( int l = 0; l < LOADERS; l++ )
+		CHECK( load_count( l, &buf, 1 ) == ( l == TABLE ? attrs + 2 : 1 ),
+		       "%s: %d attributes", loaders[l], attrs );
+
+	free( buf.data );
+
+	return NULL;
+}
+
+
+/*
+ * max_depth counts the root element as 1
+ */
+static void check_max_depth ( void ) {
+
+	struct buffer flat = { NULL, 0, 0 }, nested = { NULL, 0, 0 };
+
+	put( &flat, "<a/>" );
+	put( &nested, "<a><a/></a>" );
+
+	for ( int l = 0; l < LOADERS; l++ ) {
+
+		CHECK( load_count( l, &flat, 1 ) == ( l == TABLE ? 2 : 1 ),
+		       "%s: max_depth 1 refuses <a/>", loaders[l] );
+		CHECK( load_count( l, &nested, 1 ) == -1,
+		       "%s: max_depth 1 accepts <a><a/></a>", loaders[l] );
+		CHECK( load_count( l, &nested, 2 ) == ( l == TABLE ? 3 : 2 ),
+		       "%s: max_depth 2 refuses <a><a/></a>", loaders[l] );
+	}
+
+	free( flat.data );
+	free( nested.data );
+}
+
+
+/*
+ * threads reading the same lazy values at once all find them decoded
+ */
+struct value_reader {
+
+	void** lazy;
+	void** eager;
+	int differ;
+};
+
+static void* read_values ( void* arg ) {
+
+	struct value_reader* reader = arg;
+
+	for ( int i = 0; reader->lazy[i] && reader->eager[i]; i++ ) {
+
+		int len, eager_len;
+		const char* value = xml_value( reader->lazy[i], &len );
+		const char* eager = xml_value( reader->eager[i], &eager_len );
+
+		if ( len != eager_len || ( len && memcmp( value, eager, len ) != 0 ) )
+			reader->differ++;
+	}
+
+	return NULL;
+}
+
+
+static void check_lazy_values ( void ) {
+
+	static const char* queries[] = { "//*", "//@*" };
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+
+	gen_document( &buf, 64 * 1024 );
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.decode = XML_DECODE;
+
+	struct xml_element* eager = load_xml_buffer_opt( buf.data, buf.len, &opt );
+
+	opt.decode = XML_DECODE_LAZY;
+	opt.lazy_values = 1;
+
+	struct xml_element* lazy = load_xml_buffer_opt( buf.data, buf.len, &opt );
+
+	CHECK( eager && lazy, "lazy values: document does not load" );
+
+	for ( int q = 0; q < 2 && eager && lazy; q++ ) {
+
+		struct value_reader readers[4];
+		pthread_t threads[4];
+		bool started[4];
+		void** lazy_list = xml_get( lazy, queries[q] );
+		void** eager_list = xml_get( eager, queries[q] );
+
+		CHECK( lazy_list && eager_list, "%s: query failed", queries[q] );
+
+		if ( !lazy_list || !eager_list ) {
+			free_xml_list( lazy_list );
+			free_xml_list( eager_list );
+			continue;
+		}
+
+		for ( int t = 0; t < 4; t++ ) {
+
+			readers[t] = (struct value_reader){ lazy_list, eager_list, 0 };
+			started[t] = pthread_create( threads + t, NULL, read_values,
+			                             readers + t ) == 0;
+		}
+
+		for ( int t = 0; t < 4; t++ ) {
+
+			if ( started[t] ) pthread_join( threads[t], NULL );
+			else read_values( readers + t );
+
+			CHECK( readers[t].differ == 0, "%s: %d lazy values differ",
+			       queries[q], readers[t].differ );
+		}
+
+		free_xml_list( lazy_list );
+		free_xml_list( eager_list );
+	}
+
+	free_xml( eager );
+	free_xml( lazy );
+	free( buf.data );
+}
+
+
+/*
+ * the ids of the nodes a query finds, in order, or "NULL" when it fails
+ */
+static void query_ids ( struct xml_element* root, const char* query,
+                        char* ids, size_t size ) {
+
+	void** list = xml_get( root, query );
+	size_t len = 0;
+
+	ids[0] = 0;
+
+	if ( !list ) {
+		snprintf( ids, size, "NULL" );
+		return;
+	}
+
+	for ( void** node = list; *node && len < size; node++ ) {
+
+		const struct xml_attribute* id = ((struct xml_element*)*node)->attr;
+
+		len += snprintf( ids + len, size - len, "%s%.*s", len ? " " : "",
+		                 id ? id->value_len : 1, id ? id->value : "-" );
+	}
+
+	free_xml_list( list );
+}
+
+
+/*
+ * predicates count positions along the axis of their step, backwards on
+ * reverse axes, and among the matches of the predicates before them
+ */
+static void check_predicates ( void ) {
+
+	static const char* document =
+		"<r><a i='1'/><b i='b'/><a i='2' k='v'/>"
+		"<c i='c'><a i='3' k='v'/><a i='4'/></c><a i='5' k='v'/></r>";
+
+	static const char* queries[][2] = {
+		{ "//a[1]", "1 3" },
+		{ "a[1]", "1 3" },
+		{ "/r/a[2]", "2" },
+		{ "//a[last()]", "4 5" },
+		{ "//a[@k='v'][1]", "2 3" },
+		{ "//a[1][@k='v']", "3" },
+		{ "//c/preceding-sibling::*[1]", "2" },
+		{ "//c/preceding-sibling::*[3]", "1" },
+		{ "//a[@i='4']/ancestor::*[1]", "c" },
+		{ "//a[@i='4']/ancestor::*[2]", "-" },
+		{ "/ancestor::r", "" },
+		{ "/ancestor-or-self::*", "" },
+		{ "//a[1]x", "NULL" },
+		{ "a[1]x", "NULL" },
+		{ "a[1]b/c", "NULL" },
+		{ "[]", "NULL" },
+		{ "[1][]", "NULL" },
+		{ "a[]", "NULL" },
+	};
+
+	struct xml_element* root = load_xml_buffer( document, strlen( document ) );
+	char ids[64];
+
+	CHECK( root != NULL, "predicates: document not loaded" );
+	if ( !root ) return;
+
+	for ( size_t i = 0; i < sizeof( queries )/sizeof( queries[0] ); i++ ) {
+
+		query_ids( root, queries[i][0], ids, sizeof( ids ) );
+
+		CHECK( strcmp( ids, queries[i][1] ) == 0, "%s finds %s, not %s",
+		       queries[i][0], ids, queries[i][1] );
+	}
+
+	free_xml( root );
+}
+
+
+/*
+ * The pull reader reports the tree the loader builds: its elements and
+ * attributes in document order, and the last text of every element as its
+ * value. The event parser reports what the reader does, however the input
+ * is cut, and skipping an element hides all of its descendants.
+ */
+static void put_event ( struct buffer* buf, const struct xml_event* ev ) {
+
+	put( buf, "%d %d %.*s=%.*s %d\n", ev->type, ev->depth,
+	     ev->name ? ev->name_len : 0, ev->name ? ev->name : "",
+	     ev->value ? ev->value_len : 0, ev->value ? ev->value : "",
+	     ev->refs );
+}
+
+
+static void put_parser_event ( const struct xml_event* ev, void* ctx ) {
+
+	put_event( ctx, ev );
+}
+
+
+static bool same_value ( const char* x, int x_len, const char* y,
+                         int y_len ) {
+
+	return x_len == y_len && ( !x_len || memcmp( x, y, x_len ) == 0 );
+}
+
+
+static int read_against_tree ( const struct buffer* buf, void** elems,
+                               struct buffer* events ) {
+
+	struct xml_reader* reader = new_xml_reader( buf->data, buf->len );
+	struct xml_element* open[64];
+	struct xml_attribute* attr = NULL;
+	const char* text[64];
+	int text_len[64];
+	struct xml_event ev;
+	int differ = 0, top = 0;
+	bool lost = false;
+
+	events->len = 0;
+
+	while ( !lost && xml_reader_next( reader, &ev ) < XML_END_DOCUMENT ) {
+
+		put_event( events, &ev );
+
+		switch ( ev.type ) {
+
+			case XML_START_ELEMENT: {
+
+				struct xml_element* elem = *elems ? *elems++ : NULL;
+
+				if ( !elem || top == 64 || ev.depth != top + 1 ||
+				     !same_value( ev.name, ev.name_len, elem->name,
+				                  elem->name_len ) ) {
+					lost = true;
+					break;
+				}
+
+				open[ top ] = elem;
+				text[ top ] = NULL;
+				text_len[ top++ ] = 0;
+				attr = elem->attr;
+				break;
+			}
+
+			case XML_ATTRIBUTE:
+				if ( !attr || !same_value( ev.name, ev.name_len, attr->name,
+				                           attr->name_len ) ||
+				     !same_value( ev.value, ev.value_len, attr->value,
+				                  attr->value_len ) )
+					differ++;
+				if ( attr ) attr = attr->next;
+				break;
+
+			case XML_TEXT:
+				if ( !top ) differ++;
+				else {
+					text[ top - 1 ] = ev.value;
+					text_len[ top - 1 ] = ev.value_len;
+				}
+				break;
+
+			case XML_END_ELEMENT:
+				if ( !top ) {
+					lost = true;
+					break;
+				}
+				top--;
+				if ( !same_value( text[ top ], text_len[ top ],
+				                  open[ top ]->value, open[ top ]->value_len ) )
+					differ++;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	put_event( events, &ev );
+
+	if ( ev.type != XML_END_DOCUMENT || *elems || top ) differ++;
+
+	free_xml_reader( reader );
+
+	return differ;
+}
+
+
+static void check_reader ( void ) {
+
+	struct buffer buf = { NULL, 0, 0 }, events = { NULL, 0, 0 },
+	              pushed = { NULL, 0, 0 };
+
+	for ( int doc = 0; doc < 8; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		struct xml_element* root = load_xml_buffer( buf.data, buf.len );
+		void** elems = xml_get( root, "//*" );
+
+		CHECK( root && elems, "reader: document %d does not load", doc );
+		if ( !elems ) {
+			free_xml( root );
+			continue;
+		}
+
+		int differ = read_against_tree( &buf, elems, &events );
+
+		CHECK( differ == 0, "reader: document %d, %d nodes differ from the "
+		       "tree", doc, differ );
+
+		for ( size_t chunk = 1; chunk <= 4096; chunk *= 8 ) {
+
+			struct xml_parser* parser = new_xml_event_parser( put_parser_event,
+			                                                  &pushed );
+			int failed = 0;
+
+			pushed.len = 0;
+
+			for ( size_t i = 0; i < buf.len && !failed; i += chunk )
+				failed = xml_parser_feed( parser, buf.data + i,
+				                          buf.len - i < chunk ? buf.len - i
+				                                              : chunk );
+
+			CHECK( !failed && xml_parser_finish( parser ) == 0 &&
+			       pushed.len == events.len &&
+			       memcmp( pushed.data, events.data, events.len ) == 0,
+			       "reader: document %d, chunks of %zu: events differ", doc,
+			       chunk );
+
+			free_xml_parser( parser );
+		}
+
+		struct xml_reader* reader = new_xml_reader( buf.data, buf.len );
+		struct xml_event ev;
+		int seen = 0;
+
+		while ( xml_reader_next( reader, &ev ) < XML_END_DOCUMENT )
+			if ( ev.type == XML_START_ELEMENT ) {
+				seen++;
+				if ( same_value( ev.name, ev.name_len, "item", 4 ) &&
+				     xml_reader_skip( reader ) != XML_END_ELEMENT )
+					break;
+			}
+
+		int shown = 0;
+
+		for ( void** node = elems; *node; node++ ) {
+
+			struct xml_element* father = ((struct xml_element*)*node)->father;
+
+			for ( ; father && father->name &&
+			        strcmp( father->name, "item" ) != 0;
+			      father = father->father ) ;
+
+			if ( !father || !father->name ) shown++;
+		}
+
+		CHECK( ev.type == XML_END_DOCUMENT && seen == shown,
+		       "reader: document %d, skipping items shows %d elements, "
+		       "not %d", doc, seen, shown );
+
+		free_xml_reader( reader );
+		free_xml_list( elems );
+		free_xml( root );
+	}
+
+	free( pushed.data );
+	free( events.data );
+	free( buf.data );
+}
+
+
+/*
+ * Streaming a plan finds what xml_get does on the tree: the attributes in
+ * document order and the elements as they end, with their text as value.
+ */
+struct stream_matches {
+
+	struct buffer elems;
+	struct buffer attrs;
+};
+
+static void put_match ( const struct xml_event* ev, void* ctx ) {
+
+	struct stream_matches* matches = ctx;
+
+	put( ev->type == XML_ATTRIBUTE ? &matches->attrs : &matches->elems,
+	     "%.*s=%.*s\n", ev->name_len, ev->name,
+	     ev->value ? ev->value_len : 0, ev->value ? ev->value : "" );
+}
+
+
+static int cmp_end ( const void* x, const void* y ) {
+
+	const struct xml_element* a = *(void* const*)x;
+	const struct xml_element* b = *(void* const*)y;
+
+	// an element ends after its descendants, which share its end
+	if ( a->end != b->end ) return a->end < b->end ? -1 : 1;
+	return a->order > b->order ? -1 : a->order < b->order;
+}
+
+
+static void check_stream ( void ) {
+
+	static const char* queries[] = { "//item", "/root/*", "//a/b",
+	                                 "item/name", "//item//name", "//*",
+	                                 "/*/*/item", "//name/@a0", "//*/@a1",
+	                                 "/root//x/self::*", "//x/self::x",
+	                                 "//value/@*" };
+
+	struct buffer buf = { NULL, 0, 0 }, tree = { NULL, 0, 0 };
+	struct stream_matches matches = { { NULL, 0, 0 }, { NULL, 0, 0 } };
+	const int len = sizeof( queries )/sizeof( queries[0] );
+
+	for ( int doc = 0; doc < 4; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		struct xml_element* root = load_xml_buffer( buf.data, buf.len );
+
+		for ( int q = 0; q < len && root; q++ ) {
+
+			struct xml_plan* plan = xml_compile( queries[q] );
+			struct xml_reader* reader = new_xml_reader( buf.data, buf.len );
+			void** list = xml_exec( plan, root );
+			int n = 0;
+
+			matches.elems.len = matches.attrs.len = 0;
+
+			int ret = xml_stream( plan, reader, put_match, &matches );
+
+			// the status of attributes has 2 set; elements are kept apart
+			tree.len = 0;
+			for ( int i = 0; list && list[i]; i++ ) {
+
+				struct xml_attribute* attr = list[i];
+
+				if ( attr->status & 2 )
+					put( &tree, "%s=%.*s\n", attr->name, attr->value_len,
+					     attr->value_len ? attr->value : "" );
+				else
+					list[ n++ ] = attr;
+			}
+
+			CHECK( ret == 0 && list &&
+			       same_value( tree.data, tree.len, matches.attrs.data,
+			                   matches.attrs.len ),
+			       "stream: document %d, %s: attributes differ", doc,
+			       queries[q] );
+
+			if ( list ) qsort( list, n, sizeof( void* ), cmp_end );
+
+			tree.len = 0;
+			for ( int i = 0; i < n; i++ ) {
+
+				struct xml_element* elem = list[i];
+
+				put( &tree, "%s=%.*s\n", elem->name, elem->value_len,
+				     elem->value_len ? elem->value : "" );
+			}
+
+			CHECK( ret == 0 && list &&
+			       same_value( tree.data, tree.len, matches.elems.data,
+			                   matches.elems.len ),
+			       "stream: document %d, %s: elements differ", doc,
+			       queries[q] );
+
+			free_xml_list( list );
+			free_xml_reader( reader );
+			free_xml_plan( plan );
+		}
+
+		free_xml( root );
+	}
+
+	// backward axes and predicates are refused
+	struct xml_plan* plan = xml_compile( "//item/.." );
+	struct xml_reader* reader = new_xml_reader( buf.data, buf.len );
+
+	CHECK( xml_stream( plan, reader, put_match, &matches ) == -1,
+	       "stream: //item/.. is streamed" );
+
+	free_xml_reader( reader );
+	free_xml_plan( plan );
+
+	plan = xml_compile( "//item[1]" );
+	reader = new_xml_reader( buf.data, buf.len );
+
+	CHECK( xml_stream( plan, reader, put_match, &matches ) == -1,
+	       "stream: //item[1] is streamed" );
+
+	free_xml_reader( reader );
+	free_xml_plan( plan );
+
+	free( matches.elems.data );
+	free( matches.attrs.data );
+	free( tree.data );
+	free( buf.data );
+}
+
+
+/*
+ * Loading from marks builds the tree load_xml_buffer does and fails where
+ * it fails, and skipping from the start tag of an element jumps over the
+ * start tags of all of its descendants.
+ */
+static bool is_start_tag ( const struct xml_marks* marks, size_t i ) {
+
+	const char* p = marks->buffer + marks->pos[i];
+
+	return p[0] == '<' && !strchr( "/!?", p[1] );
+}
+
+
+static void check_marks ( void ) {
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+
+	for ( int doc = 0; doc < 8; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		for ( int mode = 0; mode < 3; mode++ ) {
+
+			memset( &opt, 0, sizeof( opt ) );
+			opt.decode = mode == 1 ? XML_DECODE : 0;
+			opt.lazy_values = mode == 2;
+
+			size_t len = doc % 4 == 3 ? buf.len / 2 : buf.len;
+			struct xml_marks* marks = xml_mark( buf.data, len );
+			struct xml_element* base = load_xml_buffer_opt( buf.data, len,
+			                                                &opt );
+			struct xml_element* root = marks ? load_xml_marks( marks, &opt )
+			                                 : NULL;
+
+			CHECK( !base == !root && ( !root || same_tree( base, root ) ),
+			       "marks: document %d, mode %d: trees differ", doc, mode );
+
+			free_xml( root );
+			free_xml( base );
+			free_xml_marks( marks );
+		}
+
+		struct xml_marks* marks = xml_mark( buf.data, buf.len );
+		struct xml_element* root = load_xml_buffer( buf.data, buf.len );
+		void** elems = xml_get( root, "//*" );
+		int k = 0, differ = 0;
+
+		CHECK( marks && elems, "marks: document %d not marked", doc );
+
+		for ( size_t i = 0; marks && elems && i < marks->count; i++ ) {
+
+			if ( !is_start_tag( marks, i ) ) continue;
+
+			struct xml_element* elem = elems[ k ];
+			size_t skip = xml_marks_skip( marks, i );
+			int starts = 0, inside = 1;
+
+			for ( size_t j = i; j < skip; j++ )
+				starts += is_start_tag( marks, j );
+
+			for ( ; elems[ k + inside ] &&
+			        ((struct xml_element*)elems[ k + inside ])->order <=
+			        elem->end; inside++ ) ;
+
+			if ( starts != inside ) differ++;
+			if ( !elems[ ++k ] ) break;
+		}
+
+		if ( elems && elems[k] ) differ++;
+
+		CHECK( differ == 0, "marks: document %d, %d elements skipped wrong",
+		       doc, differ );
+
+		free_xml_list( elems );
+		free_xml( root );
+		free_xml_marks( marks );
+	}
+
+	free( buf.data );
+}
+
+
+/*
+ * A node table holds the tree node for node, by order, and its queries
+ * find the node numbers of what xml_get finds, from any context.
+ */
+static bool same_orders ( void** list, const uint32_t* nodes ) {
+
+	if ( !list || !nodes ) return false;
+
+	for ( ; *list && *nodes; list++, nodes++ )
+		if ( (uint32_t)((struct xml_element*)*list)->order != *nodes )
+			return false;
+
+	return !*list && !*nodes;
+}
+
+
+static int table_differs ( const struct xml_table* table, void** nodes ) {
+
+	int differ = 0;
+
+	for ( ; *nodes; nodes++ ) {
+
+		const struct xml_element* node = *nodes;
+		uint32_t i = node->order;
+		bool attr = node->status & 2;
+
+		if ( i >= table->len || table->kind[i] != ( attr ? 2 : 1 ) ||
+		     table->father[i] != (uint32_t)node->father->order ||
+		     table->name_id[i] != node->name_id ||
+		     ( !attr && table->end[i] != (uint32_t)node->end ) ||
+		     ( table->value[i] == XML_NIL ? node->value_len != 0
+		       : !same_value( table->buffer + table->value[i],
+		                      table->value_len[i], node->value,
+		                      node->value_len ) ) )
+			differ++;
+	}
+
+	return differ;
+}
+
+
+static void check_table ( void ) {
+
+	static const char* queries[] = { "//item", "/root/*", "//a/b",
+	                                 "item/name", "//*/@a1",
+	                                 "//value/parent::*", "//x/ancestor::item",
+	                                 "//b/following-sibling::*",
+	                                 "//name/preceding::x",
+	                                 "//item/following::*/@*" };
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+	const int len = sizeof( queries )/sizeof( queries[0] );
+
+	memset( &opt, 0, sizeof( opt ) );
+
+	for ( int doc = 0; doc < 4; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		// one name table, for name ids to match
+		opt.names = new_xml_names();
+
+		struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len,
+		                                                &opt );
+		struct xml_table* table = load_xml_table( buf.data, buf.len, &opt );
+		void** elems = xml_get( root, "//*" );
+		void** attrs = xml_get( root, "//*/@*" );
+
+		CHECK( root && table && elems && attrs,
+		       "table: document %d does not load", doc );
+
+		if ( root && table && elems && attrs ) {
+
+			CHECK( table->len == (uint32_t)root->end + 1 &&
+			       table->kind[0] == 4 && table->father[0] == XML_NIL,
+			       "table: document %d has %u nodes, not %d", doc,
+			       table->len, root->end + 1 );
+
+			int differ = table_differs( table, elems ) +
+			             table_differs( table, attrs );
+
+			CHECK( differ == 0, "table: document %d, %d nodes differ", doc,
+			       differ );
+
+			for ( int q = 0; q < len; q++ ) {
+
+				void** list = xml_get( root, queries[q] );
+				uint32_t* nodes = xml_table_get( table, 0, queries[q] );
+
+				CHECK( same_orders( list, nodes ), "table: document %d, %s: "
+				       "nodes differ", doc, queries[q] );
+
+				free( nodes );
+				free_xml_list( list );
+			}
+
+			// and from every item
+			differ = 0;
+
+			for ( void** elem = elems; *elem; elem++ ) {
+
+				struct xml_element* item = *elem;
+
+				if ( strcmp( item->name, "item" ) != 0 ) continue;
+
+				void** list = xml_get( item, "name/parent::*/*" );
+				uint32_t* nodes = xml_table_get( table, item->order,
+				                                 "name/parent::*/*" );
+
+				differ += !same_orders( list, nodes );
+
+				free( nodes );
+				free_xml_list( list );
+			}
+
+			CHECK( differ == 0, "table: document %d, name/parent::*/* differs "
+			       "from %d items", doc, differ );
+
+			CHECK( !xml_table_get( table, 0, "//item[1]" ),
+			       "table: //item[1] runs" );
+		}
+
+		free_xml_list( elems );
+		free_xml_list( attrs );
+		free_xml_table( table );
+		free_xml( root );
+		free_xml_names( opt.names );
+	}
+
+	free( buf.data );
+}
+
+
+/*
+ * Postings change how descendant, following and preceding steps find
+ * their nodes, never which: queries find the same nodes with them, from
+ * the meta root or any element, however the document was loaded.
+ */
+static bool same_nodes ( void* const* x, void* const* y ) {
+
+	if ( !x || !y ) return false;
+
+	for ( ; *x && *y; x++, y++ )
+		if ( ((struct xml_element*)*x)->order !=
+		     ((struct xml_element*)*y)->order )
+			return false;
+
+	return !*x && !*y;
+}
+
+
+static void check_postings ( void ) {
+
+	static const char* queries[] = { "//name", "//item//x", "/root//value",
+	                                 "item//name/@a0", "//b/following::x",
+	                                 "//x/preceding::item",
+	                                 "//value/descendant::*",
+	                                 "//a/descendant-or-self::a",
+	                                 "//item[2]//name" };
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+	const int len = sizeof( queries )/sizeof( queries[0] );
+
+	for ( int doc = 0; doc < 4; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		memset( &opt, 0, sizeof( opt ) );
+
+		struct xml_element* base = load_xml_buffer_opt( buf.data, buf.len,
+		                                                &opt );
+		void** items = xml_get( base, "//item" );
+
+		for ( int threads = 1; threads <= 4; threads += 3 ) {
+
+			opt.postings = 1;
+			opt.threads = threads;
+
+			struct xml_element* root = load_xml_buffer_opt( buf.data,
+			                                                buf.len, &opt );
+			void** others = xml_get( root, "//item" );
+
+			CHECK( base && root && items && others,
+			       "postings: document %d does not load", doc );
+			if ( !base || !root || !items || !others ) {
+				free_xml_list( others );
+				free_xml( root );
+				continue;
+			}
+
+			for ( int q = 0; q < len; q++ ) {
+
+				void** x = xml_get( base, queries[q] );
+				void** y = xml_get( root, queries[q] );
+				int differ = !same_nodes( x, y );
+
+				free_xml_list( x );
+				free_xml_list( y );
+
+				for ( int i = 0; items[i] && others[i]; i++ ) {
+
+					x = xml_get( items[i], queries[q] );
+					y = xml_get( others[i], queries[q] );
+					differ += !same_nodes( x, y );
+
+					free_xml_list( x );
+					free_xml_list( y );
+				}
+
+				CHECK( differ == 0, "postings: document %d, %d threads, %s: "
+				       "%d contexts differ", doc, threads, queries[q],
+				       differ );
+			}
+
+			struct xml_profile profile;
+			void** list = xml_get_profiled( root, "//name", &profile );
+
+			CHECK( list && profile.len > 0 &&
+			       profile.steps[ profile.len - 1 ].used & XML_USED_POSTINGS,
+			       "postings: //name does not use them" );
+
+			free_xml_list( list );
+			free_xml_profile( &profile );
+			free_xml_list( others );
+			free_xml( root );
+		}
+
+		free_xml_list( items );
+		free_xml( base );
+	}
+
+	free( buf.data );
+}
+
+
+/*
+ * Cached lists hold what xml_get finds, are shared while cached and stay
+ * valid after they are evicted, until released: also when threads get
+ * and release them at once, with the cache evicting all the time.
+ */
+struct cache_reader {
+
+	struct xml_element* root;
+	const char** queries;
+	void** expected[4];
+	int differ;
+};
+
+static void* read_cached ( void* arg ) {
+
+	struct cache_reader* reader = arg;
+	unsigned state = (unsigned)(uintptr_t)arg;
+
+	for ( int i = 0; i < 500; i++ ) {
+
+		state = state * 1664525u + 1013904223u;
+
+		int q = ( state >> 8 ) % 4;
+		void* const* list = xml_get_cached( reader->root,
+		                                    reader->queries[q] );
+
+		if ( !same_nodes( list, reader->expected[q] ) )
+			reader->differ++;
+
+		free_xml_cached( list );
+	}
+
+	return NULL;
+}
+
+
+static void check_cache ( void ) {
+
+	static const char* queries[] = { "//item", "//name", "//a/b", "//x/@*" };
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_cache_stats stats;
+	struct xml_options opt;
+
+	gen_document( &buf, 8192 );
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.cache = 2;
+
+	struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len, &opt );
+	struct cache_reader readers[4];
+	void** expected[4];
+
+	for ( int q = 0; q < 4; q++ ) expected[q] = xml_get( root, queries[q] );
+
+	void* const* item = xml_get_cached( root, "//item" );
+	void* const* again = xml_get_cached( root, "//item/" );
+	struct xml_plan* plan = xml_compile( "//item" );
+	void* const* exec = xml_exec_cached( plan, root );
+
+	xml_get_cache_stats( root, &stats );
+
+	CHECK( item && same_nodes( item, expected[0] ) &&
+	       again == item && exec == item, "cache: //item is not shared" );
+	CHECK( stats.hits == 2 && stats.misses == 1 && stats.len == 1,
+	       "cache: %zu hits, %zu misses and %d lists, not 2, 1 and 1",
+	       stats.hits, stats.misses, stats.len );
+
+	// another context is another entry
+	void* const* son = xml_get_cached( expected[0][0], "//item" );
+
+	free_xml_cached( xml_get_cached( root, "//name" ) );
+	free_xml_cached( xml_get_cached( root, "//a/b" ) );
+
+	xml_get_cache_stats( root, &stats );
+
+	CHECK( son && son != item && stats.misses == 4 && stats.len == 2,
+	       "cache: %zu misses and %d lists, not 4 and 2", stats.misses,
+	       stats.len );
+
+	// evicted but held
+	CHECK( same_nodes( item, expected[0] ),
+	       "cache: an evicted list changed" );
+
+	void* const* refill = xml_get_cached( root, "//item" );
+
+	xml_get_cache_stats( root, &stats );
+
+	CHECK( refill && refill != item && stats.misses == 5 &&
+	       same_nodes( refill, expected[0] ),
+	       "cache: //item is not found again" );
+
+	free_xml_cached( refill );
+	free_xml_cached( son );
+	free_xml_cached( exec );
+	free_xml_cached( again );
+	free_xml_cached( item );
+	free_xml_plan( plan );
+
+	pthread_t threads[4];
+	bool started[4];
+
+	for ( int t = 0; t < 4; t++ ) {
+
+		readers[t] = (struct cache_reader){ root, queries, { expected[0],
+		             expected[1], expected[2], expected[3] }, 0 };
+		started[t] = pthread_create( threads + t, NULL, read_cached,
+		                             readers + t ) == 0;
+	}
+
+	for ( int t = 0; t < 4; t++ ) {
+
+		if ( started[t] ) pthread_join( threads[t], NULL );
+		else read_cached( readers + t );
+
+		CHECK( readers[t].differ == 0, "cache: thread %d got %d wrong lists",
+		       t, readers[t].differ );
+	}
+
+	// held past the document's cache
+	void* const* held = xml_get_cached( root, "//name" );
+
+	free_xml( root );
+	free_xml_cached( held );
+
+	for ( int q = 0; q < 4; q++ ) free_xml_list( expected[q] );
+	free( buf.data );
+}
+
+
+/*
+ * Decoding knows the five entities and character references up to
+ * U+10FFFF but the surrogates and U+0000, and copies anything else as is.
+ * Decoded loads hold xml_decode of the values raw loads hold.
+ */
+static void check_decode ( void ) {
+
+	static const char* cases[][2] = {
+		{ "&amp;&lt;&gt;&quot;&apos;", "&<>\"'" },
+		{ "&#65;&#x42;&#x63;", "ABc" },
+		{ "&#xe9;&#8364;", "\xc3\xa9\xe2\x82\xac" },
+		{ "&#x1F600;&#x10FFFF;", "\xf0\x9f\x98\x80\xf4\x8f\xbf\xbf" },
+		{ "&#0;", "&#0;" },
+		{ "&#xD800;&#xDFFF;", "&#xD800;&#xDFFF;" },
+		{ "&#1114112;&#x110000;", "&#1114112;&#x110000;" },
+		{ "&#99999999999999999999;", "&#99999999999999999999;" },
+		{ "&bogus; &#; &#x; &#xg; & &amp", "&bogus; &#; &#x; &#xg; & &amp" },
+		{ "a&#65", "a&#65" },
+	};
+
+	char out[64];
+
+	for ( size_t i = 0; i < sizeof( cases )/sizeof( cases[0] ); i++ ) {
+
+		int len = strlen( cases[i][0] );
+
+		memcpy( out, cases[i][0], len );
+		len = xml_decode( out, len, out );
+
+		CHECK( same_value( out, len, cases[i][1], strlen( cases[i][1] ) ),
+		       "decode: %s gives %.*s", cases[i][0], len, out );
+	}
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_options opt;
+
+	for ( int doc = 0; doc < 5; doc++ ) {
+
+		if ( doc < 4 )
+			gen_document( &buf, 256 + next_random() % 8192 );
+		else {
+			buf.len = 0;
+			put( &buf, "<r a='&#0;&#xD800;' b='&#1114112;&amp;'>" );
+			for ( size_t i = 0; i < sizeof( cases )/sizeof( cases[0] ); i++ )
+				put( &buf, "<t v='%s'>%s</t>", cases[i][0], cases[i][0] );
+			put( &buf, "</r>" );
+		}
+
+		memset( &opt, 0, sizeof( opt ) );
+
+		struct xml_element* raw = load_xml_buffer_opt( buf.data, buf.len,
+		                                               &opt );
+		opt.decode = XML_DECODE;
+		opt.threads = doc % 2 ? 4 : 1;
+
+		struct xml_element* decoded = load_xml_buffer_opt( buf.data,
+		                                                   buf.len, &opt );
+
+		CHECK( raw && decoded, "decode: document %d does not load", doc );
+
+		for ( int q = 0; q < 2 && raw && decoded; q++ ) {
+
+			void** x = xml_get( raw, q ? "//*/@*" : "//*" );
+			void** y = xml_get( decoded, q ? "//*/@*" : "//*" );
+			int differ = 0, i = 0;
+
+			for ( ; x && y && x[i] && y[i]; i++ ) {
+
+				int len, decoded_len;
+				const char* value = xml_value( x[i], &len );
+				const char* decoded_value = xml_value( y[i], &decoded_len );
+				char* copy = malloc( len + 1 );
+
+				len = xml_decode( value, len, copy );
+
+				if ( !same_value( copy, len, decoded_value, decoded_len ) )
+					differ++;
+
+				free( copy );
+			}
+
+			CHECK( x && y && !x[i] && !y[i] && differ == 0,
+			       "decode: document %d, %d %s values differ", doc, differ,
+			       q ? "attribute" : "element" );
+
+			free_xml_list( x );
+			free_xml_list( y );
+		}
+
+		free_xml( raw );
+		free_xml( decoded );
+	}
+
+	free( buf.data );
+}
+
+
+/*
+ * Every loader that builds a tree counts in its stats what the tree holds
+ * and the reader reports, failing or not.
+ */
+static void check_stats ( void ) {
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_load_stats stats;
+	struct xml_options opt;
+
+	for ( int doc = 0; doc < 4; doc++ ) {
+
+		gen_document( &buf, 256 + next_random() % 8192 );
+
+		struct xml_reader* reader = new_xml_reader( buf.data, buf.len );
+		struct xml_event ev;
+		size_t texts = 0, full = 0;
+		int depth = 0;
+
+		while ( xml_reader_next( reader, &ev ) < XML_END_DOCUMENT ) {
+			if ( ev.type == XML_TEXT ) texts++;
+			if ( ev.type == XML_START_ELEMENT ) full++;
+			if ( ev.depth > depth ) depth = ev.depth;
+		}
+
+		free_xml_reader( reader );
+
+		for ( int l = 0; l < TABLE; l++ ) {
+
+			memset( &opt, 0, sizeof( opt ) );
+			opt.stats = &stats;
+			opt.postings = l == SEQUENTIAL;
+
+			struct xml_element* root = load_root( l, &buf, &opt );
+			long elements = xml_count( root, "//*" );
+			long attributes = xml_count( root, "//*/@*" );
+
+			CHECK( root && stats.bytes == buf.len &&
+			       (long)stats.elements == elements &&
+			       (long)stats.attributes == attributes &&
+			       stats.texts == texts && stats.max_depth == depth,
+			       "stats: %s, document %d: %zu bytes, %zu elements, "
+			       "%zu attributes, %zu texts and depth %d, not %zu, %ld, "
+			       "%ld, %zu and %d", loaders[l], doc, stats.bytes,
+			       stats.elements, stats.attributes, stats.texts,
+			       stats.max_depth, buf.len, elements, attributes, texts,
+			       depth );
+
+			CHECK( stats.nodes.count == stats.elements + stats.attributes &&
+			       stats.arena.bytes >= stats.nodes.bytes &&
+			       stats.names.count > 0 &&
+			       stats.postings.count == ( l == SEQUENTIAL ) &&
+			       stats.parse_time >= 0 &&
+			       stats.total_time >= stats.parse_time,
+			       "stats: %s, document %d: memory or times are off",
+			       loaders[l], doc );
+
+			CHECK( l != SEQUENTIAL || stats.values.count == 0,
+			       "stats: %s, document %d: %zu raw values copied",
+			       loaders[l], doc, stats.values.count );
+
+			free_xml( root );
+		}
+
+		// cut short: what was read up to the failure
+		size_t len = buf.len;
+
+		buf.len = len / 2;
+		memset( &opt, 0, sizeof( opt ) );
+		opt.stats = &stats;
+
+		CHECK( !load_root( SEQUENTIAL, &buf, &opt ) &&
+		       stats.bytes == buf.len && stats.elements > 0 &&
+		       stats.elements < full,
+		       "stats: document %d cut short: %zu bytes, %zu elements",
+		       doc, stats.bytes, stats.elements );
+
+		buf.len = len;
+	}
+
+	free( buf.data );
+}
+
+
+/*
+ * Profiled queries find what xml_get does, and their steps chain: each
+ * gets what the one before kept, the last keeps the results, and those
+ * after a step that kept nothing do not run.
+ */
+static int profile_differs ( const struct xml_profile* profile ) {
+
+	int differ = profile->len > 0 && profile->steps[0].input == 1 ? 0 : 1;
+	size_t kept = 1;
+
+	for ( int i = 0; i < profile->len; i++ ) {
+
+		const struct xml_step_profile* step = profile->steps + i;
+
+		if ( !step->axis || !step->name ) differ++;
+		if ( step->input != kept || step->output > step->visited ) differ++;
+
+		if ( !kept && ( step->visited || step->ns ) ) differ++;
+		kept = step->output;
+	}
+
+	return differ + ( kept != profile->results );
+}
+
+
+static void check_profile ( void ) {
+
+	static const struct { const char* query; int len; int preds; } queries[] = {
+		{ "//item", 1, 0 }, { "/root/item/name", 3, 0 },
+		{ "item/name", 3, 0 }, { "//x/ancestor::item/@*", 3, 0 },
+		{ "//item[@a0][1]", 1, 2 }, { "//nothing/item", 2, 0 },
+		{ "//b/following-sibling::x[last()]", 2, 1 },
+	};
+
+	struct buffer buf = { NULL, 0, 0 };
+	struct xml_profile profile;
+	struct xml_options opt;
+	const int len = sizeof( queries )/sizeof( queries[0] );
+
+	gen_document( &buf, 8192 );
+
+	memset( &opt, 0, sizeof( opt ) );
+	opt.index_threshold = -1;
+
+	struct xml_element* root = load_xml_buffer_opt( buf.data, buf.len, &opt );
+
+	for ( int q = 0; q < len && root; q++ ) {
+
+		void** list = xml_get( root, queries[q].query );
+		void** profiled = xml_get_profiled( root, queries[q].query,
+		                                    &profile );
+		size_t results = 0;
+
+		for ( ; list && list[ results ]; results++ ) ;
+
+		CHECK( same_nodes( list, profiled ) && profile.results == results &&
+		       profile.len == queries[q].len &&
+		       profile.steps[ profile.len - 1 ].preds == queries[q].preds &&
+		       profile_differs( &profile ) == 0,
+		       "profile: %s does not add up", queries[q].query );
+
+		free_xml_list( profiled );
+		free_xml_profile( &profile );
+
+		struct xml_plan* plan = xml_compile( queries[q].query );
+
+		profiled = xml_exec_profiled( plan, root, &profile );
+
+		CHECK( same_nodes( list, profiled ) && profile.results == results,
+		       "profile: compiled %s does not add up", queries[q].query );
+
+		free_xml_list( profiled );
+		free_xml_profile( &profile );
+		free_xml_plan( plan );
+		free_xml_list( list );
+	}
+
+	// every list is indexed, so a named child step uses them
+	void** list = xml_get_profiled( root, "/root/item", &profile );
+
+	CHECK( list && profile.len == 2 &&
+	       profile.steps[1].used & XML_USED_INDEX,
+	       "profile: /root/item uses no index" );
+
+	FILE* out = tmpfile();
+	int lines = 0;
+
+	if ( out ) {
+
+		print_xml_profile( out, &profile );
+		rewind( out );
+
+		for ( int c; ( c = fgetc( out ) ) != EOF; ) lines += c == '\n';
+		fclose( out );
+	}
+
+	CHECK( lines == profile.len + 2, "profile: printed in %d lines, not %d",
+	       lines, profile.len + 2 );
+
+	free_xml_list( list );
+	free_xml_profile( &profile );
+	free_xml( root );
+	free( buf.data );
+}
+
+
+int main ( void ) {
+
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	pthread_attr_init( &attr );
+	pthread_attr_setstacksize( &attr, 256 * 1024 );
+
+	if ( pthread_create( &thread, &attr, check_shapes, NULL ) == 0 )
+		pthread_join( thread, NULL );
+	else
+		CHECK( false, "no thread to check shapes on" );
+
+	pthread_attr_destroy( &attr );
+
+	check_max_depth();
+	check_predicates();
+
+	check_parallel();
+	check_lazy_values();
+	check_snapshot();
+	check_reader();
+	check_stream();
+	check_marks();
+	check_table();
+	check_postings();
+	check_cache();
+	check_decode();
+	check_stats();
+	check_profile();
+
+	printf( "%d checks, %d failed\n", checks, failures );
+
+	return failures ? 1 : 0;
+}
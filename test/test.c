@@ -8,12 +8,25 @@
 #include "xml.h"
 
 
+static void print_str ( const char* str, int len ) {
+
+	if ( str )
+		printf( "%.*s", len, str );
+	else
+		printf( "(null)" );
+}
+
+
 static void print_xml_attr ( int level, struct xml_attribute* attr ) {
 
 	if ( !attr ) return;
 
 	for( int i = 0; i < level*3; i++ ) putchar(' ');
-	printf( "(%s, %s)\n", attr->name, attr->value );
+	putchar('(');
+	print_str( attr->name, attr->name_len );
+	printf( ", " );
+	print_str( attr->value, attr->value_len );
+	printf( ")\n" );
 
 	if ( level )
 		print_xml_attr( level, attr->next );
@@ -30,7 +43,10 @@ static void print_xml_node ( int level, struct xml_element* elem ) {
 	}
 
 	for( int i = 0; i < level*3; i++ ) putchar(' ');
-	printf( "%s: %s\n", elem->name, elem->value );
+	print_str( elem->name, elem->name_len );
+	printf( ": " );
+	print_str( elem->value, elem->value_len );
+	putchar('\n');
 
 	print_xml_attr( level + 1, elem->attr );
 	print_xml_node( level + 1, elem->son );
@@ -39,30 +55,6 @@ static void print_xml_node ( int level, struct xml_element* elem ) {
 }
 
 
-static void print_xml_trie ( int level, struct trie_node* node ) {
-
-	if ( !node ) return;
-
-	if ( node->letter > 0 || !level ) {
-		for( int i = 0; i < level*3; i++ ) putchar(' ');
-		if ( level ) putchar( node->letter );
-
-		putchar('[');
-		for ( int i = 0; i < node->len; i++)
-			putchar( abs( ((struct trie_node*)node->list)[i].letter ) );
-		printf( "]\n" );
-
-		for ( int i = 0; i < node->len; i++)
-			print_xml_trie( level + 1, (struct trie_node*)node->list + i );
-	} else {
-		for ( int i = 0; i < node->len; i++) {
-			for( int j = 0; j < level*3; j++ ) putchar(' ');
-			printf( "%s\n", ((struct xml_element**)node->list)[i]->name );
-		}
-	}
-}
-
-
 int main ( void ) {
 
 	struct xml_element* xml_root = load_xml( "test/test.xml" );
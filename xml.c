@@ -4,1218 +4,6545 @@
  * TODO:
  * + Do not ignote <!> & <?> tags --> read_special_tag
  * + Handle namespaces
- * + Handle [] in XPath
- * + Handle this:
- * There are 5 predefined entity references in XML:
- *
- * &lt;		<	less than
- * &gt;		>	greater than
- * &amp;	&	ampersand
- * &apos;	'	apostrophe
- * &quot;	"	quotation mark
  *
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
 #include "xml.h"
 
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define XML_SCAN_X86
+#include <immintrin.h>
+#endif
+
 
 enum STATE {
 	OK,
 	OPEN_TAG, CLOSE_TAG, ISOLATED_TAG, OTHER_TAG,
-	PARSE_ERROR, MEMORY_ERROR
+	INCOMPLETE, PARSE_ERROR, MEMORY_ERROR
 };
 
 
 #define IS_ELEMENT_STATUS       1
 #define IS_ATTRIBUTE_STATUS     2
 #define IS_META_ROOT_STATUS     4
-#define IS_TOUCHED_STATUS       8
 #define IS_NAMESPACE_STATUS    16
 #define IS_COMMENT_STATUS      32
 #define IS_INSTRUCTION_STATUS  64
 #define IF_TEXT_STATUS        128
 
+// what xml_value has yet to do to a value
+#define PENDING_DECODE  1
+#define PENDING_TRIM    2
+#define PENDING_BUSY    4 // being done by another thread
 
-#define TRIE_HEAD_LETTER   (~0)
 
+/*
+ * Lazily built parts of a document are published with these, so that
+ * queries can run on it from many threads at once. The fields involved are
+ * not _Atomic, which rules <stdatomic.h> out.
+ */
+#ifdef __GNUC__
+#define atomic_load_ptr( p )  __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define atomic_cas_ptr( p, expected, desired ) \
+	__atomic_compare_exchange_n( p, expected, desired, false, \
+	                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE )
+#define atomic_add_int( p, n )  __atomic_add_fetch( p, n, __ATOMIC_ACQ_REL )
+#define atomic_load_flag( p )   __atomic_load_n( p, __ATOMIC_ACQUIRE )
+#define atomic_cas_flag( p, expected, desired ) \
+	__atomic_compare_exchange_n( p, expected, desired, false, \
+	                             __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE )
+#define atomic_store_flag( p, v ) \
+	__atomic_store_n( p, v, __ATOMIC_RELEASE )
+#else
+#error "xml.c needs the __atomic builtins of GCC or Clang"
+#endif
+
+
+#define NO_NAME    (-1)
+#define ANY_NAME   (-2)
+
+
+struct cursor {
+
+	const char* cur;
+	const char* end;
+};
 
-static const struct string {
 
-	int len;
-	int max_len;
-	char* str;
+/*
+ * Bump pointer allocator: every node, attribute and index of a document is
+ * carved out of a few large blocks, which are only released all together.
+ */
+#define ARENA_MIN_BLOCK   ( 16 * 1024 )
+#define ARENA_MAX_BLOCK   ( 1024 * 1024 )
 
-} init_str = { 0, 0, NULL };
+union arena_align {
 
+	void* p;
+	long long l;
+	double d;
+	long double ld;
+};
 
-static enum STATE str_push_back ( int c, struct string* str ) {
+#define ARENA_ALIGN  sizeof( union arena_align )
 
-	if ( str->len < 2 || str->len - 2 < str->max_len ) {
+struct arena_block {
 
-		str->max_len = 2*str->len + 2;
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+	union arena_align data[];
+};
 
-		char* aux = realloc( str->str, str->max_len );
-		if ( !aux ) return MEMORY_ERROR;
+struct arena {
 
-		str->str = aux;
-	}
+	struct arena_block* head;
+	size_t next_size;
+};
 
-	str->str[ str->len++ ] = (char)c;
-	str->str[ str->len ] = 0;
-	return OK;
-}
 
+/*
+ * Open addressing hash table from names to ids. slots hold id + 1, or 0
+ * when empty; the names themselves live in the table's own arena.
+ */
+struct name_entry {
+
+	const char* str;
+	int len;
+	unsigned hash;
+};
 
-static const struct ptr_list {
+struct xml_names {
 
 	int len;
 	int max_len;
-	void** list;
+	struct name_entry* entries;
 
-} init_ptr_list = { 0, 0, NULL };
+	int* slots;
+	int slots_len;
 
+	struct arena arena;
+};
 
-static enum STATE ptr_list_push_back ( void* p, struct ptr_list* ptrl ) {
 
-	if ( ptrl->len < 2 || ptrl->len - 2 < ptrl->max_len ) {
+/*
+ * A file mapped into memory, or read whole into data when it can not be
+ */
+struct source {
 
-		ptrl->max_len = 2*ptrl->len + 2;
+	const char* buf;
+	size_t len;
 
-		void* aux = realloc( ptrl->list, ptrl->max_len * sizeof( void* ) );
-		if ( !aux ) return MEMORY_ERROR;
+	void* map;
+	size_t map_len;
 
-		ptrl->list = aux;
-	}
+	char* data;
+};
 
-	ptrl->list[ ptrl->len++ ] = p;
-	ptrl->list[ ptrl->len ] = NULL;
-	return OK;
-}
 
+/*
+ * The meta root of every document is the first member of its
+ * xml_document, which owns the arena its nodes live in and the source
+ * their values point into.
+ */
+#define DEFAULT_INDEX_THRESHOLD  16
 
-static void skip_space ( FILE* file ) {
+struct xml_document {
 
-	int c;
-	do {
-		c = fgetc( file );
-		if ( c == EOF ) return;
-	} while ( isspace(c) );
+	struct xml_element root;
 
-	ungetc( c, file );
-}
+	struct arena arena;
 
+	struct xml_names* names;
+	bool own_names;
 
-static void str_remove_trail_space ( struct string* str ) {
+	int index_threshold;
+	struct index_block* indexes;
+	struct value_block* values;
 
-	for ( ; str->len && isspace( str->str[ str->len - 1 ] ); str->len-- ) ;
+	int max_depth;
+	int decode;
+	bool lazy_values;
 
-	char* aux = realloc( str->str, str->len + 1 );
-	if ( aux ) str->str = aux;
+	bool want_postings;
+	struct postings* postings;
 
-	str->str[ str->len ] = 0;
-}
+	struct result_cache* cache;
+
+	struct xml_load_stats* stats; // the caller's, while loading
+
+	struct source source;
+	bool snapshot; // lives in its source, see xml_open_snapshot
+};
 
 
-static enum STATE read_attr_name ( FILE* file, struct xml_attribute* attr ) {
+/*
+ * The tokenizer. It keeps copies of the names of the open elements to match
+ * end tags against, and nothing else, so the input may be consumed in
+ * pieces.
+ */
+struct name_slice {
 
-	struct string name = init_str;
-	char c;
+	int offset;
+	int len;
+};
 
-	while ( ( c = fgetc( file ) ) != '=' && !isspace(c) ) {
+struct xml_reader {
 
-		if ( c == EOF || str_push_back( c, &name ) != OK ) {
-			free( name.str );
-			return ( c == EOF ) ? PARSE_ERROR : MEMORY_ERROR;
-		}
-	}
+	struct cursor src;
+	struct source source;
 
-	str_remove_trail_space( &name );
-	attr->name = name.str;
+	struct name_slice* stack;
+	int depth;
+	int max_depth;
 
-	ungetc( c, file );
-	skip_space( file );
+	char* names;
+	size_t names_len;
 
-	return OK;
+	bool final; // no more input will follow src
+	bool partial; // src starts inside elements, whose end tags pass through
+	bool in_tag;
+	bool done;
+	bool error;
+	bool raw_values; // untrimmed, see lazy_values
+};
+
+
+static size_t arena_size ( size_t size ) {
+
+	return ( size + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
 }
 
 
-static enum STATE read_attr_value ( FILE* file, struct xml_attribute* attr ) {
+static void* arena_alloc ( struct arena* arena, size_t size ) {
 
-	char d = fgetc( file );
-	if ( d != '\'' && d != '"' ) return PARSE_ERROR;
+	size = arena_size( size );
+
+	struct arena_block* block = arena->head;
+
+	if ( !block || block->size - block->used < size ) {
+
+		if ( !arena->next_size ) arena->next_size = ARENA_MIN_BLOCK;
+
+		size_t block_size = arena->next_size;
 
-	struct string value = init_str;
-	char c;
+		// oversized requests get a block of their own, behind the head
+		if ( size > block_size ) block_size = size;
 
-	while ( ( c = fgetc( file ) ) != d ) {
+		block = malloc( sizeof( struct arena_block ) + block_size );
+		if ( !block ) return NULL;
 
-		if ( c == EOF || str_push_back( c, &value ) != OK ) {
-			free( value.str );
-			return ( c == EOF ) ? PARSE_ERROR : MEMORY_ERROR;
+		block->size = block_size;
+		block->used = 0;
+
+		if ( size > arena->next_size && arena->head ) {
+			block->next = arena->head->next;
+			arena->head->next = block;
+		} else {
+			block->next = arena->head;
+			arena->head = block;
+
+			if ( arena->next_size < ARENA_MAX_BLOCK )
+				arena->next_size *= 2;
 		}
 	}
 
-	str_remove_trail_space( &value );
-	attr->value = value.str;
+	void* ptr = (char*)block->data + block->used;
+	block->used += size;
 
-	return OK;
+	return ptr;
 }
 
 
-static enum STATE read_attr ( FILE* file, struct xml_element* elem ) {
+static void* arena_calloc ( struct arena* arena, size_t size ) {
 
-	enum STATE state;
+	void* ptr = arena_alloc( arena, size );
+	if ( ptr ) memset( ptr, 0, size );
 
-	skip_space( file );
+	return ptr;
+}
 
-	int c = fgetc( file );
 
-	if ( c == EOF || c == '=' ) return PARSE_ERROR;
+/*
+ * moves the blocks of other into arena, behind its head
+ */
+static void arena_adopt ( struct arena* arena, struct arena* other ) {
 
-	if ( c == '/' ) {
-		skip_space( file );
-		c = fgetc( file );
-		return ( c == '>' ) ? ISOLATED_TAG : PARSE_ERROR;
-	}
+	if ( !other->head ) return;
 
-	if ( c == '>' ) return OPEN_TAG;
+	struct arena_block* tail = other->head;
+	while ( tail->next ) tail = tail->next;
 
-	ungetc( c, file );
+	if ( arena->head ) {
+		tail->next = arena->head->next;
+		arena->head->next = other->head;
+	} else {
+		*arena = *other;
+	}
 
-	struct xml_attribute* attr = calloc( 1, sizeof( struct xml_attribute ) );
-	if ( !attr ) return MEMORY_ERROR;
+	other->head = NULL;
+	other->next_size = 0;
+}
 
-	attr->father = elem;
-	attr->status = IS_ATTRIBUTE_STATUS;
 
-	state = read_attr_name( file, attr );
-	if ( state != OK ) {
-		free( attr );
-		return state;
-	}
+/*
+ * adds the blocks of arena and their bytes to usage
+ */
+static void arena_usage ( const struct arena* arena,
+                          struct xml_alloc_stats* usage ) {
 
-	c = fgetc( file );
-	if ( c != '=' ) {
-		free( attr->name );
-		free( attr );
-		return PARSE_ERROR;
+	for ( struct arena_block* i = arena->head; i; i = i->next ) {
+		usage->count++;
+		usage->bytes += sizeof( struct arena_block ) + i->size;
 	}
-	skip_space( file );
+}
 
-	state = read_attr_value( file, attr );
-	if ( state != OK ) {
-		free( attr->name );
-		free( attr );
-		return state;
-	}
-	state = read_attr( file, elem );
 
-	attr->next = elem->attr;
-	elem->attr = attr;
-	if ( attr->next ) attr->next->prev = attr;
+static void arena_free ( struct arena* arena ) {
 
-	return state;
+	while ( arena->head ) {
+		struct arena_block* next = arena->head->next;
+		free( arena->head );
+		arena->head = next;
+	}
+	arena->next_size = 0;
 }
 
 
-static enum STATE read_special_tag ( FILE* file, struct xml_element* elem ) {
+static unsigned hash_name ( const char* str, int len ) {
 
-	(void)elem;
+	unsigned hash = 2166136261u;
 
-	for ( int open = 1; open; ) {
-		char c = fgetc( file );
-		switch ( c ) {
-			case '<': open++; break;
-			case '>': open--; break;
-			case EOF: return PARSE_ERROR;
-		}
-	}
+	for ( int i = 0; i < len; i++ )
+		hash = ( hash ^ (unsigned char)str[i] ) * 16777619u;
 
-	return OTHER_TAG;
+	return hash;
 }
 
 
-static enum STATE read_tag ( FILE* file, struct xml_element* elem ) {
+struct xml_names* new_xml_names ( void ) {
 
-	int c = fgetc( file );
-	if ( c != '<' ) return PARSE_ERROR;
+	return calloc( 1, sizeof( struct xml_names ) );
+}
 
-	c = fgetc( file );
-	if ( c == EOF ) return PARSE_ERROR;
 
-	if( c == '?' || c == '!' )
-		return read_special_tag( file, elem );
+void free_xml_names ( struct xml_names* names ) {
 
-	bool close_tag = false;
-	if ( c == '/' )
-		close_tag = true;
-	else
-		ungetc( c, file );
+	if ( !names ) return;
 
-	skip_space( file );
+	arena_free( &names->arena );
+	free( names->entries );
+	free( names->slots );
+	free( names );
+}
 
-	struct string str = init_str;
-	c = fgetc( file );
 
-	if ( c == '>' )
-		return PARSE_ERROR;
+static int names_slot ( const struct xml_names* names, const char* str,
+                        int len, unsigned hash ) {
 
-	while ( c != '>' && c != '/' && !isspace(c) ) {
+	int mask = names->slots_len - 1;
+	int i = hash & mask;
 
-		if ( c == EOF || str_push_back( c, &str ) != OK ) {
-			free( str.str );
-			return ( c == EOF ) ? PARSE_ERROR : MEMORY_ERROR;
-		}
-		c = fgetc( file );
+	for ( ; names->slots[i]; i = ( i + 1 ) & mask ) {
+
+		const struct name_entry* e = names->entries + names->slots[i] - 1;
+
+		if ( e->hash == hash && e->len == len &&
+		     memcmp( e->str, str, len ) == 0 )
+			break;
 	}
+	return i;
+}
 
-	if ( close_tag ) {
 
-		if ( c == '/' || strcmp( str.str, elem->father->name ) != 0 ) {
-			free( str.str );
-			return PARSE_ERROR;
-		}
+int xml_names_find ( const struct xml_names* names, const char* name,
+                     int len ) {
 
-		if ( c != '>') {
-			skip_space( file );
-			if ( fgetc( file ) != '>' ) {
-				free( str.str );
-				return PARSE_ERROR;
-			}
-		}
-		free( str.str );
-		return CLOSE_TAG;
-	}
+	if ( !names || !names->slots_len ) return NO_NAME;
 
-	str_remove_trail_space( &str );
-	elem->name = str.str;
-	ungetc( c, file );
+	int i = names_slot( names, name, len, hash_name( name, len ) );
 
-	return read_attr( file, elem );
+	return names->slots[i] - 1;
 }
 
 
-static enum STATE read_value ( FILE* file, struct xml_element* elem ) {
+static enum STATE names_grow ( struct xml_names* names ) {
 
-	struct string str = init_str;
-	int c;
+	int slots_len = names->slots_len ? 2 * names->slots_len : 64;
 
-	while ( ( c = fgetc( file ) ) != '<' ) {
+	int* slots = calloc( slots_len, sizeof( int ) );
+	if ( !slots ) return MEMORY_ERROR;
 
-		if ( c == EOF || str_push_back( c, &str ) != OK ) {
-			free( str.str );
-			return ( c == EOF ) ? PARSE_ERROR : MEMORY_ERROR;
-		}
+	for ( int id = 0; id < names->len; id++ ) {
+
+		int i = names->entries[id].hash & ( slots_len - 1 );
+		for ( ; slots[i]; i = ( i + 1 ) & ( slots_len - 1 ) ) ;
+		slots[i] = id + 1;
 	}
 
-	str_remove_trail_space( &str );
-	elem->value = str.str;
-	ungetc( c, file );
+	free( names->slots );
+	names->slots = slots;
+	names->slots_len = slots_len;
 
 	return OK;
 }
 
 
-static enum STATE build_trie_node ( struct trie_node* node, void* list_ptr,
-                                    int len, int level ) {
-
-	char*** list = list_ptr;
-
-	// if leaf
-	if ( level && strcmp( **list, **( list + len - 1 ) ) == 0 ) {
+/*
+ * returns the id of the name, adding it if needed, or NO_NAME when out
+ * of memory
+ */
+static int names_intern ( struct xml_names* names, const char* str, int len,
+                          const char** interned ) {
 
-		node->letter = -node->letter;
-		node->len = len;
-		node->list = malloc( len * sizeof(void*) );
-		if ( !node->list )
-			return MEMORY_ERROR;
+	if ( 2 * ( names->len + 1 ) > names->slots_len )
+		if ( names_grow( names ) != OK ) return NO_NAME;
 
-		memcpy( node->list, list, len * sizeof(void*) );
-		return OK;
-	}
+	unsigned hash = hash_name( str, len );
+	int i = names_slot( names, str, len, hash );
 
-	// malloc sons
-	node->len = 1;
-	for ( char*** i = list + 1; i < list + len; i++ )
-		if ( (**i)[level] != (**(i-1))[level] )
-			node->len++;
+	if ( !names->slots[i] ) {
 
-	node->list = calloc( node->len, sizeof( struct trie_node ) );
-	if ( !node->list ) return MEMORY_ERROR;
+		if ( names->len == names->max_len ) {
 
-	// build trie
-	int letter = (*list[0])[level];
-	int start = 0;
-	int pos = -1;
-	for ( int end = 1; end <= len; end++ ) {
+			int max_len = 2 * names->max_len + 16;
 
-		if ( end == len || (*list[end])[level] != letter ) {
+			void* aux = realloc( names->entries,
+			                     max_len * sizeof( struct name_entry ) );
+			if ( !aux ) return NO_NAME;
 
-			((struct trie_node*)node->list)[++pos].letter = letter;
+			names->entries = aux;
+			names->max_len = max_len;
+		}
 
-			enum STATE state = build_trie_node(
-			                             (struct trie_node*)node->list + pos,
-			                             list + start, end - start, level + 1 );
-			if ( state != OK ) return state;
+		char* copy = arena_alloc( &names->arena, len + 1 );
+		if ( !copy ) return NO_NAME;
 
-			if ( end != len ) letter = (*list[end])[level];
+		memcpy( copy, str, len );
+		copy[len] = 0;
 
-			start = end;
-		}
+		names->entries[ names->len ] = (struct name_entry){ copy, len, hash };
+		names->slots[i] = ++names->len;
 	}
-	return OK;
+
+	if ( interned ) *interned = names->entries[ names->slots[i] - 1 ].str;
+	return names->slots[i] - 1;
 }
 
 
-static int cmp_str_p ( const void *a, const void *b ) {
+/*
+ * Lists with a handler set are not kept: nodes go to the handler instead,
+ * see emit.
+ */
+static const struct ptr_list {
 
-	return strcmp( **(char**const*)a, **(char**const*)b );
-}
+	int len;
+	int max_len;
+	void** list;
 
+	xml_match_handler each;
+	void* ctx;
 
-static enum STATE build_trie ( void* source_list, void** trie ) {
+	bool failed; // out of memory, see ptr_list_fail
 
-	enum STATE state;
+} init_ptr_list = { 0, 0, NULL, NULL, NULL, false };
 
-	if ( !source_list ) return OK;
 
-	struct ptr_list list = init_ptr_list;
+static enum STATE ptr_list_push_back ( void* p, struct ptr_list* ptrl ) {
 
-	for ( struct xml_element* i = source_list; i; i = i->next ) {
-		if ( ptr_list_push_back( i, &list ) != OK ) {
-			free( list.list );
-			return MEMORY_ERROR;
-		}
-	}
+	if ( ptrl->len + 2 > ptrl->max_len ) {
 
-	qsort( list.list, list.len, sizeof(void*), cmp_str_p );
+		ptrl->max_len = 2*ptrl->len + 2;
 
-	*trie = calloc( 1, sizeof( struct trie_node ) );
-	if ( !*trie ) {
-		free( list.list );
-		return MEMORY_ERROR;
+		void* aux = realloc( ptrl->list, ptrl->max_len * sizeof( void* ) );
+		if ( !aux ) return MEMORY_ERROR;
+
+		ptrl->list = aux;
 	}
 
-	((struct trie_node*)(*trie))->letter = TRIE_HEAD_LETTER;
+	ptrl->list[ ptrl->len++ ] = p;
+	ptrl->list[ ptrl->len ] = NULL;
+	return OK;
+}
 
-	state = build_trie_node( *trie, list.list, list.len, 0 );
 
-	free( list.list );
-	if ( state != OK ) free( *trie );
+/*
+ * Scanning kernels. Each one returns the first position in [p, end) that
+ * stops it, or end. find_delim stops at a, b or, if space is set, at any
+ * whitespace; whitespace is what isspace() accepts in the C locale.
+ * mark_mask has bit i set when p[i], of the 64 bytes at p, may be markup.
+ */
+static inline bool is_space ( int c ) {
 
-	return state;
+	return c == ' ' || (unsigned)( c - '\t' ) < 5;
 }
 
 
-static void reverse_son_list ( struct xml_element* elem ) {
-
-	if ( !elem || !elem->son ) return;
+static const char* scalar_find_char ( const char* p, const char* end, int c ) {
 
-	for ( struct xml_element* i = elem->son; i->next; i = i->prev ) {
-		elem->son = i->next;
-		i->next = i->prev;
-		i->prev = elem->son;
-	}
-	elem->son->next = elem->son->prev;
-	elem->son->prev = NULL;
+	for ( ; p < end && *p != c; p++ ) ;
+	return p;
 }
 
 
-static enum STATE xml_post_processing ( struct xml_element* elem ) {
-
-	if ( !elem ) return OK;
+static const char* scalar_skip_space ( const char* p, const char* end ) {
 
-	enum STATE state;
+	for ( ; p < end && is_space( (unsigned char)*p ); p++ ) ;
+	return p;
+}
 
-	reverse_son_list( elem );
 
-	 state = build_trie( elem->son, (void*)&elem->sons_trie );
-	if ( state != OK ) return state;
+static const char* scalar_find_delim ( const char* p, const char* end,
+                                       int a, int b, bool space ) {
 
-	state = build_trie( elem->attr, (void*)&elem->attr_trie );
-	if ( state != OK ) return state;
+	for ( ; p < end; p++ )
+		if ( *p == a || *p == b || ( space && is_space( (unsigned char)*p ) ) )
+			break;
+	return p;
+}
 
-	state = xml_post_processing ( elem->next );
-	if ( state != OK ) return state;
 
-	state = xml_post_processing ( elem->son );
+static inline bool is_mark ( int c ) {
 
-	return state;
+	return c == '<' || c == '>' || c == '=' || c == '/' || c == '"' ||
+	       c == '\'';
 }
 
 
-static enum STATE read_xml ( FILE* file, struct xml_element* elem, bool root ) {
+static uint64_t scalar_mark_mask ( const char* p ) {
 
-	enum STATE state;
+	uint64_t mask = 0;
 
-	while ( true ) {
+	for ( int i = 0; i < 64; i++ )
+		if ( is_mark( p[i] ) )
+			mask |= (uint64_t)1 << i;
 
-		skip_space( file );
+	return mask;
+}
 
-		char c = fgetc( file );
-		if ( c == EOF ) return root ? OK : PARSE_ERROR;
-		ungetc( c, file );
 
-		if ( c == '<' ) {
+#ifdef XML_SCAN_X86
 
-			struct xml_element* son = calloc( 1, sizeof( struct xml_element ) );
-			if ( !son ) return MEMORY_ERROR;
+#define SSE2_TARGET __attribute__(( target( "sse2" ) ))
+#define AVX2_TARGET __attribute__(( target( "avx2" ) ))
 
-			son->father = elem;
-			son->next = elem->son;
-			son->status = IS_ELEMENT_STATUS;
 
-			state = read_tag( file, son );
-			switch ( state ) {
+SSE2_TARGET static inline __m128i sse2_space_mask ( __m128i v ) {
 
-				case OPEN_TAG:
+	__m128i ctl = _mm_sub_epi8( v, _mm_set1_epi8( '\t' ) );
 
-					if ( son->next ) son->next->prev = son;
-					elem->son = son;
+	return _mm_or_si128(
+	           _mm_cmpeq_epi8( v, _mm_set1_epi8( ' ' ) ),
+	           _mm_cmpeq_epi8( _mm_min_epu8( ctl, _mm_set1_epi8( 4 ) ), ctl ) );
+}
 
-					if ( ( state = read_xml ( file, son, false ) ) != OK )
-						return state;
-					break;
 
-				case CLOSE_TAG:
+SSE2_TARGET static const char* sse2_find_char ( const char* p,
+                                                const char* end, int c ) {
 
-					free( son );
-					return OK;
+	__m128i key = _mm_set1_epi8( (char)c );
 
-				case ISOLATED_TAG:
+	for ( ; end - p >= 16; p += 16 ) {
 
-					if ( son->next ) son->next->prev = son;
-					elem->son = son;
-					break;
+		__m128i v = _mm_loadu_si128( (const __m128i*)(const void*)p );
+		int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( v, key ) );
+		if ( mask ) return p + __builtin_ctz( mask );
+	}
+	return scalar_find_char( p, end, c );
+}
 
-				case OTHER_TAG:
 
-					free( son );
-					break;
+SSE2_TARGET static const char* sse2_skip_space ( const char* p,
+                                                 const char* end ) {
 
-				default:
-					if ( son->next ) son->next->prev = son;
-					elem->son = son;
-					return state;
-			}
-		} else {
-			state = read_value( file, elem );
-			if ( state != OK ) return state;
-		}
+	for ( ; end - p >= 16; p += 16 ) {
+
+		__m128i v = _mm_loadu_si128( (const __m128i*)(const void*)p );
+		int mask = _mm_movemask_epi8( sse2_space_mask( v ) ) ^ 0xFFFF;
+		if ( mask ) return p + __builtin_ctz( mask );
 	}
+	return scalar_skip_space( p, end );
 }
 
 
-struct xml_element* load_xml ( const char* name ) {
+SSE2_TARGET static const char* sse2_find_delim ( const char* p,
+                                                 const char* end,
+                                                 int a, int b, bool space ) {
+
+	__m128i ka = _mm_set1_epi8( (char)a );
+	__m128i kb = _mm_set1_epi8( (char)b );
 
-	FILE* file = fopen( name, "r" );
-	if ( !file ) return NULL;
+	for ( ; end - p >= 16; p += 16 ) {
 
-	struct xml_element* root = calloc( 1, sizeof( struct xml_element ) );
+		__m128i v = _mm_loadu_si128( (const __m128i*)(const void*)p );
+		__m128i hit = _mm_or_si128( _mm_cmpeq_epi8( v, ka ),
+		                            _mm_cmpeq_epi8( v, kb ) );
+		if ( space ) hit = _mm_or_si128( hit, sse2_space_mask( v ) );
 
-	if ( !root ) {
-		fclose( file );
-		return root;
+		int mask = _mm_movemask_epi8( hit );
+		if ( mask ) return p + __builtin_ctz( mask );
 	}
+	return scalar_find_delim( p, end, a, b, space );
+}
 
-	root->status = IS_META_ROOT_STATUS;
 
-	enum STATE state;
+SSE2_TARGET static uint64_t sse2_mark_mask ( const char* p ) {
 
-	state = read_xml( file, root, true );
+	uint64_t mask = 0;
 
-	if ( state == OK )
-		state = xml_post_processing( root );
+	for ( int i = 0; i < 64; i += 16 ) {
 
-	if ( state != OK ) {
-		free_xml( root );
-		root = NULL;
+		__m128i v = _mm_loadu_si128( (const __m128i*)(const void*)( p + i ) );
+
+		__m128i hit = _mm_or_si128(
+		    _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '<' ) ),
+		                  _mm_cmpeq_epi8( v, _mm_set1_epi8( '>' ) ) ),
+		    _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '=' ) ),
+		                  _mm_cmpeq_epi8( v, _mm_set1_epi8( '/' ) ) ) );
+		hit = _mm_or_si128( hit,
+		    _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '"' ) ),
+		                  _mm_cmpeq_epi8( v, _mm_set1_epi8( '\'' ) ) ) );
+
+		mask |= (uint64_t)(unsigned)_mm_movemask_epi8( hit ) << i;
 	}
 
-	fclose( file );
-	return root;
+	return mask;
 }
 
 
-static void free_xml_trie ( struct trie_node* node, bool root ) {
-
-	if ( !node ) return;
+AVX2_TARGET static inline __m256i avx2_space_mask ( __m256i v ) {
 
-	if( root || node->letter > 0 )
-		for ( int i = 0; i < node->len; i++ )
-			free_xml_trie( (struct trie_node*)node->list + i, false );
+	__m256i ctl = _mm256_sub_epi8( v, _mm256_set1_epi8( '\t' ) );
 
-	free( node->list );
+	return _mm256_or_si256(
+	        _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ' ' ) ),
+	        _mm256_cmpeq_epi8( _mm256_min_epu8( ctl, _mm256_set1_epi8( 4 ) ),
+	                           ctl ) );
 }
 
 
-static void free_xml_attr ( struct xml_attribute* attr ) {
+AVX2_TARGET static const char* avx2_find_char ( const char* p,
+                                                const char* end, int c ) {
 
-	if ( !attr ) return;
+	__m256i key = _mm256_set1_epi8( (char)c );
 
-	free_xml_attr( attr->next );
+	for ( ; end - p >= 32; p += 32 ) {
 
-	free( attr->name );
-	free( attr->value );
-	free( attr );
+		__m256i v = _mm256_loadu_si256( (const __m256i*)(const void*)p );
+		unsigned mask = _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, key ) );
+		if ( mask ) return p + __builtin_ctz( mask );
+	}
+	return sse2_find_char( p, end, c );
 }
 
 
-void free_xml ( struct xml_element* elem ) {
-
-	if ( !elem ) return;
-
-	free_xml( elem->next );
-	free_xml( elem->son );
-	free_xml_attr( elem->attr );
+AVX2_TARGET static const char* avx2_skip_space ( const char* p,
+                                                 const char* end ) {
 
-	free( elem->name );
-	free( elem->value );
+	for ( ; end - p >= 32; p += 32 ) {
 
-	free_xml_trie( elem->sons_trie, true );
-	free_xml_trie( elem->attr_trie, true );
-	free( elem->sons_trie );
-	free( elem->attr_trie );
-
-	free( elem );
+		__m256i v = _mm256_loadu_si256( (const __m256i*)(const void*)p );
+		unsigned mask = ~(unsigned)_mm256_movemask_epi8( avx2_space_mask( v ) );
+		if ( mask ) return p + __builtin_ctz( mask );
+	}
+	return sse2_skip_space( p, end );
 }
 
 
-static bool xml_element_check ( struct xml_element* elem, const char* name,
-                                int name_len ) {
+AVX2_TARGET static const char* avx2_find_delim ( const char* p,
+                                                 const char* end,
+                                                 int a, int b, bool space ) {
 
-	if ( !elem || !elem->name ) return false;
+	__m256i ka = _mm256_set1_epi8( (char)a );
+	__m256i kb = _mm256_set1_epi8( (char)b );
 
-	if ( name_len == 1 && name[0] == '*' ) return true;
+	for ( ; end - p >= 32; p += 32 ) {
 
-	if ( strncmp( elem->name, name, name_len ) != 0 ) return false;
+		__m256i v = _mm256_loadu_si256( (const __m256i*)(const void*)p );
+		__m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( v, ka ),
+		                               _mm256_cmpeq_epi8( v, kb ) );
+		if ( space ) hit = _mm256_or_si256( hit, avx2_space_mask( v ) );
 
-	return !elem->name[ name_len ];
+		unsigned mask = _mm256_movemask_epi8( hit );
+		if ( mask ) return p + __builtin_ctz( mask );
+	}
+	return sse2_find_delim( p, end, a, b, space );
 }
 
 
-static int cmp_trie ( const void *a, const void *b ) {
-
-	return abs( *(const int*)a ) - abs( *(const int*)b );
-}
+AVX2_TARGET static uint64_t avx2_mark_mask ( const char* p ) {
 
+	uint64_t mask = 0;
 
-static struct trie_node* xml_trie_check ( int level, struct trie_node* node,
-										  const char* name, int name_len ) {
+	for ( int i = 0; i < 64; i += 32 ) {
 
-	if ( !node ) return NULL;
+		__m256i v = _mm256_loadu_si256( (const __m256i*)(const void*)( p + i ) );
 
-	if ( node->letter == 0 ) return node;
+		__m256i hit = _mm256_or_si256(
+		    _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '<' ) ),
+		                     _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '>' ) ) ),
+		    _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '=' ) ),
+		                     _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '/' ) ) ) );
+		hit = _mm256_or_si256( hit,
+		    _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '"' ) ),
+		                     _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\'' ) ) ) );
 
-	if ( level && node->letter < 0 ) {
+		mask |= (uint64_t)(unsigned)_mm256_movemask_epi8( hit ) << i;
+	}
 
-		if ( strncmp( **(char***)node->list + level, name, name_len ) != 0 )
-			return NULL;
+	return mask;
+}
 
-		if ( (**(char***)node->list)[level + name_len] != 0 ) return NULL;
+#endif /* XML_SCAN_X86 */
 
-		return node;
-	}
 
-	int key = *name;
-	return xml_trie_check( level + 1,
-	                       bsearch( &key, node->list, node->len,
-	                                sizeof( struct trie_node ), cmp_trie ),
-	                       name + 1, name_len - 1 );
-}
+static struct scanners {
 
+	const char* (*find_char) ( const char*, const char*, int );
+	const char* (*skip_space) ( const char*, const char* );
+	const char* (*find_delim) ( const char*, const char*, int, int, bool );
+	uint64_t (*mark_mask) ( const char* );
 
-static bool _xml_get_ancestor ( struct ptr_list* plist, struct xml_element* elem,
-                                const char* name, int name_len ) {
+} scan = { scalar_find_char, scalar_skip_space, scalar_find_delim,
+           scalar_mark_mask };
 
-	if ( elem->status & IS_META_ROOT_STATUS ) return true;
-	if ( elem->status & IS_TOUCHED_STATUS   ) return true;
 
-	elem->status |= IS_TOUCHED_STATUS;
+#ifdef XML_SCAN_X86
 
-	bool ret = _xml_get_ancestor( plist, elem->father, name, name_len );
+__attribute__(( constructor )) static void select_scanners ( void ) {
 
-	if ( xml_element_check( elem, name, name_len ) )
-		if ( ptr_list_push_back( elem, plist ) != OK )
-			return false;
+	__builtin_cpu_init();
 
-	return ret;
+	if ( __builtin_cpu_supports( "avx2" ) ) {
+		scan.find_char  = avx2_find_char;
+		scan.skip_space = avx2_skip_space;
+		scan.find_delim = avx2_find_delim;
+		scan.mark_mask  = avx2_mark_mask;
+	} else
+	if ( __builtin_cpu_supports( "sse2" ) ) {
+		scan.find_char  = sse2_find_char;
+		scan.skip_space = sse2_skip_space;
+		scan.find_delim = sse2_find_delim;
+		scan.mark_mask  = sse2_mark_mask;
+	}
 }
 
+#endif
 
-static void _xml_clear_ancestor ( struct xml_element* elem ) {
-
-	if ( elem->status & IS_META_ROOT_STATUS ) return;
-	if ( !( elem->status & IS_TOUCHED_STATUS ) ) return;
 
-	elem->status ^= IS_TOUCHED_STATUS;
+static void skip_space ( struct cursor* src ) {
 
-	_xml_clear_ancestor( elem->father );
+	src->cur = scan.skip_space( src->cur, src->end );
 }
 
 
-static void xml_get_ancestor ( struct ptr_list* plist, struct xml_element** list,
-                               const char* name, int name_len ) {
+/*
+ * Names and values are int long: longer ones make a document malformed.
+ */
+static bool too_long ( const char* start, const char* end ) {
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	return end - start > INT_MAX;
+}
 
-		if ( !_xml_get_ancestor( plist, (*l)->father, name, name_len ) ) {
 
-			free( plist->list );
-			*plist = init_ptr_list;
+static int remove_trail_space ( const char* str, int len ) {
 
-			for ( l = list; *l; l++ )
-				_xml_clear_ancestor( (*l)->father );
-			return;
-		}
-	}
+	for ( ; len && is_space( (unsigned char)str[ len - 1 ] ); len-- ) ;
 
-	for ( struct xml_element** l = list; *l; l++ )
-		_xml_clear_ancestor( (*l)->father );
+	return len;
 }
 
 
-static void xml_get_ancestor_or_self ( struct ptr_list* plist,
-                                       struct xml_element** list,
-                                       const char* name, int name_len ) {
-
-	for ( struct xml_element** l = list; *l; l++ ) {
+static int put_utf8 ( unsigned long c, char* out ) {
 
-		if ( !_xml_get_ancestor( plist, *l, name, name_len ) ) {
+	if ( c < 0x80 ) {
+		out[0] = (char)c;
+		return 1;
+	}
 
-			free( plist->list );
-			*plist = init_ptr_list;
+	if ( c < 0x800 ) {
+		out[0] = (char)( 0xc0 | c >> 6 );
+		out[1] = (char)( 0x80 | ( c & 0x3f ) );
+		return 2;
+	}
 
-			for ( l = list; *l; l++ )
-				_xml_clear_ancestor( *l );
-			return;
-		}
+	if ( c < 0x10000 ) {
+		out[0] = (char)( 0xe0 | c >> 12 );
+		out[1] = (char)( 0x80 | ( c >> 6 & 0x3f ) );
+		out[2] = (char)( 0x80 | ( c & 0x3f ) );
+		return 3;
 	}
 
-	for ( struct xml_element** l = list; *l; l++ )
-		_xml_clear_ancestor( *l );
+	out[0] = (char)( 0xf0 | c >> 18 );
+	out[1] = (char)( 0x80 | ( c >> 12 & 0x3f ) );
+	out[2] = (char)( 0x80 | ( c >> 6 & 0x3f ) );
+	out[3] = (char)( 0x80 | ( c & 0x3f ) );
+	return 4;
 }
 
 
-static void xml_get_attribute ( struct ptr_list* plist, struct xml_element** list,
-                                const char* name, int name_len ) {
+static const struct { const char* name; int len; char c; } entities[] = {
+	{ "lt;", 3, '<' }, { "gt;", 3, '>' }, { "amp;", 4, '&' },
+	{ "apos;", 5, '\'' }, { "quot;", 5, '"' }
+};
 
-	if ( name_len == 1 && name[0] == '*' ) {
+/*
+ * writes what the reference at p stands for to out, and returns the length
+ * of the reference, or 0 if p does not start one. The shortest reference
+ * to every character is at least as long as its UTF-8, so out never gets
+ * ahead of p.
+ */
+static int decode_ref ( const char* p, const char* end, char* out,
+                        int* out_len ) {
 
-		for ( struct xml_element** l = list; *l; l++ ) {
+	if ( end - p > 2 && p[1] == '#' ) {
 
-			struct xml_attribute* attr = (*l)->attr;
+		const char* q = p + 2;
+		int base = *q == 'x' ? 16 : 10;
+		unsigned long c = 0;
 
-			for ( ; attr; attr = attr->next ) {
+		if ( base == 16 ) q++;
 
-				if ( ptr_list_push_back( attr, plist ) != OK ) {
+		const char* digits = q;
 
-					free( plist->list );
-					*plist = init_ptr_list;
-					return;
-				}
-			}
-		}
-	} else {
-		for ( struct xml_element** l = list; *l; l++ ) {
+		for ( ; q < end; q++ ) {
 
-			struct trie_node* node = xml_trie_check( 0, (*l)->attr_trie, name,
-			                                         name_len );
-			if ( node ) {
-				struct xml_attribute** attrs = (void*)node->list;
+			int d = *q >= '0' && *q <= '9' ? *q - '0'
+			      : base == 16 && *q >= 'a' && *q <= 'f' ? *q - 'a' + 10
+			      : base == 16 && *q >= 'A' && *q <= 'F' ? *q - 'A' + 10
+			      : -1;
+			if ( d < 0 ) break;
 
-				for ( int i = 0; i < node->len; i++ ) {
+			if ( c <= 0x10ffff ) c = c * base + d;
+		}
 
-					if ( ptr_list_push_back( attrs[i], plist ) != OK ) {
+		if ( q == digits || q == end || *q != ';' || !c || c > 0x10ffff ||
+		     ( c >= 0xd800 && c <= 0xdfff ) )
+			return 0;
 
-						free( plist->list );
-						*plist = init_ptr_list;
-						return;
-					}
-				}
-			}
-		}
+		*out_len = put_utf8( c, out );
+		return q + 1 - p;
 	}
-}
 
+	for ( size_t i = 0; i < sizeof( entities ) / sizeof( *entities ); i++ )
+		if ( end - p > entities[i].len &&
+		     memcmp( p + 1, entities[i].name, entities[i].len ) == 0 ) {
+			*out = entities[i].c;
+			*out_len = 1;
+			return entities[i].len + 1;
+		}
 
-static void xml_get_child ( struct ptr_list* plist, struct xml_element** list,
-                            const char* name, int name_len ) {
-
-	if ( name_len == 1 && name[0] == '*' ) {
+	return 0;
+}
 
-		for ( struct xml_element** l = list; *l; l++ ) {
 
-			struct xml_element* elem = (*l)->son;
+/*
+ * runs without references are copied whole, found as fast as the scanners
+ * go; out may be value itself
+ */
+int xml_decode ( const char* value, int len, char* out ) {
 
-			for ( ; elem; elem = elem->next ) {
+	const char* end = value + len;
+	char* o = out;
 
-				if ( ptr_list_push_back( elem, plist ) != OK ) {
+	while ( value < end ) {
 
-					free( plist->list );
-					*plist = init_ptr_list;
-					return;
-				}
-			}
-		}
-	} else {
-		for ( struct xml_element** l = list; *l; l++ ) {
+		const char* amp = scan.find_char( value, end, '&' );
 
-			struct trie_node* node = xml_trie_check( 0, (*l)->sons_trie, name,
-			                                         name_len );
-			if ( node ) {
-				struct xml_element** elems = (void*)node->list;
+		memmove( o, value, amp - value );
+		o += amp - value;
+		value = amp;
 
-				for ( int i = 0; i < node->len; i++ ) {
+		if ( value == end ) break;
 
-					if ( ptr_list_push_back( elems[i], plist ) != OK ) {
+		int n, written;
 
-						free( plist->list );
-						*plist = init_ptr_list;
-						return;
-					}
-				}
-			}
-		}
+		if ( ( n = decode_ref( value, end, o, &written ) ) ) {
+			value += n;
+			o += written;
+		} else
+			*o++ = *value++;
 	}
+
+	return o - out;
 }
 
 
-static bool _xml_get_descendant ( struct ptr_list* plist, struct xml_element* elem,
-                                  const char* name, int name_len ) {
+static enum STATE read_attr_name ( struct cursor* src, struct xml_event* ev ) {
 
-	if ( !elem || elem->status & IS_TOUCHED_STATUS ) return true;
+	const char* start = src->cur;
 
-	elem->status |= IS_TOUCHED_STATUS;
+	src->cur = scan.find_delim( src->cur, src->end, '=', '=', true );
 
-	if ( xml_element_check( elem, name, name_len ) )
-		if ( ptr_list_push_back( elem, plist ) != OK )
-			return false;
+	if ( src->cur == src->end ) return INCOMPLETE;
+	if ( too_long( start, src->cur ) ) return PARSE_ERROR;
 
-	for ( struct xml_element* son = elem->son; son; son = son->next )
-		if ( !_xml_get_descendant( plist, son, name, name_len ) )
-			return false;
+	ev->name = start;
+	ev->name_len = src->cur - start;
 
-	return true;
+	skip_space( src );
+
+	return OK;
 }
 
 
-static void _xml_clear_descendant ( struct xml_element* elem ) {
+static enum STATE read_attr_value ( struct cursor* src, struct xml_event* ev,
+                                    bool trim ) {
 
-	if ( !elem ) return;
-	if ( !( elem->status & IS_TOUCHED_STATUS ) ) return;
+	if ( src->cur == src->end ) return INCOMPLETE;
 
-	elem->status ^= IS_TOUCHED_STATUS;
+	char d = *src->cur++;
+	if ( d != '\'' && d != '"' ) return PARSE_ERROR;
 
-	for ( struct xml_element* son = elem->son; son; son = son->next )
-		_xml_clear_descendant( son );
-}
+	const char* start = src->cur;
+	const char* end = scan.find_delim( start, src->end, d, '&', false );
 
+	ev->refs = end < src->end && *end == '&';
+	if ( ev->refs ) end = scan.find_char( end, src->end, d );
 
-static void xml_get_descendant ( struct ptr_list* plist, struct xml_element** list,
-                                 const char* name, int name_len ) {
+	if ( end == src->end ) return INCOMPLETE;
+	if ( too_long( start, end ) ) return PARSE_ERROR;
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	src->cur = end + 1;
 
-		if ( !( (*l)->status & IS_TOUCHED_STATUS ) ) {
+	ev->value = start;
+	ev->value_len = trim ? remove_trail_space( start, end - start )
+	                     : end - start;
 
-			struct xml_element* elem = (*l)->son;
+	return OK;
+}
 
-			for ( ; elem; elem = elem->next ) {
 
-				if ( !_xml_get_descendant( plist, elem, name, name_len ) ) {
+/*
+ * reads the next attribute of a start tag (OK) or the end of the tag,
+ * either OPEN_TAG or ISOLATED_TAG
+ */
+static enum STATE read_attr ( struct cursor* src, struct xml_event* ev,
+                              bool trim ) {
 
-					free( plist->list );
-					*plist = init_ptr_list;
+	enum STATE state;
 
-					for ( l = list; *l; l++ ) {
-						(*l)->status |= IS_TOUCHED_STATUS;
-						_xml_clear_descendant( *l );
-					}
-					return;
-				}
+	skip_space( src );
+
+	if ( src->cur == src->end ) return INCOMPLETE;
+
+	int c = *src->cur++;
+
+	if ( c == '=' ) return PARSE_ERROR;
+
+	if ( c == '/' ) {
+		skip_space( src );
+		if ( src->cur == src->end ) return INCOMPLETE;
+		return ( *src->cur++ == '>' ) ? ISOLATED_TAG : PARSE_ERROR;
+	}
+
+	if ( c == '>' ) return OPEN_TAG;
+
+	src->cur--;
+
+	state = read_attr_name( src, ev );
+	if ( state != OK ) return state;
+
+	if ( src->cur == src->end ) return INCOMPLETE;
+	if ( *src->cur++ != '=' ) return PARSE_ERROR;
+	skip_space( src );
+
+	return read_attr_value( src, ev, trim );
+}
+
+
+static enum STATE read_special_tag ( struct cursor* src, struct xml_event* ev ) {
+
+	const char* start = src->cur;
+
+	for ( int open = 1; open; src->cur++ ) {
+
+		src->cur = scan.find_delim( src->cur, src->end, '<', '>', false );
+		if ( src->cur == src->end ) return INCOMPLETE;
+
+		switch ( *src->cur ) {
+			case '<': open++; break;
+			case '>': open--; break;
+		}
+	}
+
+	if ( too_long( start, src->cur - 1 ) ) return PARSE_ERROR;
+
+	ev->value = start;
+	ev->value_len = src->cur - 1 - start;
+
+	return OTHER_TAG;
+}
+
+
+/*
+ * reads the name of a start tag (OPEN_TAG, its attributes still to be read
+ * by read_attr), a whole end tag (CLOSE_TAG) or a whole <? > or <! > tag
+ * (OTHER_TAG)
+ */
+static enum STATE read_tag ( struct cursor* src, struct xml_event* ev ) {
+
+	if ( src->cur == src->end || *src->cur++ != '<' ) return PARSE_ERROR;
+
+	if ( src->cur == src->end ) return INCOMPLETE;
+
+	int c = *src->cur;
+
+	if( c == '?' || c == '!' )
+		return read_special_tag( src, ev );
+
+	bool close_tag = false;
+	if ( c == '/' ) {
+		close_tag = true;
+		src->cur++;
+	}
+
+	skip_space( src );
+
+	const char* start = src->cur;
+
+	if ( src->cur < src->end && *src->cur == '>' )
+		return PARSE_ERROR;
+
+	src->cur = scan.find_delim( src->cur, src->end, '>', '/', true );
+
+	if ( src->cur == src->end ) return INCOMPLETE;
+	if ( too_long( start, src->cur ) ) return PARSE_ERROR;
+
+	c = *src->cur;
+
+	ev->name = start;
+	ev->name_len = src->cur - start;
+
+	if ( close_tag ) {
+
+		if ( c == '/' ) return PARSE_ERROR;
+
+		skip_space( src );
+		if ( src->cur == src->end ) return INCOMPLETE;
+		if ( *src->cur++ != '>' ) return PARSE_ERROR;
+
+		return CLOSE_TAG;
+	}
+
+	return OPEN_TAG;
+}
+
+
+static enum STATE read_value ( struct cursor* src, struct xml_event* ev,
+                               bool trim ) {
+
+	const char* start = src->cur;
+	const char* end = scan.find_delim( start, src->end, '<', '&', false );
+
+	ev->refs = end < src->end && *end == '&';
+	if ( ev->refs ) end = scan.find_char( end, src->end, '<' );
+
+	if ( end == src->end ) return INCOMPLETE;
+	if ( too_long( start, end ) ) return PARSE_ERROR;
+
+	src->cur = end;
+
+	ev->value = start;
+	ev->value_len = trim ? remove_trail_space( start, end - start )
+	                     : end - start;
+
+	return OK;
+}
+
+
+static enum STATE reader_push ( struct xml_reader* reader,
+                                const char* name, int len ) {
+
+	if ( reader->depth == reader->max_depth ) {
+
+		int max_depth = 2 * reader->max_depth + 16;
+
+		void* aux = realloc( reader->stack,
+		                     max_depth * sizeof( struct name_slice ) );
+		if ( !aux ) return MEMORY_ERROR;
+
+		reader->stack = aux;
+		reader->max_depth = max_depth;
+	}
+
+	int offset = reader->depth ? reader->stack[ reader->depth - 1 ].offset +
+	                             reader->stack[ reader->depth - 1 ].len
+	                           : 0;
+
+	if ( (size_t)offset + len > reader->names_len ) {
+
+		size_t names_len = 2 * ( offset + len ) + 64;
+
+		void* aux = realloc( reader->names, names_len );
+		if ( !aux ) return MEMORY_ERROR;
+
+		reader->names = aux;
+		reader->names_len = names_len;
+	}
+
+	memcpy( reader->names + offset, name, len );
+
+	reader->stack[ reader->depth++ ] = (struct name_slice){ offset, len };
+	return OK;
+}
+
+
+/*
+ * Reads the next event. Returns INCOMPLETE, leaving the reader where it
+ * was, when the input ends in the middle of a token and more may come.
+ */
+static enum STATE reader_step ( struct xml_reader* reader,
+                                struct xml_event* ev ) {
+
+	struct cursor* src = &reader->src;
+	const char* start = src->cur;
+	enum STATE state;
+
+	ev->name = ev->value = NULL;
+	ev->name_len = ev->value_len = ev->refs = 0;
+
+	if ( reader->done ) {
+		ev->type = XML_END_DOCUMENT;
+		return OK;
+	}
+
+	if ( reader->in_tag ) {
+
+		ev->depth = reader->depth;
+
+		state = read_attr( src, ev, !reader->raw_values );
+
+		if ( state == OK ) {
+			ev->type = XML_ATTRIBUTE;
+			return OK;
+		}
+
+		if ( state == ISOLATED_TAG ) {
+
+			struct name_slice* top = reader->stack + --reader->depth;
+
+			reader->in_tag = false;
+			ev->name = reader->names + top->offset;
+			ev->name_len = top->len;
+			ev->type = XML_END_ELEMENT;
+			return OK;
+		}
+
+		if ( state != OPEN_TAG ) goto fail;
+
+		reader->in_tag = false;
+		start = src->cur;
+	}
+
+	skip_space( src );
+
+	ev->depth = reader->depth;
+
+	if ( src->cur == src->end ) {
+
+		if ( !reader->final ) {
+			state = INCOMPLETE;
+			goto fail;
+		}
+
+		if ( reader->depth ) return PARSE_ERROR;
+
+		reader->done = true;
+		ev->type = XML_END_DOCUMENT;
+		return OK;
+	}
+
+	if ( *src->cur != '<' ) {
+
+		state = read_value( src, ev, !reader->raw_values );
+		if ( state != OK ) goto fail;
+
+		ev->type = XML_TEXT;
+		return OK;
+	}
+
+	state = read_tag( src, ev );
+
+	switch ( state ) {
+
+		case OPEN_TAG:
+
+			state = reader_push( reader, ev->name, ev->name_len );
+			if ( state != OK ) return state;
+
+			reader->in_tag = true;
+			ev->depth = reader->depth;
+			ev->type = XML_START_ELEMENT;
+			return OK;
+
+		case CLOSE_TAG: {
+
+			if ( !reader->depth && reader->partial ) {
+				ev->type = XML_END_ELEMENT;
+				return OK;
+			}
+
+			if ( !reader->depth ) return PARSE_ERROR;
+
+			struct name_slice* top = reader->stack + reader->depth - 1;
+
+			if ( top->len != ev->name_len ||
+			     memcmp( reader->names + top->offset, ev->name,
+			             ev->name_len ) != 0 )
+				return PARSE_ERROR;
+
+			reader->depth--;
+			ev->type = XML_END_ELEMENT;
+			return OK;
+		}
+
+		case OTHER_TAG:
+
+			ev->type = XML_SPECIAL_TAG;
+			return OK;
+
+		default:
+			break;
+	}
+
+fail:
+	if ( state != INCOMPLETE ) return state;
+
+	if ( reader->final ) return PARSE_ERROR;
+
+	src->cur = start;
+	return INCOMPLETE;
+}
+
+
+enum xml_event_type xml_reader_next ( struct xml_reader* reader,
+                                      struct xml_event* ev ) {
+
+	if ( reader->error ) {
+		ev->type = XML_ERROR;
+		ev->name = ev->value = NULL;
+		ev->name_len = ev->value_len = ev->refs = 0;
+		return XML_ERROR;
+	}
+
+	if ( reader_step( reader, ev ) != OK ) {
+		reader->error = true;
+		ev->type = XML_ERROR;
+	}
+
+	return ev->type;
+}
+
+
+enum xml_event_type xml_reader_skip ( struct xml_reader* reader ) {
+
+	struct xml_event ev;
+
+	int depth = reader->depth;
+
+	if ( !depth ) return XML_ERROR;
+
+	while ( reader->depth >= depth )
+		if ( xml_reader_next( reader, &ev ) == XML_ERROR )
+			return XML_ERROR;
+
+	return XML_END_ELEMENT;
+}
+
+
+/*
+ * maps the file, or reads it whole when that fails and map is not set
+ */
+static enum STATE open_source ( const char* name, bool map,
+                                struct source* source ) {
+
+	*source = (struct source){ "", 0, NULL, 0, NULL };
+
+	int fd = open( name, O_RDONLY );
+	if ( fd < 0 ) return PARSE_ERROR;
+
+	struct stat st;
+
+	if ( fstat( fd, &st ) != 0 ) {
+		close( fd );
+		return PARSE_ERROR;
+	}
+
+	if ( S_ISREG( st.st_mode ) && st.st_size == 0 ) {
+		close( fd );
+		return OK;
+	}
+
+	if ( S_ISREG( st.st_mode ) ) {
+
+		void* map_ptr = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+		if ( map_ptr != MAP_FAILED ) {
+			close( fd );
+			source->buf = source->map = map_ptr;
+			source->len = source->map_len = st.st_size;
+			return OK;
+		}
+	}
+
+	if ( map ) {
+		close( fd );
+		return PARSE_ERROR;
+	}
+
+	size_t len = 0, max_len = 0;
+	ssize_t n = 1;
+
+	while ( n > 0 ) {
+
+		if ( len == max_len ) {
+
+			max_len = 2*max_len + 4096;
+
+			char* aux = realloc( source->data, max_len );
+			if ( !aux ) {
+				n = -1;
+				break;
 			}
+			source->data = aux;
 		}
+
+		n = read( fd, source->data + len, max_len - len );
+		if ( n > 0 ) len += n;
+	}
+
+	close( fd );
+
+	if ( n < 0 ) {
+		free( source->data );
+		source->data = NULL;
+		return MEMORY_ERROR;
+	}
+
+	source->buf = source->data;
+	source->len = len;
+	return OK;
+}
+
+
+static void close_source ( struct source* source ) {
+
+	if ( source->map ) munmap( source->map, source->map_len );
+	free( source->data );
+}
+
+
+static void reader_init ( struct xml_reader* reader, const char* buffer,
+                          size_t len ) {
+
+	memset( reader, 0, sizeof( struct xml_reader ) );
+
+	reader->src = (struct cursor){ buffer, buffer + len };
+	reader->final = true;
+}
+
+
+static void reader_release ( struct xml_reader* reader ) {
+
+	free( reader->stack );
+	free( reader->names );
+}
+
+
+struct xml_reader* new_xml_reader ( const char* buffer, size_t len ) {
+
+	struct xml_reader* reader = malloc( sizeof( struct xml_reader ) );
+	if ( !reader ) return NULL;
+
+	reader_init( reader, buffer, len );
+	return reader;
+}
+
+
+struct xml_reader* open_xml_reader ( const char* name ) {
+
+	struct source source;
+
+	if ( open_source( name, false, &source ) != OK ) return NULL;
+
+	struct xml_reader* reader = new_xml_reader( source.buf, source.len );
+
+	if ( reader ) reader->source = source;
+	else close_source( &source );
+
+	return reader;
+}
+
+
+void free_xml_reader ( struct xml_reader* reader ) {
+
+	if ( !reader ) return;
+
+	close_source( &reader->source );
+	reader_release( reader );
+	free( reader );
+}
+
+
+/*
+ * (name id, position) pairs, sorted to group nodes by name while keeping
+ * them in document order
+ */
+struct index_key {
+
+	int id;
+	int pos;
+	void* node;
+};
+
+
+static int cmp_index_key ( const void *a, const void *b ) {
+
+	const struct index_key* x = a;
+	const struct index_key* y = b;
+
+	if ( x->id != y->id ) return x->id < y->id ? -1 : 1;
+
+	return x->pos - y->pos;
+}
+
+
+struct scratch {
+
+	size_t size;
+	void* buf;
+};
+
+
+static void* scratch_reserve ( struct scratch* scratch, size_t size ) {
+
+	if ( size > scratch->size ) {
+
+		void* aux = realloc( scratch->buf, size );
+		if ( !aux ) return NULL;
+
+		scratch->buf = aux;
+		scratch->size = size;
 	}
+	return scratch->buf;
+}
+
+
+/*
+ * Indexes are malloc'd, not taken from the arena, since queries running at
+ * the same time may build them; every document keeps a list of its own.
+ */
+struct index_block {
+
+	struct index_block* next;
+	struct xml_index index;
+};
+
+
+/*
+ * So are the values xml_value decodes, as it may run in many threads too.
+ */
+struct value_block {
+
+	struct value_block* next;
+	char value[];
+};
+
+
+/*
+ * elements and attributes share their first fields, so both lists are
+ * walked as elements
+ */
+static struct index_block* build_index ( struct scratch* scratch,
+                                         void* source_list ) {
+
+	int len = 0;
+	for ( struct xml_element* i = source_list; i; i = i->next ) len++;
+
+	struct index_key* keys = scratch_reserve( scratch,
+	                                          len * sizeof( struct index_key ) );
+	if ( !keys ) return NULL;
+
+	int groups = 0;
+	int pos = 0;
+	bool sorted = true;
+
+	for ( struct xml_element* i = source_list; i; i = i->next, pos++ ) {
+
+		keys[pos] = (struct index_key){ i->name_id, pos, i };
+		if ( pos && keys[pos].id < keys[ pos - 1 ].id ) sorted = false;
+	}
+
+	if ( !sorted )
+		qsort( keys, len, sizeof( struct index_key ), cmp_index_key );
+
+	for ( int i = 0; i < len; i++ )
+		if ( !i || keys[i].id != keys[ i - 1 ].id ) groups++;
+
+	struct index_block* block = malloc( sizeof( struct index_block ) +
+	                                    groups * sizeof( struct xml_index_entry ) +
+	                                    len * sizeof( void* ) );
+	if ( !block ) return NULL;
+
+	struct xml_index_entry* entries = (void*)( block + 1 );
+	void** nodes = (void*)( entries + groups );
+
+	block->index.len = groups;
+	block->index.entries = entries;
+
+	for ( int i = 0, g = -1; i < len; i++ ) {
+
+		if ( !i || keys[i].id != keys[ i - 1 ].id )
+			entries[ ++g ] = (struct xml_index_entry){ keys[i].id, 0,
+			                                           nodes + i };
+		entries[g].len++;
+		nodes[i] = keys[i].node;
+	}
+
+	return block;
+}
+
+
+/*
+ * Builds the tree of a document out of reader events. In copy mode values
+ * are copied into the arena, for input that does not outlive the parse.
+ */
+struct builder {
+
+	struct xml_document* doc;
+	struct xml_element* elem;
+	struct xml_element* last; // last son of elem read so far
+	struct xml_attribute* last_attr;
+	int order; // of the last node built
+	int depth; // of elem
+	bool copy;
+};
+
+
+static void builder_init ( struct builder* builder, struct xml_document* doc,
+                           bool copy ) {
+
+	*builder = (struct builder){ doc, &doc->root, NULL, NULL, 0, 0, copy };
+}
+
+
+/*
+ * Values are decoded, or copied in copy mode, into the arena; the others
+ * point into the buffer. What is left for xml_value is noted in pending.
+ */
+static enum STATE builder_value ( struct builder* builder,
+                                  const struct xml_event* ev,
+                                  const char** value, int* len,
+                                  char* pending ) {
+
+	struct xml_document* doc = builder->doc;
+	int decode = ev->refs ? doc->decode : 0;
+
+	*value = ev->value;
+	*len = ev->value_len;
+	*pending = 0;
+
+	if ( doc->lazy_values && decode ) decode = XML_DECODE_LAZY;
+
+	if ( decode == XML_DECODE_LAZY ) *pending |= PENDING_DECODE;
+
+	if ( doc->lazy_values && ev->value_len &&
+	     is_space( (unsigned char)ev->value[ ev->value_len - 1 ] ) )
+		*pending |= PENDING_TRIM;
+
+	if ( !( builder->copy || decode == XML_DECODE ) || !ev->value_len )
+		return OK;
+
+	char* copy = arena_alloc( &doc->arena, ev->value_len );
+	if ( !copy ) return MEMORY_ERROR;
+
+	if ( doc->stats ) {
+		doc->stats->values.count++;
+		doc->stats->values.bytes += arena_size( ev->value_len );
+	}
+
+	if ( decode == XML_DECODE )
+		*len = xml_decode( ev->value, ev->value_len, copy );
+	else
+		memcpy( copy, ev->value, ev->value_len );
+
+	*value = copy;
+
+	return OK;
+}
+
+
+static enum STATE build_event ( struct builder* builder,
+                                const struct xml_event* ev ) {
+
+	struct xml_document* doc = builder->doc;
+
+	switch ( ev->type ) {
+
+		case XML_START_ELEMENT: {
+
+			if ( builder->depth == doc->max_depth ) return PARSE_ERROR;
+
+			struct xml_element* son = arena_calloc( &doc->arena,
+			                                sizeof( struct xml_element ) );
+			if ( !son ) return MEMORY_ERROR;
+
+			son->father = builder->elem;
+			son->prev = builder->last;
+			son->status = IS_ELEMENT_STATUS;
+			son->order = ++builder->order;
+
+			if ( builder->last ) builder->last->next = son;
+			else builder->elem->son = son;
+
+			son->name_len = ev->name_len;
+			son->name_id = names_intern( doc->names, ev->name, ev->name_len,
+			                             &son->name );
+			if ( son->name_id == NO_NAME ) return MEMORY_ERROR;
+
+			builder->elem = son;
+			builder->last = NULL;
+			builder->last_attr = NULL;
+			builder->depth++;
+
+			if ( doc->stats ) {
+				doc->stats->elements++;
+				if ( builder->depth > doc->stats->max_depth )
+					doc->stats->max_depth = builder->depth;
+			}
+			return OK;
+		}
+
+		case XML_ATTRIBUTE: {
+
+			struct xml_attribute* attr = arena_calloc( &doc->arena,
+			                              sizeof( struct xml_attribute ) );
+			if ( !attr ) return MEMORY_ERROR;
+
+			attr->father = builder->elem;
+			attr->prev = builder->last_attr;
+			attr->status = IS_ATTRIBUTE_STATUS;
+			attr->order = ++builder->order;
+
+			if ( builder->last_attr ) builder->last_attr->next = attr;
+			else builder->elem->attr = attr;
+
+			attr->name_len = ev->name_len;
+			attr->name_id = names_intern( doc->names, ev->name,
+			                              ev->name_len, &attr->name );
+			if ( attr->name_id == NO_NAME ) return MEMORY_ERROR;
+
+			builder->last_attr = attr;
+
+			if ( doc->stats ) doc->stats->attributes++;
+
+			return builder_value( builder, ev, &attr->value, &attr->value_len,
+			                      &attr->pending );
+		}
+
+		case XML_TEXT:
+
+			if ( doc->stats ) doc->stats->texts++;
+
+			return builder_value( builder, ev, &builder->elem->value,
+			                      &builder->elem->value_len,
+			                      &builder->elem->pending );
+
+		case XML_END_ELEMENT:
+
+			builder->elem->end = builder->order;
+			builder->last = builder->elem;
+			builder->elem = builder->elem->father;
+			builder->depth--;
+			return OK;
+
+		case XML_END_DOCUMENT:
+
+			doc->root.end = builder->order;
+			return OK;
+
+		case XML_SPECIAL_TAG:
+			return OK;
+
+		default:
+			return PARSE_ERROR;
+	}
+}
+
+
+static enum STATE read_xml ( struct xml_reader* reader,
+                             struct xml_document* doc ) {
+
+	struct builder builder;
+	struct xml_event ev;
+
+	builder_init( &builder, doc, false );
+
+	do {
+		xml_reader_next( reader, &ev );
+
+		enum STATE state = build_event( &builder, &ev );
+		if ( state != OK ) return state;
+
+	} while ( ev.type != XML_END_DOCUMENT );
+
+	return OK;
+}
+
+
+/*
+ * Result cache: entries hash by context and query key into chains, and are
+ * linked from the most to the least recently used. Callers hold references
+ * of their own, so an entry may outlive its place in the cache.
+ */
+struct cached {
+
+	struct cached* chain;
+	struct cached* newer;
+	struct cached* older;
+
+	unsigned hash;
+	int refs;
+
+	const struct xml_element* context;
+	const char* key; // after the list
+	size_t key_len;
+
+	void* list[];
+};
+
+struct result_cache {
+
+	pthread_mutex_t lock;
+
+	int len;
+	int max_len;
+
+	unsigned mask;
+	struct cached** table;
+
+	struct cached* newest;
+	struct cached* oldest;
+
+	size_t hits;
+	size_t misses;
+};
+
+
+static void release_cached ( struct cached* entry ) {
+
+	if ( atomic_add_int( &entry->refs, -1 ) == 0 )
+		free( entry );
+}
+
+
+static struct result_cache* new_result_cache ( int max_len ) {
+
+	struct result_cache* cache = calloc( 1, sizeof( struct result_cache ) );
+	if ( !cache ) return NULL;
+
+	unsigned size = 16;
+
+	while ( size < (unsigned)max_len && size < 1u << 30 )
+		size *= 2;
+
+	cache->table = calloc( size, sizeof( struct cached* ) );
+
+	if ( !cache->table || pthread_mutex_init( &cache->lock, NULL ) != 0 ) {
+		free( cache->table );
+		free( cache );
+		return NULL;
+	}
+
+	cache->max_len = max_len;
+	cache->mask = size - 1;
+
+	return cache;
+}
+
+
+static void free_result_cache ( struct result_cache* cache ) {
+
+	if ( !cache ) return;
+
+	for ( struct cached* entry = cache->newest; entry; ) {
+
+		struct cached* older = entry->older;
+		release_cached( entry );
+		entry = older;
+	}
+
+	pthread_mutex_destroy( &cache->lock );
+
+	free( cache->table );
+	free( cache );
+}
+
+
+static double now ( void ) {
+
+	struct timespec t;
+
+	clock_gettime( CLOCK_MONOTONIC, &t );
+
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static enum STATE init_document ( struct xml_document* doc,
+                                  const struct xml_options* opt ) {
+
+	if ( opt && opt->stats ) {
+		doc->stats = opt->stats;
+		memset( doc->stats, 0, sizeof( struct xml_load_stats ) );
+	}
+
+	doc->root.status = IS_META_ROOT_STATUS;
+	doc->root.name_id = NO_NAME;
+
+	doc->index_threshold = opt && opt->index_threshold ? opt->index_threshold
+	                                                   : DEFAULT_INDEX_THRESHOLD;
+	doc->max_depth = opt && opt->max_depth > 0 ? opt->max_depth : -1;
+	doc->want_postings = opt && opt->postings;
+	doc->decode = opt ? opt->decode : 0;
+	doc->lazy_values = opt && opt->lazy_values;
+
+	if ( opt && opt->cache > 0 ) {
+		doc->cache = new_result_cache( opt->cache );
+		if ( !doc->cache ) return MEMORY_ERROR;
+	}
+
+	if ( opt && opt->names ) {
+		doc->names = opt->names;
+		return OK;
+	}
+
+	doc->names = new_xml_names();
+	doc->own_names = true;
+
+	return doc->names ? OK : MEMORY_ERROR;
+}
+
+
+/*
+ * the element after elem in document order, skipping its descendants if
+ * asked to
+ */
+static struct xml_element* next_element ( struct xml_element* elem,
+                                          bool skip_sons ) {
+
+	if ( !skip_sons && elem->son ) return elem->son;
+
+	for ( ; !( elem->status & IS_META_ROOT_STATUS ); elem = elem->father )
+		if ( elem->next ) return elem->next;
+
+	return NULL;
+}
+
+
+/*
+ * Postings: the elements of every name, in document order, as one array
+ * with the start of each name's run in first, and the end of the last
+ * after it. Names added to the table once built have none.
+ */
+struct postings {
+
+	int len; // names
+	int* first;
+	struct xml_element** nodes;
+};
+
+
+static size_t postings_size ( int names, size_t nodes ) {
+
+	return sizeof( struct postings ) + nodes * sizeof( struct xml_element* ) +
+	       ( names + 1 ) * sizeof( int );
+}
+
+
+static enum STATE build_postings ( struct xml_document* doc ) {
+
+	int names = doc->names->len, len = 0;
+
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) )
+		len++;
+
+	struct postings* postings = malloc( postings_size( names, len ) );
+	if ( !postings ) return MEMORY_ERROR;
+
+	postings->len = names;
+	postings->nodes = (struct xml_element**)( postings + 1 );
+	postings->first = (int*)( postings->nodes + len );
+
+	int* first = postings->first;
+
+	memset( first, 0, ( names + 1 ) * sizeof( int ) );
+
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) )
+		first[ e->name_id + 1 ]++;
+
+	for ( int i = 0; i < names; i++ )
+		first[ i + 1 ] += first[i];
+
+	// filling moves every start to the next one, shifted back after
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) )
+		postings->nodes[ first[ e->name_id ]++ ] = e;
+
+	for ( int i = names; i > 0; i-- )
+		first[i] = first[ i - 1 ];
+	first[0] = 0;
+
+	doc->postings = postings;
+
+	return OK;
+}
+
+
+/*
+ * the first element named id numbered order or after, up to end, which
+ * ends the run of the name
+ */
+static struct xml_element** postings_find ( const struct postings* postings,
+                                            int id, int order,
+                                            struct xml_element*** end ) {
+
+	if ( id < 0 || id >= postings->len ) {
+		*end = postings->nodes;
+		return postings->nodes;
+	}
+
+	int low = postings->first[id], high = postings->first[ id + 1 ];
+
+	*end = postings->nodes + high;
+
+	while ( low < high ) {
+
+		int mid = low + ( high - low ) / 2;
+
+		if ( postings->nodes[mid]->order < order )
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return postings->nodes + low;
+}
+
+
+/*
+ * what the tree, names and postings take, for the stats
+ */
+static void count_memory ( struct xml_document* doc ) {
+
+	struct xml_load_stats* stats = doc->stats;
+	struct xml_names* names = doc->names;
+
+	stats->nodes.count = stats->elements + stats->attributes;
+	stats->nodes.bytes =
+		stats->elements * arena_size( sizeof( struct xml_element ) ) +
+		stats->attributes * arena_size( sizeof( struct xml_attribute ) );
+
+	arena_usage( &doc->arena, &stats->arena );
+
+	stats->names.count = names->len;
+	stats->names.bytes = names->max_len * sizeof( struct name_entry ) +
+	                     names->slots_len * sizeof( int );
+
+	struct xml_alloc_stats strings = { 0, 0 };
+
+	arena_usage( &names->arena, &strings );
+	stats->names.bytes += strings.bytes;
+
+	if ( doc->postings ) {
+		stats->postings.count = 1;
+		stats->postings.bytes = postings_size( doc->postings->len,
+		                        doc->postings->first[ doc->postings->len ] );
+	}
+}
+
+
+static enum STATE end_document ( struct xml_document* doc ) {
+
+	double start = now();
+
+	enum STATE state = doc->want_postings ? build_postings( doc ) : OK;
+
+	if ( doc->stats ) {
+		doc->stats->postings_time = now() - start;
+		count_memory( doc );
+	}
+
+	return state;
+}
+
+
+/*
+ * Parallel loading. The buffer is cut in chunks, each starting at the first
+ * '<' after its cut, parsed by a thread each into a fragment: the subtrees
+ * whose start tags the chunk holds, named in a private table and numbered
+ * from 1. Whatever a chunk does to elements opened before it (add sons or
+ * text, end them) is kept as a list of ops.
+ *
+ * A chunk whose start was guessed wrong, as the previous one did not end
+ * there because the cut fell inside a tag, is parsed again from the right
+ * place. Then the private names are interned in chunk order, which gives
+ * the same ids a sequential load does, the fragments get their names and
+ * numbers fixed in parallel, and their ops are replayed to stitch them.
+ * The first chunk uses the document table and numbers right away.
+ */
+#ifndef XML_MIN_CHUNK
+#define XML_MIN_CHUNK  ( 256 * 1024 )
+#endif
+
+enum fragment_op_type { ADD_SON, SET_TEXT, END_ELEMENT };
+
+struct fragment_op {
+
+	enum fragment_op_type type;
+	int order; // of the last node of the fragment before an END_ELEMENT
+
+	struct xml_element* son;
+	int depth; // levels of the subtree son, so far
+
+	const char* str; // the text, or the name of the element ended
+	int len;
+	char pending; // of the text
+};
+
+struct fragment {
+
+	struct xml_document doc; // the subtrees hang from its root
+	struct builder builder;
+
+	const char* start;
+	const char* stop; // where the next chunk starts
+	const char* end; // where parsing did stop
+	const char* limit; // of the whole buffer
+
+	struct fragment_op* ops;
+	int ops_len;
+	int ops_max;
+
+	struct xml_names* names; // of the document
+	bool direct; // names go straight into it, nothing to fix
+	int decode; // of the document
+	bool lazy_values;
+	int* ids; // document id of every private one
+	int offset; // nodes in the fragments before
+
+	bool count; // into stats, with depths from the fragment's root
+	struct xml_load_stats stats;
+
+	enum STATE state;
+};
+
+
+static enum STATE fragment_op ( struct fragment* frag,
+                                struct fragment_op op ) {
+
+	if ( frag->ops_len == frag->ops_max ) {
+
+		int ops_max = 2 * frag->ops_max + 16;
+
+		void* aux = realloc( frag->ops, ops_max * sizeof( struct fragment_op ) );
+		if ( !aux ) return MEMORY_ERROR;
+
+		frag->ops = aux;
+		frag->ops_max = ops_max;
+	}
+
+	frag->ops[ frag->ops_len++ ] = op;
+	return OK;
+}
+
+
+static enum STATE fragment_event ( struct fragment* frag,
+                                   const struct xml_event* ev ) {
+
+	struct builder* builder = &frag->builder;
+
+	// inside the subtree the last op added
+	if ( builder->elem != &frag->doc.root ) {
+
+		struct fragment_op* op = frag->ops + frag->ops_len - 1;
+
+		if ( ev->type == XML_START_ELEMENT && builder->depth + 1 > op->depth )
+			op->depth = builder->depth + 1;
+
+		return build_event( builder, ev );
+	}
+
+	switch ( ev->type ) {
+
+		case XML_START_ELEMENT: {
+
+			// sons are linked to their siblings when stitching
+			builder->last = NULL;
+
+			enum STATE state = build_event( builder, ev );
+			if ( state != OK ) return state;
+
+			return fragment_op( frag, (struct fragment_op){ ADD_SON, 0,
+			                                builder->elem, 1, NULL, 0, 0 } );
+		}
+
+		case XML_TEXT: {
+
+			struct fragment_op op = { SET_TEXT, 0, NULL, 0, NULL, 0, 0 };
+
+			if ( frag->doc.stats ) frag->doc.stats->texts++;
+
+			enum STATE state = builder_value( builder, ev, &op.str, &op.len,
+			                                  &op.pending );
+			if ( state != OK ) return state;
+
+			return fragment_op( frag, op );
+		}
+
+		case XML_END_ELEMENT:
+			return fragment_op( frag, (struct fragment_op){ END_ELEMENT,
+			        builder->order, NULL, 0, ev->name, ev->name_len, 0 } );
+
+		default:
+			return build_event( builder, ev );
+	}
+}
+
+
+static void* parse_fragment ( void* arg ) {
+
+	struct fragment* frag = arg;
+	struct xml_reader reader;
+	struct xml_event ev;
+
+	struct xml_options opt = { 0 };
+
+	opt.names = frag->direct ? frag->names : NULL;
+	opt.decode = frag->decode;
+	opt.lazy_values = frag->lazy_values;
+	opt.stats = frag->count ? &frag->stats : NULL;
+
+	frag->state = init_document( &frag->doc, &opt );
+	builder_init( &frag->builder, &frag->doc, false );
+
+	reader_init( &reader, frag->start, frag->limit - frag->start );
+	reader.partial = true;
+	reader.raw_values = frag->lazy_values;
+
+	while ( frag->state == OK ) {
+
+		if ( !reader.in_tag ) {
+			skip_space( &reader.src );
+			if ( reader.src.cur >= frag->stop ) break;
+		}
+
+		frag->state = reader_step( &reader, &ev );
+
+		if ( frag->state == OK )
+			frag->state = fragment_event( frag, &ev );
+	}
+
+	frag->end = reader.src.cur;
+	reader_release( &reader );
+
+	return NULL;
+}
+
+
+static void release_fragment ( struct fragment* frag ) {
+
+	arena_free( &frag->doc.arena );
+	if ( frag->doc.own_names ) free_xml_names( frag->doc.names );
+	free( frag->ops );
+	free( frag->ids );
+
+	memset( &frag->doc, 0, sizeof( struct xml_document ) );
+	frag->ops = NULL;
+	frag->ids = NULL;
+	frag->ops_len = frag->ops_max = 0;
+}
+
+
+static void fix_node ( struct fragment* frag, struct xml_element* node ) {
+
+	node->name_id = frag->ids[ node->name_id ];
+	node->name = frag->names->entries[ node->name_id ].str;
+	node->order += frag->offset;
+}
+
+
+/*
+ * gives the nodes of a fragment their document names and numbers; the
+ * elements still open at its end get theirs when stitching
+ */
+static void* fix_fragment ( void* arg ) {
+
+	struct fragment* frag = arg;
+	struct xml_element* root = &frag->doc.root;
+
+	if ( frag->direct ) return NULL;
+
+	for ( struct xml_element* open = frag->builder.elem; open != root;
+	      open = open->father )
+		open->end = -1;
+
+	for ( int i = 0; i < frag->ops_len; i++ ) {
+
+		struct xml_element* top = frag->ops[i].son;
+		struct xml_element* elem = top;
+
+		while ( elem ) {
+
+			fix_node( frag, elem );
+			if ( elem->end >= 0 ) elem->end += frag->offset;
+
+			for ( struct xml_attribute* attr = elem->attr; attr;
+			      attr = attr->next )
+				fix_node( frag, (struct xml_element*)attr );
+
+			if ( elem->son ) {
+				elem = elem->son;
+				continue;
+			}
+
+			while ( elem != top && !elem->next ) elem = elem->father;
+
+			elem = elem == top ? NULL : elem->next;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * runs func on every fragment, the first one on the calling thread, and
+ * any other a thread can not be started for too
+ */
+static void run_fragments ( struct fragment* frags, int len,
+                            void* (*func) ( void* ) ) {
+
+	pthread_t threads[ len ];
+	bool started[ len ];
+
+	for ( int i = 1; i < len; i++ )
+		started[i] = !pthread_create( threads + i, NULL, func, frags + i );
+
+	func( frags );
+
+	for ( int i = 1; i < len; i++ ) {
+		if ( started[i] ) pthread_join( threads[i], NULL );
+		else func( frags + i );
+	}
+}
+
+
+struct stitch {
+
+	struct xml_element* elem;
+	struct xml_element* last; // son
+};
+
+
+static enum STATE stitch_fragment ( struct fragment* frag,
+                                    struct stitch** stack, int* depth,
+                                    int* max_depth, int limit,
+                                    int* deepest ) {
+
+	// count the elements left open before stitching changes their fathers
+	int open = 0;
+
+	for ( struct xml_element* i = frag->builder.elem; i != &frag->doc.root;
+	      i = i->father )
+		open++;
+
+	for ( int i = 0; i < frag->ops_len; i++ ) {
+
+		struct fragment_op* op = frag->ops + i;
+		struct stitch* top = *stack + *depth - 1;
+
+		switch ( op->type ) {
+
+			case ADD_SON:
+
+				if ( limit > 0 && *depth - 1 + op->depth > limit )
+					return PARSE_ERROR;
+
+				if ( *depth - 1 + op->depth > *deepest )
+					*deepest = *depth - 1 + op->depth;
+
+				op->son->father = top->elem;
+				op->son->prev = top->last;
+
+				if ( top->last ) top->last->next = op->son;
+				else top->elem->son = op->son;
+
+				top->last = op->son;
+				break;
+
+			case SET_TEXT:
+
+				top->elem->value = op->str;
+				top->elem->value_len = op->len;
+				top->elem->pending = op->pending;
+				break;
+
+			case END_ELEMENT:
+
+				if ( *depth == 1 || top->elem->name_len != op->len ||
+				     memcmp( top->elem->name, op->str, op->len ) != 0 )
+					return PARSE_ERROR;
+
+				top->elem->end = frag->offset + op->order;
+				(*depth)--;
+				top[-1].last = top->elem;
+				break;
+		}
+	}
+
+	if ( *depth + open > *max_depth ) {
+
+		int len = 2 * ( *depth + open ) + 16;
+
+		void* aux = realloc( *stack, len * sizeof( struct stitch ) );
+		if ( !aux ) return MEMORY_ERROR;
+
+		*stack = aux;
+		*max_depth = len;
+	}
+
+	struct xml_element* last = frag->builder.last;
+	struct xml_element* elem = frag->builder.elem;
+
+	*depth += open;
+
+	for ( int i = 1; i <= open; i++, last = elem, elem = elem->father )
+		(*stack)[ *depth - i ] = (struct stitch){ elem, last };
+
+	return OK;
+}
+
+
+static enum STATE stitch_fragments ( struct xml_document* doc,
+                                     struct fragment* frags, int len ) {
+
+	int depth = 1, max_depth = 16;
+
+	struct stitch* stack = malloc( max_depth * sizeof( struct stitch ) );
+	if ( !stack ) return MEMORY_ERROR;
+
+	stack[0] = (struct stitch){ &doc->root, NULL };
+
+	enum STATE state = OK;
+	int deepest = 0;
+
+	for ( int i = 0; i < len && state == OK; i++ )
+		state = stitch_fragment( frags + i, &stack, &depth, &max_depth,
+		                         doc->max_depth, &deepest );
+
+	if ( doc->stats ) doc->stats->max_depth = deepest;
+
+	if ( state == OK && depth != 1 ) state = PARSE_ERROR;
+
+	free( stack );
+
+	return state;
+}
+
+
+static enum STATE intern_fragment ( struct xml_document* doc,
+                                    struct fragment* frag ) {
+
+	struct xml_names* names = frag->doc.names;
+
+	if ( frag->direct ) return OK;
+
+	frag->ids = malloc( ( names->len + 1 ) * sizeof( int ) );
+	if ( !frag->ids ) return MEMORY_ERROR;
+
+	for ( int i = 0; i < names->len; i++ ) {
+
+		frag->ids[i] = names_intern( doc->names, names->entries[i].str,
+		                             names->entries[i].len, NULL );
+		if ( frag->ids[i] == NO_NAME ) return MEMORY_ERROR;
+	}
+
+	return OK;
+}
+
+
+static void add_counts ( struct xml_load_stats* stats,
+                         const struct xml_load_stats* frag ) {
+
+	stats->elements += frag->elements;
+	stats->attributes += frag->attributes;
+	stats->texts += frag->texts;
+	stats->values.count += frag->values.count;
+	stats->values.bytes += frag->values.bytes;
+}
+
+
+static enum STATE read_xml_parallel ( struct xml_document* doc,
+                                      const char* buffer, size_t len,
+                                      int threads ) {
+
+	struct fragment* frags = calloc( threads, sizeof( struct fragment ) );
+	if ( !frags ) return MEMORY_ERROR;
+
+	const char* end = buffer + len;
+
+	for ( int i = 0; i < threads; i++ ) {
+
+		frags[i].limit = end;
+		frags[i].names = doc->names;
+		frags[i].decode = doc->decode;
+		frags[i].lazy_values = doc->lazy_values;
+		frags[i].count = doc->stats != NULL;
+		frags[i].start = i ? scan.find_char( buffer + len / threads * i,
+		                                     end, '<' )
+		                   : buffer;
+		if ( i ) frags[ i - 1 ].stop = frags[i].start;
+	}
+	frags[ threads - 1 ].stop = end;
+
+	// the first chunk always starts right, and is the first to name things
+	frags[0].direct = true;
+
+	run_fragments( frags, threads, parse_fragment );
+
+	enum STATE state = frags[0].state;
+
+	for ( int i = 1; i < threads && state == OK; i++ ) {
+
+		if ( frags[i].start != frags[ i - 1 ].end ) {
+
+			release_fragment( frags + i );
+			frags[i].start = frags[ i - 1 ].end;
+			parse_fragment( frags + i );
+		}
+		state = frags[i].state;
+	}
+
+	double start = now();
+
+	if ( doc->stats )
+		for ( int i = 0; i < threads; i++ )
+			add_counts( doc->stats, &frags[i].stats );
+
+	for ( int i = 0, offset = 0; i < threads && state == OK; i++ ) {
+
+		state = intern_fragment( doc, frags + i );
+
+		frags[i].offset = offset;
+		offset += frags[i].builder.order;
+	}
+
+	if ( state == OK ) {
+
+		run_fragments( frags, threads, fix_fragment );
+
+		state = stitch_fragments( doc, frags, threads );
+
+		doc->root.end = frags[ threads - 1 ].offset +
+		                frags[ threads - 1 ].builder.order;
+	}
+
+	for ( int i = 0; i < threads; i++ ) {
+
+		if ( state == OK ) arena_adopt( &doc->arena, &frags[i].doc.arena );
+		release_fragment( frags + i );
+	}
+
+	free( frags );
+
+	if ( doc->stats ) doc->stats->merge_time = now() - start;
+
+	return state;
+}
+
+
+static struct xml_element* load_document ( struct xml_document* doc,
+                                           const char* buffer, size_t len,
+                                           const struct xml_options* opt ) {
+
+	struct xml_element* root = &doc->root;
+	struct xml_reader reader;
+	double start = now();
+
+	enum STATE state = init_document( doc, opt );
+
+	int threads = opt && opt->threads > 1 ? opt->threads : 1;
+
+	if ( (size_t)threads > len / XML_MIN_CHUNK )
+		threads = len / XML_MIN_CHUNK;
+
+	if ( state == OK && threads > 1 ) {
+
+		state = read_xml_parallel( doc, buffer, len, threads );
+
+	} else if ( state == OK ) {
+
+		reader_init( &reader, buffer, len );
+		reader.raw_values = doc->lazy_values;
+		state = read_xml( &reader, doc );
+		reader_release( &reader );
+	}
+
+	if ( doc->stats ) {
+		doc->stats->bytes = len;
+		doc->stats->parse_time = now() - start - doc->stats->merge_time;
+	}
+
+	if ( state == OK )
+		state = end_document( doc );
+
+	if ( doc->stats ) {
+		doc->stats->total_time = now() - start;
+		doc->stats = NULL;
+	}
+
+	if ( state != OK ) {
+		free_xml( root );
+		root = NULL;
+	}
+
+	return root;
+}
+
+
+struct xml_element* load_xml_buffer_opt ( const char* buffer, size_t len,
+                                          const struct xml_options* opt ) {
+
+	struct xml_document* doc = calloc( 1, sizeof( struct xml_document ) );
+	if ( !doc ) return NULL;
+
+	return load_document( doc, buffer, len, opt );
+}
+
+
+struct xml_element* load_xml_buffer ( const char* buffer, size_t len ) {
+
+	return load_xml_buffer_opt( buffer, len, NULL );
+}
+
+
+static struct xml_element* load_xml_file ( const char* name, bool map,
+                                           const struct xml_options* opt ) {
+
+	struct xml_load_stats* stats = opt ? opt->stats : NULL;
+	double start = now();
+
+	if ( stats ) memset( stats, 0, sizeof( struct xml_load_stats ) );
+
+	struct xml_document* doc = calloc( 1, sizeof( struct xml_document ) );
+	if ( !doc ) return NULL;
+
+	if ( open_source( name, map, &doc->source ) != OK ) {
+		free( doc );
+		return NULL;
+	}
+
+	double read_time = now() - start;
+
+	struct xml_element* root = load_document( doc, doc->source.buf,
+	                                          doc->source.len, opt );
+
+	if ( stats ) {
+		stats->read_time = read_time;
+		stats->total_time += read_time;
+	}
+
+	return root;
+}
+
+
+struct xml_element* load_xml_mmap_opt ( const char* name,
+                                        const struct xml_options* opt ) {
+
+	return load_xml_file( name, true, opt );
+}
+
+
+struct xml_element* load_xml_opt ( const char* name,
+                                   const struct xml_options* opt ) {
+
+	return load_xml_file( name, false, opt );
+}
+
+
+struct xml_element* load_xml_mmap ( const char* name ) {
+
+	return load_xml_file( name, true, NULL );
+}
+
+
+struct xml_element* load_xml ( const char* name ) {
+
+	return load_xml_file( name, false, NULL );
+}
+
+
+void free_xml ( struct xml_element* elem ) {
+
+	if ( !elem || !( elem->status & IS_META_ROOT_STATUS ) ) return;
+
+	struct xml_document* doc = (struct xml_document*)elem;
+
+	arena_free( &doc->arena );
+
+	for ( struct index_block* block = doc->indexes; block; ) {
+
+		struct index_block* next = block->next;
+		free( block );
+		block = next;
+	}
+
+	for ( struct value_block* block = doc->values; block; ) {
+
+		struct value_block* next = block->next;
+		free( block );
+		block = next;
+	}
+
+	if ( doc->own_names ) free_xml_names( doc->names );
+
+	free_result_cache( doc->cache );
+
+	if ( doc->snapshot ) {
+		struct source source = doc->source;
+		close_source( &source );
+		return;
+	}
+
+	close_source( &doc->source );
+
+	free( doc->postings );
+	free( doc );
+}
+
+
+/*
+ * Structural index. The first stage finds the bytes that may be markup,
+ * 64 at a time, and keeps those a state machine tells are: every '<' and
+ * the '>' ending its tag, '=', '/' and the quotes around values inside
+ * tags. Text, values and the contents of special tags hold none.
+ *
+ * The second stage builds the tree from the marks, reading names as the
+ * tokenizer does but jumping over text and values. It checks every mark it
+ * needs is where the bytes say, so a document the stages disagree on, which
+ * takes names holding quotes or '>', is rejected.
+ */
+#define MARKS_MIN  64
+
+enum mark_state { MARK_CONTENT, MARK_TAG, MARK_VALUE_START, MARK_VALUE,
+                  MARK_SPECIAL };
+
+
+static inline int lowest_bit ( uint64_t mask ) {
+
+#ifdef __GNUC__
+	return __builtin_ctzll( mask );
+#else
+	int i = 0;
+	for ( ; !( mask & 1 ); mask >>= 1 ) i++;
+	return i;
+#endif
+}
+
+
+static enum STATE marks_push ( struct xml_marks* marks, size_t* max,
+                               size_t pos ) {
+
+	if ( marks->count == *max ) {
+
+		size_t len = 2 * *max;
+
+		void* aux = realloc( marks->pos, len * sizeof( uint32_t ) );
+		if ( !aux ) return MEMORY_ERROR;
+
+		marks->pos = aux;
+		*max = len;
+	}
+
+	marks->pos[ marks->count++ ] = pos;
+	return OK;
+}
+
+
+struct xml_marks* xml_mark ( const char* buffer, size_t len ) {
+
+	if ( len > UINT32_MAX ) return NULL;
+
+	struct xml_marks* marks = calloc( 1, sizeof( struct xml_marks ) );
+	if ( !marks ) return NULL;
+
+	size_t max = len / 16 + MARKS_MIN;
+
+	marks->buffer = buffer;
+	marks->len = len;
+	marks->pos = malloc( max * sizeof( uint32_t ) );
+	if ( !marks->pos ) goto fail;
+
+	enum mark_state state = MARK_CONTENT;
+	char quote = 0;
+	int open = 0;
+
+	for ( size_t base = 0; base < len; base += 64 ) {
+
+		uint64_t mask;
+
+		if ( len - base >= 64 ) {
+			mask = scan.mark_mask( buffer + base );
+		} else {
+			char tail[ 64 ] = { 0 };
+			memcpy( tail, buffer + base, len - base );
+			mask = scan.mark_mask( tail );
+		}
+
+		for ( ; mask; mask &= mask - 1 ) {
+
+			size_t pos = base + lowest_bit( mask );
+			char c = buffer[ pos ];
+			bool keep = false;
+
+			switch ( state ) {
+
+				case MARK_CONTENT:
+
+					if ( c != '<' ) break;
+
+					keep = true;
+					state = MARK_TAG;
+
+					if ( pos + 1 < len && ( buffer[ pos + 1 ] == '?' ||
+					                        buffer[ pos + 1 ] == '!' ) ) {
+						state = MARK_SPECIAL;
+						open = 1;
+					}
+					break;
+
+				case MARK_SPECIAL:
+
+					if ( c == '<' ) open++;
+					if ( c == '>' && !--open ) {
+						keep = true;
+						state = MARK_CONTENT;
+					}
+					break;
+
+				case MARK_VALUE:
+
+					if ( c == quote ) {
+						keep = true;
+						state = MARK_TAG;
+					}
+					break;
+
+				case MARK_VALUE_START:
+
+					if ( c == '"' || c == '\'' ) {
+						keep = true;
+						quote = c;
+						state = MARK_VALUE;
+						break;
+					}
+					state = MARK_TAG;
+					/* fall through */
+
+				case MARK_TAG:
+
+					keep = c == '=' || c == '/' || c == '>';
+
+					if ( c == '=' ) state = MARK_VALUE_START;
+					if ( c == '>' ) state = MARK_CONTENT;
+					break;
+			}
+
+			if ( keep && marks_push( marks, &max, pos ) != OK )
+				goto fail;
+		}
+	}
+
+	return marks;
+
+fail:
+	free_xml_marks( marks );
+	return NULL;
+}
+
+
+void free_xml_marks ( struct xml_marks* marks ) {
+
+	if ( !marks ) return;
+
+	free( marks->pos );
+	free( marks );
+}
+
+
+size_t xml_marks_skip ( const struct xml_marks* marks, size_t i ) {
+
+	const char* buf = marks->buffer;
+	bool closing = false, isolated = false;
+	int depth = 0;
+
+	for ( ; i < marks->count; i++ ) {
+
+		const char* p = buf + marks->pos[ i ];
+
+		switch ( *p ) {
+
+			case '<':
+
+				closing = p + 1 < buf + marks->len && p[ 1 ] == '/';
+				isolated = false;
+
+				if ( p + 1 < buf + marks->len &&
+				     ( p[ 1 ] == '?' || p[ 1 ] == '!' ) )
+					i++;
+				else if ( !closing )
+					depth++;
+				break;
+
+			case '/':
+
+				if ( !closing && i + 1 < marks->count &&
+				     buf[ marks->pos[ i + 1 ] ] == '>' )
+					isolated = true;
+				break;
+
+			case '>':
+
+				if ( ( closing || isolated ) && !--depth ) return i + 1;
+				break;
+		}
+	}
+
+	return marks->count;
+}
+
+
+/*
+ * moves i past the mark at p, which must be the first one at or after it
+ */
+static bool seek_mark ( const struct xml_marks* marks, size_t* i,
+                        const char* p ) {
+
+	size_t pos = p - marks->buffer;
+
+	while ( *i < marks->count && marks->pos[ *i ] < pos ) ++*i;
+
+	if ( *i == marks->count || marks->pos[ *i ] != pos ) return false;
+
+	++*i;
+	return true;
+}
+
+
+static const char* next_mark ( const struct xml_marks* marks, size_t* i,
+                               char c ) {
+
+	if ( *i == marks->count ) return NULL;
+
+	const char* p = marks->buffer + marks->pos[ (*i)++ ];
+
+	return *p == c ? p : NULL;
+}
+
+
+/*
+ * marks jump over values, so they are searched for references apart, and
+ * only when the document is to decode them
+ */
+static int marks_refs ( const struct xml_document* doc, const char* value,
+                        int len ) {
+
+	return doc->decode && scan.find_char( value, value + len, '&' ) <
+	                      value + len;
+}
+
+
+/*
+ * reads the attributes and end of a start tag, from just after its name
+ */
+static enum STATE read_marks_attrs ( const struct xml_marks* marks, size_t* i,
+                                     struct cursor* src,
+                                     struct builder* builder ) {
+
+	struct xml_event ev = { XML_ATTRIBUTE, 0, NULL, NULL, 0, 0, 0 };
+	enum STATE state;
+
+	for ( ;; ) {
+
+		skip_space( src );
+		if ( src->cur == src->end ) return PARSE_ERROR;
+
+		int c = *src->cur++;
+
+		if ( c == '=' ) return PARSE_ERROR;
+
+		if ( c == '/' ) {
+			skip_space( src );
+			if ( src->cur == src->end || *src->cur != '>' ||
+			     !seek_mark( marks, i, src->cur++ ) )
+				return PARSE_ERROR;
+			return ISOLATED_TAG;
+		}
+
+		if ( c == '>' )
+			return seek_mark( marks, i, src->cur - 1 ) ? OPEN_TAG
+			                                          : PARSE_ERROR;
+
+		ev.name = --src->cur;
+		src->cur = scan.find_delim( src->cur, src->end, '=', '=', true );
+		if ( too_long( ev.name, src->cur ) ) return PARSE_ERROR;
+		ev.name_len = src->cur - ev.name;
+
+		skip_space( src );
+		if ( src->cur == src->end || *src->cur++ != '=' ) return PARSE_ERROR;
+		skip_space( src );
+
+		if ( src->cur == src->end ) return PARSE_ERROR;
+
+		char d = *src->cur;
+		if ( d != '\'' && d != '"' ) return PARSE_ERROR;
+
+		const char* end;
+		if ( !seek_mark( marks, i, src->cur ) ||
+		     !( end = next_mark( marks, i, d ) ) ||
+		     too_long( src->cur + 1, end ) )
+			return PARSE_ERROR;
+
+		ev.value = src->cur + 1;
+		ev.value_len = builder->doc->lazy_values
+		               ? end - ev.value
+		               : remove_trail_space( ev.value, end - ev.value );
+		ev.refs = marks_refs( builder->doc, ev.value, ev.value_len );
+		src->cur = end + 1;
+
+		state = build_event( builder, &ev );
+		if ( state != OK ) return state;
+	}
+}
+
+
+static enum STATE read_tag_name ( struct cursor* src, struct xml_event* ev ) {
+
+	skip_space( src );
+
+	if ( src->cur < src->end && *src->cur == '>' ) return PARSE_ERROR;
+
+	ev->name = src->cur;
+	src->cur = scan.find_delim( src->cur, src->end, '>', '/', true );
+	if ( too_long( ev->name, src->cur ) ) return PARSE_ERROR;
+	ev->name_len = src->cur - ev->name;
+
+	return src->cur == src->end ? PARSE_ERROR : OK;
+}
+
+
+static enum STATE read_xml_marks ( const struct xml_marks* marks,
+                                   struct xml_document* doc ) {
+
+	struct cursor src = { marks->buffer, marks->buffer + marks->len };
+	struct builder builder;
+	struct xml_event ev;
+	enum STATE state;
+	size_t i = 0;
+
+	builder_init( &builder, doc, false );
+
+	for ( ;; ) {
+
+		ev = (struct xml_event){ XML_TEXT, 0, NULL, NULL, 0, 0, 0 };
+
+		skip_space( &src );
+
+		if ( src.cur == src.end ) {
+
+			if ( builder.elem != &doc->root ) return PARSE_ERROR;
+
+			ev.type = XML_END_DOCUMENT;
+			return build_event( &builder, &ev );
+		}
+
+		if ( *src.cur != '<' ) {
+
+			size_t j = i;
+			const char* end = next_mark( marks, &j, '<' );
+			if ( !end || too_long( src.cur, end ) ) return PARSE_ERROR;
+
+			ev.value = src.cur;
+			ev.value_len = doc->lazy_values
+			               ? end - src.cur
+			               : remove_trail_space( src.cur, end - src.cur );
+			ev.refs = marks_refs( doc, ev.value, ev.value_len );
+			src.cur = end;
+
+		} else {
+
+			if ( !seek_mark( marks, &i, src.cur++ ) ||
+			     src.cur == src.end )
+				return PARSE_ERROR;
+
+			if ( *src.cur == '?' || *src.cur == '!' ) {
+
+				const char* end = next_mark( marks, &i, '>' );
+				if ( !end || too_long( src.cur, end ) ) return PARSE_ERROR;
+
+				ev.type = XML_SPECIAL_TAG;
+				ev.value = src.cur;
+				ev.value_len = end - src.cur;
+				src.cur = end + 1;
+
+			} else if ( *src.cur == '/' ) {
+
+				struct xml_element* elem = builder.elem;
+
+				src.cur++;
+				if ( read_tag_name( &src, &ev ) != OK || *src.cur == '/' )
+					return PARSE_ERROR;
+
+				skip_space( &src );
+				if ( src.cur == src.end || *src.cur != '>' ||
+				     !seek_mark( marks, &i, src.cur++ ) )
+					return PARSE_ERROR;
+
+				if ( elem == &doc->root || elem->name_len != ev.name_len ||
+				     memcmp( elem->name, ev.name, ev.name_len ) != 0 )
+					return PARSE_ERROR;
+
+				ev.type = XML_END_ELEMENT;
+
+			} else {
+
+				if ( read_tag_name( &src, &ev ) != OK ) return PARSE_ERROR;
+
+				ev.type = XML_START_ELEMENT;
+				state = build_event( &builder, &ev );
+				if ( state != OK ) return state;
+
+				state = read_marks_attrs( marks, &i, &src, &builder );
+				if ( state == OPEN_TAG ) continue;
+				if ( state != ISOLATED_TAG ) return state;
+
+				ev.type = XML_END_ELEMENT;
+			}
+		}
+
+		state = build_event( &builder, &ev );
+		if ( state != OK ) return state;
+	}
+}
+
+
+struct xml_element* load_xml_marks ( const struct xml_marks* marks,
+                                     const struct xml_options* opt ) {
+
+	struct xml_document* doc = calloc( 1, sizeof( struct xml_document ) );
+	if ( !doc ) return NULL;
+
+	double start = now();
+
+	enum STATE state = init_document( doc, opt );
+
+	if ( state == OK )
+		state = read_xml_marks( marks, doc );
+
+	if ( doc->stats ) {
+		doc->stats->bytes = marks->len;
+		doc->stats->parse_time = now() - start;
+	}
+
+	if ( state == OK )
+		state = end_document( doc );
+
+	if ( doc->stats ) {
+		doc->stats->total_time = now() - start;
+		doc->stats = NULL;
+	}
+
+	if ( state != OK ) {
+		free_xml( &doc->root );
+		return NULL;
+	}
+
+	return &doc->root;
+}
+
+
+/*
+ * Push parser: keeps only the input not consumed yet, so chunks can be
+ * released as soon as they are fed. The consumed part is dropped once it
+ * outgrows the rest, and a token left incomplete longer than
+ * PARSER_RESCAN is only scanned again from its start once the input
+ * after it has grown as long, so that feeding a long one in small chunks
+ * takes linear time. Events go either to a tree, built in
+ * copy mode, or to the caller's handler.
+ */
+#define PARSER_RESCAN  4096
+
+struct xml_parser {
+
+	struct xml_reader reader;
+
+	char* buf;
+	size_t len;
+	size_t max_len;
+
+	struct xml_document* doc;
+	struct builder builder;
+
+	xml_event_handler handler;
+	void* ctx;
+
+	size_t waiting; // bytes left incomplete by the last drain
+
+	bool failed;
+	bool finished;
+};
+
+
+static struct xml_parser* new_parser ( void ) {
+
+	// a zeroed reader has nothing to read and expects more
+	return calloc( 1, sizeof( struct xml_parser ) );
+}
+
+
+struct xml_parser* new_xml_parser ( const struct xml_options* opt ) {
+
+	struct xml_parser* parser = new_parser();
+	if ( !parser ) return NULL;
+
+	parser->doc = calloc( 1, sizeof( struct xml_document ) );
+
+	if ( !parser->doc || init_document( parser->doc, opt ) != OK ) {
+		free_xml_parser( parser );
+		return NULL;
+	}
+
+	builder_init( &parser->builder, parser->doc, true );
+	parser->reader.raw_values = parser->doc->lazy_values;
+
+	return parser;
+}
+
+
+struct xml_parser* new_xml_event_parser ( xml_event_handler handler,
+                                          void* ctx ) {
+
+	struct xml_parser* parser = new_parser();
+	if ( !parser ) return NULL;
+
+	parser->handler = handler;
+	parser->ctx = ctx;
+
+	return parser;
+}
+
+
+static int parser_fail ( struct xml_parser* parser ) {
+
+	parser->failed = true;
+
+	if ( parser->handler ) {
+
+		struct xml_event ev = { XML_ERROR, parser->reader.depth,
+		                        NULL, NULL, 0, 0, 0 };
+		parser->handler( &ev, parser->ctx );
+	}
+
+	return -1;
+}
+
+
+/*
+ * hands every complete event in the buffer over, up to the end of the
+ * document once finishing
+ */
+static int parser_drain ( struct xml_parser* parser ) {
+
+	struct xml_event ev;
+
+	while ( true ) {
+
+		enum STATE state = reader_step( &parser->reader, &ev );
+
+		if ( state == INCOMPLETE ) return 0;
+		if ( state != OK ) return parser_fail( parser );
+
+		if ( parser->handler )
+			parser->handler( &ev, parser->ctx );
+		else if ( build_event( &parser->builder, &ev ) != OK )
+			return parser_fail( parser );
+
+		if ( ev.type == XML_END_DOCUMENT ) return 0;
+	}
+}
+
+
+int xml_parser_feed ( struct xml_parser* parser, const char* bytes,
+                      size_t len ) {
+
+	if ( parser->failed || parser->finished ) return -1;
+
+	struct cursor* src = &parser->reader.src;
+	struct xml_load_stats* stats = parser->doc ? parser->doc->stats : NULL;
+	double start = stats ? now() : 0;
+
+	size_t done = parser->len ? (size_t)( src->cur - parser->buf ) : 0;
+	size_t left = parser->len - done;
+
+	if ( done && ( done >= left || parser->len + len > parser->max_len ) ) {
+
+		memmove( parser->buf, parser->buf + done, left );
+		parser->len = left;
+		done = 0;
+	}
+
+	if ( parser->len + len > parser->max_len ) {
+
+		size_t max_len = 2 * ( parser->len + len ) + 4096;
+
+		void* aux = realloc( parser->buf, max_len );
+		if ( !aux ) return parser_fail( parser );
+
+		parser->buf = aux;
+		parser->max_len = max_len;
+	}
+
+	if ( len )
+		memcpy( parser->buf + parser->len, bytes, len );
+
+	parser->len += len;
+	*src = (struct cursor){ parser->buf + done, parser->buf + parser->len };
+
+	int result = 0;
+
+	if ( parser->waiting <= PARSER_RESCAN ||
+	     left + len >= 2 * parser->waiting ) {
+
+		result = parser_drain( parser );
+		parser->waiting = src->end - src->cur;
+	}
+
+	if ( stats ) {
+		stats->bytes += len;
+		stats->parse_time += now() - start;
+		stats->total_time = stats->parse_time;
+	}
+
+	return result;
+}
+
+
+int xml_parser_finish ( struct xml_parser* parser ) {
+
+	if ( parser->failed || parser->finished ) return -1;
+
+	struct xml_load_stats* stats = parser->doc ? parser->doc->stats : NULL;
+	double start = stats ? now() : 0;
+
+	parser->reader.final = true;
+
+	if ( parser_drain( parser ) != 0 ) return -1;
+
+	if ( stats ) stats->parse_time += now() - start;
+
+	if ( parser->doc && end_document( parser->doc ) != OK )
+		return parser_fail( parser );
+
+	if ( stats ) {
+		stats->total_time = stats->parse_time + stats->postings_time;
+		parser->doc->stats = NULL;
+	}
+
+	parser->finished = true;
+
+	return 0;
+}
+
+
+struct xml_element* xml_parser_root ( struct xml_parser* parser ) {
+
+	if ( !parser->finished || !parser->doc ) return NULL;
+
+	struct xml_element* root = &parser->doc->root;
+	parser->doc = NULL;
+
+	return root;
+}
+
+
+void free_xml_parser ( struct xml_parser* parser ) {
+
+	if ( !parser ) return;
+
+	if ( parser->doc ) free_xml( &parser->doc->root );
+
+	reader_release( &parser->reader );
+	free( parser->buf );
+	free( parser );
+}
+
+
+static struct xml_document* document_of ( struct xml_element* elem ) {
+
+	while ( !( elem->status & IS_META_ROOT_STATUS ) )
+		elem = elem->father;
+
+	return (struct xml_document*)elem;
+}
+
+
+struct xml_names* xml_names_of ( struct xml_element* elem ) {
+
+	return document_of( elem )->names;
+}
+
+
+/*
+ * A lazy value is finished by the thread that swaps its pending state for
+ * PENDING_BUSY, while others wait, and pending is cleared after: a value
+ * found without it is final.
+ */
+static void finish_value ( struct xml_element* elem, int pending ) {
+
+	if ( pending & PENDING_TRIM ) {
+		elem->value_len = remove_trail_space( elem->value, elem->value_len );
+		pending &= ~PENDING_TRIM;
+	}
+
+	struct value_block* block = pending & PENDING_DECODE && elem->value_len
+	                            ? malloc( sizeof( struct value_block ) +
+	                                      elem->value_len )
+	                            : NULL;
+	if ( block ) {
+
+		struct xml_document* doc = document_of( elem );
+
+		elem->value_len = xml_decode( elem->value, elem->value_len,
+		                              block->value );
+		elem->value = block->value;
+
+		block->next = atomic_load_ptr( &doc->values );
+		while ( !atomic_cas_ptr( &doc->values, &block->next, block ) ) ;
+	}
+	if ( block || !elem->value_len ) pending = 0;
+
+	atomic_store_flag( &elem->pending, pending );
+}
+
+
+const char* xml_value ( void* node, int* len ) {
+
+	struct xml_element* elem = node;
+	char pending;
+
+	while ( ( pending = atomic_load_flag( &elem->pending ) ) ) {
+
+		if ( pending & PENDING_BUSY ) {
+			sched_yield();
+			continue;
+		}
+
+		if ( atomic_cas_flag( &elem->pending, &pending, PENDING_BUSY ) ) {
+			finish_value( elem, pending );
+			break;
+		}
+	}
+
+	*len = elem->value_len;
+
+	return elem->value;
+}
+
+
+static bool xml_element_check ( struct xml_element* elem, int id ) {
+
+	if ( !elem || !elem->name ) return false;
+
+	return id == ANY_NAME || elem->name_id == id;
+}
+
+
+static int cmp_index_entry ( const void *a, const void *b ) {
+
+	int x = *(const int*)a, y = ((const struct xml_index_entry*)b)->id;
+
+	return ( x > y ) - ( x < y );
+}
+
+
+static struct xml_index_entry* xml_index_check ( struct xml_index* index,
+                                                 int id ) {
+
+	if ( !index ) return NULL;
+
+	return bsearch( &id, index->entries, index->len,
+	                sizeof( struct xml_index_entry ), cmp_index_entry );
+}
+
+
+/*
+ * What a running query keeps besides the nodes it has found so far
+ */
+struct query {
+
+	struct xml_document* doc;
+	struct scratch scratch;
+
+	size_t visited; // nodes the axes looked at, for profiles
+	int used; // XML_USED_INDEX and XML_USED_POSTINGS
+};
+
+
+/*
+ * Indexes are built the first time a name is looked up in a list longer
+ * than the document threshold; shorter lists are just scanned. NULL means
+ * a scan too, also when there is no memory left for the index.
+ *
+ * Queries running at the same time may build the same index: the first to
+ * publish it wins and the others throw theirs away.
+ */
+static struct xml_index* lookup_index ( struct query* q, void* list,
+                                        struct xml_index** index ) {
+
+	struct xml_index* found = atomic_load_ptr( index );
+
+	if ( found ) {
+		q->used |= XML_USED_INDEX;
+		return found;
+	}
+
+	int len = 0;
+
+	for ( struct xml_element* i = list; i; i = i->next )
+		if ( ++len > q->doc->index_threshold ) break;
+
+	if ( len <= q->doc->index_threshold ) return NULL;
+
+	struct index_block* block = build_index( &q->scratch, list );
+	if ( !block ) return NULL;
+
+	q->used |= XML_USED_INDEX;
+
+	if ( !atomic_cas_ptr( index, &found, &block->index ) ) {
+		free( block );
+		return found;
+	}
+
+	block->next = atomic_load_ptr( &q->doc->indexes );
+
+	while ( !atomic_cas_ptr( &q->doc->indexes, &block->next, block ) ) ;
+
+	return &block->index;
+}
+
+
+/*
+ * Nodes are numbered in document order while loading: an element, then
+ * its attributes, then its descendants, with end the last number inside
+ * the element. Whether a node is inside another is then a comparison, and
+ * lists are kept in document order and free of duplicates by sorting.
+ */
+static int node_end ( const struct xml_element* node ) {
+
+	return node->status & IS_ATTRIBUTE_STATUS ? node->order : node->end;
+}
+
+
+static bool contains ( const struct xml_element* node,
+                       const struct xml_element* other ) {
+
+	return node->order <= other->order && other->order <= node_end( node );
+}
+
+
+static int cmp_order ( const void* a, const void* b ) {
+
+	const struct xml_element* x = *(void* const*)a;
+	const struct xml_element* y = *(void* const*)b;
+
+	return ( x->order > y->order ) - ( x->order < y->order );
+}
+
+
+static void ptr_list_normalize ( struct ptr_list* plist ) {
+
+	struct xml_element** list = (void*)plist->list;
+
+	int i = 1;
+
+	while ( i < plist->len && list[ i - 1 ]->order < list[i]->order ) i++;
+
+	if ( i >= plist->len ) return;
+
+	qsort( list, plist->len, sizeof( void* ), cmp_order );
+
+	int len = 1;
+
+	for ( i = 1; i < plist->len; i++ )
+		if ( list[i] != list[ len - 1 ] )
+			list[ len++ ] = list[i];
+
+	plist->len = len;
+	list[ len ] = NULL;
+}
+
+
+/*
+ * empties a list that ran out of memory, and marks it so for the query to
+ * fail
+ */
+static void ptr_list_fail ( struct ptr_list* plist ) {
+
+	free( plist->list );
+
+	plist->list = NULL;
+	plist->len = plist->max_len = 0;
+	plist->failed = true;
+}
+
+
+/*
+ * pushes node, or fails the list when there is no memory left; false
+ * tells the axis to stop
+ */
+static bool emit ( struct ptr_list* plist, void* node ) {
+
+	if ( plist->each ) return !plist->each( node, plist->ctx );
+
+	if ( ptr_list_push_back( node, plist ) == OK ) return true;
+
+	ptr_list_fail( plist );
+
+	return false;
+}
+
+
+/*
+ * Walking up from every context stops at the first node that is also
+ * above the previous one: everything from there up was found already.
+ */
+static void get_ancestors ( struct query* q, struct ptr_list* plist,
+                            struct xml_element** list, int id, bool self ) {
+
+	struct xml_element* prev = NULL;
+
+	for ( struct xml_element** l = list; *l; prev = *l++ ) {
+
+		int first = plist->len;
+
+		struct xml_element* elem = self ? *l : (*l)->father;
+
+		// the meta root has no father
+		for ( ; elem && !( elem->status & IS_META_ROOT_STATUS );
+		      elem = elem->father ) {
+
+			if ( prev && contains( elem, prev ) &&
+			     ( self || elem != prev ) )
+				break;
+
+			q->visited++;
+
+			if ( xml_element_check( elem, id ) && !emit( plist, elem ) )
+				return;
+		}
+
+		for ( int i = first, j = plist->len - 1; i < j; i++, j-- ) {
+
+			void* aux = plist->list[i];
+			plist->list[i] = plist->list[j];
+			plist->list[j] = aux;
+		}
+	}
+}
+
+
+static void xml_get_ancestor ( struct query* q, struct ptr_list* plist,
+                               struct xml_element** list, int id ) {
+
+	get_ancestors( q, plist, list, id, false );
+}
+
+
+static void xml_get_ancestor_or_self ( struct query* q,
+                                       struct ptr_list* plist,
+                                       struct xml_element** list,
+                                       int id ) {
+
+	get_ancestors( q, plist, list, id, true );
+}
+
+
+static void xml_get_attribute ( struct query* q, struct ptr_list* plist,
+                                struct xml_element** list, int id ) {
+
+	for ( struct xml_element** l = list; *l; l++ ) {
+
+		if ( (*l)->status & IS_ATTRIBUTE_STATUS ) continue;
+
+		struct xml_index* index = NULL;
+
+		if ( id != ANY_NAME )
+			index = lookup_index( q, (*l)->attr, &(*l)->attr_index );
+
+		if ( !index ) {
+
+			for ( struct xml_attribute* attr = (*l)->attr; attr;
+			      attr = attr->next ) {
+				q->visited++;
+				if ( id == ANY_NAME || attr->name_id == id )
+					if ( !emit( plist, attr ) ) return;
+			}
+			continue;
+		}
+
+		struct xml_index_entry* node = xml_index_check( index, id );
+
+		for ( int i = 0; node && i < node->len; i++, q->visited++ )
+			if ( !emit( plist, node->list[i] ) ) return;
+	}
+}
+
+
+static void xml_get_child ( struct query* q, struct ptr_list* plist,
+                            struct xml_element** list, int id ) {
+
+	for ( struct xml_element** l = list; *l; l++ ) {
+
+		if ( (*l)->status & IS_ATTRIBUTE_STATUS ) continue;
+
+		struct xml_index* index = NULL;
+
+		if ( id != ANY_NAME )
+			index = lookup_index( q, (*l)->son, &(*l)->sons_index );
+
+		if ( !index ) {
+
+			for ( struct xml_element* elem = (*l)->son; elem;
+			      elem = elem->next ) {
+				q->visited++;
+				if ( id == ANY_NAME || elem->name_id == id )
+					if ( !emit( plist, elem ) ) return;
+			}
+			continue;
+		}
+
+		struct xml_index_entry* node = xml_index_check( index, id );
+
+		for ( int i = 0; node && i < node->len; i++, q->visited++ )
+			if ( !emit( plist, node->list[i] ) ) return;
+	}
+}
+
+
+/*
+ * Contexts inside the subtree walked last have nothing new below them.
+ * With postings a subtree is the range of its numbers in those of the name.
+ */
+static void get_descendants ( struct query* q, struct ptr_list* plist,
+                              struct xml_element** list, int id, bool self ) {
+
+	const struct postings* postings = q->doc->postings;
+	int walked = -1; // end of the last subtree walked
+
+	if ( id == ANY_NAME ) postings = NULL;
+
+	if ( postings ) q->used |= XML_USED_POSTINGS;
+
+	for ( struct xml_element** l = list; *l; l++ ) {
+
+		struct xml_element* top = *l;
+
+		if ( top->status & IS_ATTRIBUTE_STATUS ) {
+
+			if ( self && xml_element_check( top, id ) && !emit( plist, top ) )
+				return;
+			continue;
+		}
+
+		if ( top->order <= walked ) continue;
+
+		walked = top->end;
+
+		if ( postings ) {
+
+			struct xml_element** end;
+			struct xml_element** e = postings_find( postings, id,
+			                                        self ? top->order
+			                                             : top->order + 1,
+			                                        &end );
+
+			for ( ; e < end && (*e)->order <= top->end; e++, q->visited++ )
+				if ( !emit( plist, *e ) ) return;
+			continue;
+		}
+
+		struct xml_element* elem = self ? top : next_element( top, false );
+
+		for ( ; elem && elem->order <= top->end;
+		      elem = next_element( elem, false ) ) {
+			q->visited++;
+			if ( xml_element_check( elem, id ) && !emit( plist, elem ) )
+				return;
+		}
+	}
+}
+
+
+static void xml_get_descendant ( struct query* q, struct ptr_list* plist,
+                                 struct xml_element** list, int id ) {
+
+	get_descendants( q, plist, list, id, false );
+}
+
+
+static void xml_get_descendant_or_self ( struct query* q,
+                                         struct ptr_list* plist,
+                                         struct xml_element** list, int id ) {
+
+	get_descendants( q, plist, list, id, true );
+}
+
+
+/*
+ * The following nodes of a list are those after the end of the context
+ * that ends first, and the preceding ones those ending before the start
+ * of the last context.
+ */
+static void xml_get_following ( struct query* q, struct ptr_list* plist,
+                                struct xml_element** list, int id ) {
+
+	struct xml_element* first = *list;
+
+	for ( struct xml_element** l = list; *l; l++ )
+		if ( node_end( *l ) < node_end( first ) )
+			first = *l;
+
+	if ( !first ) return;
+
+	if ( q->doc->postings && id != ANY_NAME ) {
+
+		struct xml_element** end;
+		struct xml_element** e = postings_find( q->doc->postings, id,
+		                                        node_end( first ) + 1, &end );
+
+		q->used |= XML_USED_POSTINGS;
+
+		for ( ; e < end; e++, q->visited++ )
+			if ( !emit( plist, *e ) ) return;
+		return;
+	}
+
+	struct xml_element* elem = first->status & IS_ATTRIBUTE_STATUS
+	                           ? next_element( first->father, false )
+	                           : next_element( first, true );
+
+	for ( ; elem; elem = next_element( elem, false ) ) {
+		q->visited++;
+		if ( xml_element_check( elem, id ) && !emit( plist, elem ) )
+			return;
+	}
+}
+
+
+static void xml_get_preceding ( struct query* q, struct ptr_list* plist,
+                                struct xml_element** list, int id ) {
+
+	if ( !*list ) return;
+
+	int order = 0;
+
+	for ( struct xml_element** l = list; *l; l++ )
+		if ( (*l)->order > order )
+			order = (*l)->order;
+
+	if ( q->doc->postings && id != ANY_NAME ) {
+
+		struct xml_element** end;
+		struct xml_element** e = postings_find( q->doc->postings, id, 0,
+		                                        &end );
+
+		q->used |= XML_USED_POSTINGS;
+
+		for ( ; e < end && (*e)->order < order; e++, q->visited++ )
+			if ( (*e)->end < order && !emit( plist, *e ) ) return;
+		return;
+	}
+
+	struct xml_element* elem = q->doc->root.son;
+
+	for ( ; elem && elem->order < order; elem = next_element( elem, false ) ) {
+		q->visited++;
+		if ( elem->end < order && xml_element_check( elem, id ) )
+			if ( !emit( plist, elem ) ) return;
+	}
+}
+
+
+static int cmp_sibling ( const void* a, const void* b ) {
+
+	const struct xml_element* x = *(void* const*)a;
+	const struct xml_element* y = *(void* const*)b;
+
+	if ( x->father != y->father )
+		return x->father->order < y->father->order ? -1 : 1;
+
+	return ( x->order > y->order ) - ( x->order < y->order );
+}
+
+
+/*
+ * the element contexts of a list sorted by father, so that those sharing
+ * one are together and in document order; NULL if there is no memory
+ */
+static struct xml_element** group_siblings ( struct query* q,
+                                             struct xml_element** list,
+                                             int* len ) {
+
+	*len = 0;
+
+	for ( struct xml_element** l = list; *l; l++ ) (*len)++;
+
+	struct xml_element** sorted = scratch_reserve( &q->scratch,
+	                                           *len * sizeof( void* ) + 1 );
+	if ( !sorted ) return NULL;
+
+	*len = 0;
+
+	for ( struct xml_element** l = list; *l; l++ )
+		if ( (*l)->status & IS_ELEMENT_STATUS )
+			sorted[ (*len)++ ] = *l;
+
+	qsort( sorted, *len, sizeof( void* ), cmp_sibling );
+
+	return sorted;
+}
+
+
+static void xml_get_following_sibling ( struct query* q,
+                                        struct ptr_list* plist,
+                                        struct xml_element** list,
+                                        int id ) {
+
+	int len;
+	struct xml_element** sorted = group_siblings( q, list, &len );
+
+	if ( !sorted ) {
+		ptr_list_fail( plist );
+		return;
+	}
+
+	// the first context of every father has all the others after it
+	for ( int i = 0; i < len; i++ ) {
+
+		if ( i && sorted[i]->father == sorted[ i - 1 ]->father ) continue;
+
+		for ( struct xml_element* elem = sorted[i]->next; elem;
+		      elem = elem->next, q->visited++ )
+			if ( xml_element_check( elem, id ) && !emit( plist, elem ) )
+				return;
+	}
+}
+
+
+static void xml_get_namespace ( struct query* q, struct ptr_list* plist,
+                                struct xml_element** list, int id ) {
+
+	free( plist->list );
+	*plist = init_ptr_list;
+	(void)q;
+	(void)list;
+	(void)id;
+}
+
+
+static void xml_get_parent ( struct query* q, struct ptr_list* plist,
+                             struct xml_element** list, int id ) {
+
+	for ( struct xml_element** l = list; *l; l++, q->visited++ )
+		if ( xml_element_check( (*l)->father, id ) )
+			if ( !emit( plist, (*l)->father ) ) return;
+}
+
+
+static void xml_get_preceding_sibling ( struct query* q,
+                                        struct ptr_list* plist,
+                                        struct xml_element** list,
+                                        int id ) {
+
+	int len;
+	struct xml_element** sorted = group_siblings( q, list, &len );
+
+	if ( !sorted ) {
+		ptr_list_fail( plist );
+		return;
+	}
+
+	// and the last one all the others before it
+	for ( int i = 0; i < len; i++ ) {
+
+		if ( i + 1 < len && sorted[i]->father == sorted[ i + 1 ]->father )
+			continue;
+
+		for ( struct xml_element* elem = sorted[i]->father->son;
+		      elem != sorted[i]; elem = elem->next, q->visited++ )
+			if ( xml_element_check( elem, id ) && !emit( plist, elem ) )
+				return;
+	}
+}
+
+
+static void xml_get_self ( struct query* q, struct ptr_list* plist,
+                           struct xml_element** list, int id ) {
+
+	for ( struct xml_element** l = list; *l; l++, q->visited++ )
+		if ( xml_element_check( *l, id ) && !emit( plist, *l ) )
+			return;
+}
+
+
+#define NUM_AXES       13
+
+#define ANCESTOR_AXE    0
+#define ATTRIBUTE_AXE   2
+#define CHILD_AXE       3
+#define FOLLOWING_AXE   6
+#define NAMESPACE_AXE   8
+#define PARENT_AXE      9
+#define PRECEDING_AXE  10
+#define SELF_AXE       12
+#define ANCESTOR_OR_SELF_AXE    1
+#define DESCENDANT_AXE          4
+#define DESCENDANT_OR_SELF_AXE  5
+#define FOLLOWING_SIBLING_AXE   7
+#define PRECEDING_SIBLING_AXE  11
+
+static const char* axes[ NUM_AXES ] = {
+
+	"ancestor",   "ancestor-or-self",   "attribute", "child",
+	"descendant", "descendant-or-self", "following", "following-sibling",
+	"namespace",  "parent",             "preceding", "preceding-sibling",
+	"self"
+};
+
+typedef void (*axe_handler) ( struct query*, struct ptr_list*,
+                              struct xml_element**, int );
+
+static const axe_handler axe_handlers[ NUM_AXES ] = {
+
+	xml_get_ancestor, xml_get_ancestor_or_self, xml_get_attribute,
+	xml_get_child,    xml_get_descendant,       xml_get_descendant_or_self,
+	xml_get_following,xml_get_following_sibling,xml_get_namespace,
+	xml_get_parent,   xml_get_preceding,        xml_get_preceding_sibling,
+	xml_get_self
+};
+
+
+/*
+ * A compiled query: the axis and name of every step, worked out once.
+ * ids belong to names, the table the plan was compiled against; documents
+ * using any other table get their ids looked up by name when run.
+ */
+enum xml_start {
+
+	START_DESCENDANTS, // relative query
+	START_SELF,        // "/..."
+	START_FIRST_SON    // "//..."
+};
+
+/*
+ * A predicate keeps, of the nodes a step finds from each context, those
+ * at a position, the last one, or those with an attribute (of a value) or
+ * a child element named id.
+ */
+enum pred_type {
+
+	PRED_POSITION,
+	PRED_LAST,
+	PRED_ATTRIBUTE,
+	PRED_ATTRIBUTE_VALUE,
+	PRED_CHILD
+};
+
+struct xml_pred {
+
+	enum pred_type type;
+	int position;
+
+	int id;
+	const char* name;
+	int name_len;
+
+	const char* value;
+	int value_len;
+};
+
+/*
+ * The predicates of a "//" step count positions among the siblings of
+ * each node, as in XPath, and those of any other step along the axis from
+ * each context.
+ */
+struct xml_step {
+
+	int axe;
+	int id;
+	const char* name;
+	int name_len;
+
+	bool by_father;
+	int pred; // first one, in the plan
+	int preds;
+};
+
+struct xml_plan {
+
+	const struct xml_names* names;
+	enum xml_start start;
+
+	int len;
+	struct xml_step* steps;
+
+	int preds;
+	struct xml_pred* pred;
+};
+
+
+static int name_test ( const struct xml_names* names, const char* name,
+                       int name_len ) {
+
+	if ( name_len == 1 && name[0] == '*' ) return ANY_NAME;
+
+	return xml_names_find( names, name, name_len );
+}
+
+
+static int find_axe ( const char* name, int name_len ) {
+
+	int m = -1, M = NUM_AXES;
+
+	while ( M - m > 1 ) {
+
+		int med = ( m + M )/2;
+		int ret = strncmp( axes[ med ], name, name_len );
+
+		if ( ret == 0 && axes[ med ][ name_len ] == 0 ) return med;
+
+		if ( ret < 0 ) m = med;
+		else M = med;
+	}
+
+	return -1;
+}
+
+
+static bool is_name_char ( int c ) {
+
+	return c && !is_space( c ) && !strchr( "=[]()@/'\"", c );
+}
+
+
+/*
+ * parses the predicate in [p, end), spaces trimmed, into pred; false if
+ * it is not one of those supported
+ */
+static bool compile_pred ( const char* p, const char* end,
+                           struct xml_pred* pred ) {
+
+	for ( ; p < end && is_space( (unsigned char)*p ); p++ ) ;
+	for ( ; end > p && is_space( (unsigned char)end[-1] ); end-- ) ;
+
+	*pred = (struct xml_pred){ PRED_CHILD, 0, NO_NAME, NULL, 0, NULL, 0 };
+
+	if ( p == end ) return false;
+
+	if ( *p >= '0' && *p <= '9' ) {
+
+		pred->type = PRED_POSITION;
+
+		for ( ; p < end && *p >= '0' && *p <= '9'; p++ )
+			if ( pred->position < 100000000 )
+				pred->position = 10 * pred->position + *p - '0';
+
+		return p == end;
+	}
+
+	if ( end - p == 6 && memcmp( p, "last()", 6 ) == 0 ) {
+		pred->type = PRED_LAST;
+		return true;
+	}
+
+	if ( *p == '@' ) {
+		pred->type = PRED_ATTRIBUTE;
+		p++;
+	}
+
+	pred->name = p;
+	for ( ; p < end && is_name_char( (unsigned char)*p ); p++ ) ;
+	pred->name_len = p - pred->name;
+
+	if ( !pred->name_len ) return false;
+	if ( p == end ) return true;
+
+	if ( pred->type != PRED_ATTRIBUTE ) return false;
+
+	for ( ; p < end && is_space( (unsigned char)*p ); p++ ) ;
+	if ( p == end || *p++ != '=' ) return false;
+	for ( ; p < end && is_space( (unsigned char)*p ); p++ ) ;
+
+	if ( end - p < 2 || ( *p != '\'' && *p != '"' ) || end[-1] != *p )
+		return false;
+
+	pred->type = PRED_ATTRIBUTE_VALUE;
+	pred->value = p + 1;
+	pred->value_len = end - p - 2;
+
+	return !memchr( pred->value, *p, pred->value_len );
+}
+
+
+static bool compile_step ( const char** query, struct xml_step* step,
+                           struct xml_plan* plan ) {
+
+	const char* q = *query;
+
+	step->axe = CHILD_AXE;
+	step->by_father = false;
+
+	switch ( *q ) {
+
+		case '/':
+			q++;
+			step->axe = DESCENDANT_OR_SELF_AXE;
+			step->by_father = true;
+			break;
+
+		case '@':
+			q++;
+			step->axe = ATTRIBUTE_AXE;
+			break;
+
+		case '.':
+			if ( *++q == '.' ) {
+				q++;
+				step->axe = PARENT_AXE;
+			} else
+				step->axe = SELF_AXE;
+			break;
+	}
+
+	const char* start = q;
+
+	for ( ; *q && *q != '/' && *q != '['; q++ ) {
+
+		if ( *q == ':' ) {
+
+			int axe = find_axe( start, q - start );
+			if ( axe >= 0 ) {
+				step->axe = axe;
+				step->by_father = false;
+			}
+
+			if ( q[1] == ':' ) q++;
+			start = q + 1;
+		}
+	}
+
+	step->name = start;
+	step->name_len = q - start;
+
+	step->pred = plan->preds;
+	step->preds = 0;
+
+	while ( *q == '[' ) {
+
+		const char* open = ++q;
+		int i = 1;
+
+		for ( ; *q && i; ++q )
+			i += ( *q == '[' ) - ( *q == ']' );
+
+		if ( i || !compile_pred( open, q - 1, plan->pred + plan->preds++ ) )
+			return false;
+
+		step->preds++;
+	}
+
+	// a step ends with the query or a slash
+	if ( *q && *q++ != '/' ) return false;
+
+	*query = q;
+	return true;
+}
+
+
+static enum STATE compile_name ( struct xml_names* names, const char* name,
+                                  int name_len, int* id ) {
+
+	if ( name_len == 1 && name[0] == '*' ) {
+		*id = ANY_NAME;
+	} else if ( names ) {
+		*id = names_intern( names, name, name_len, NULL );
+		if ( *id == NO_NAME ) return MEMORY_ERROR;
+	} else
+		*id = NO_NAME;
+
+	return OK;
+}
+
+
+static struct xml_plan* compile ( const char* query,
+                                  struct xml_names* names ) {
+
+	size_t len = strlen( query );
+	size_t preds = 0;
+
+	// a step takes at least a character of the query, a predicate its '['
+	for ( const char* p = query; ( p = strchr( p, '[' ) ); p++ ) preds++;
+
+	struct xml_plan* plan = malloc( sizeof( struct xml_plan ) +
+	                                len * sizeof( struct xml_step ) +
+	                                preds * sizeof( struct xml_pred ) +
+	                                len + 1 );
+	if ( !plan ) return NULL;
+
+	plan->steps = (struct xml_step*)( plan + 1 );
+	plan->pred = (struct xml_pred*)( plan->steps + len );
+
+	char* text = (char*)( plan->pred + preds );
+	memcpy( text, query, len + 1 );
+
+	plan->names = names;
+	plan->len = 0;
+	plan->preds = 0;
+
+	const char* q = text;
+
+	if ( q[0] != '/' ) {
+		plan->start = START_DESCENDANTS;
+	} else
+	if ( q++[1] != '/' ) {
+		plan->start = START_SELF;
+	} else {
+		plan->start = START_FIRST_SON;
+	}
+
+	while ( *q ) {
+
+		struct xml_step* step = plan->steps + plan->len++;
+
+		if ( !compile_step( &q, step, plan ) ) {
+			free( plan );
+			return NULL;
+		}
+
+		if ( compile_name( names, step->name, step->name_len,
+		                   &step->id ) != OK ) {
+			free( plan );
+			return NULL;
+		}
+	}
+
+	for ( int i = 0; i < plan->preds; i++ ) {
+
+		struct xml_pred* pred = plan->pred + i;
+
+		if ( pred->name && compile_name( names, pred->name, pred->name_len,
+		                                 &pred->id ) != OK ) {
+			free( plan );
+			return NULL;
+		}
+	}
+
+	return plan;
+}
+
+
+struct xml_plan* xml_compile ( const char* query ) {
+
+	return compile( query, NULL );
+}
+
+
+struct xml_plan* xml_compile_opt ( const char* query,
+                                   const struct xml_options* opt ) {
+
+	return compile( query, opt ? opt->names : NULL );
+}
+
+
+void free_xml_plan ( struct xml_plan* plan ) {
+
+	free( plan );
+}
+
+
+/*
+ * Predicates run as a cascade, fed the nodes of a step from one context
+ * at a time in axis order: each one passes a node on to the next or drops
+ * it, and last() holds on to the latest node until the context is done.
+ * Once a position is reached before any last(), nothing after it can pass
+ * and the axis is stopped.
+ */
+struct pred_run {
+
+	struct query* q;
+	const struct xml_pred* preds;
+	const int* ids;
+	int len;
+
+	int* count; // nodes that reached every predicate, this context
+	void** held; // by every last()
+
+	const struct ptr_list* cands; // only these pass, if set
+	struct ptr_list* out;
+	bool failed; // out of memory
+};
+
+
+static bool has_named ( struct query* q, void* list, struct xml_index** index,
+                        int id, const struct xml_pred* pred ) {
+
+	struct xml_index_entry* entry = NULL;
+	struct xml_index* found = NULL;
+
+	if ( id == NO_NAME ) return false;
+
+	if ( id != ANY_NAME && !pred->value )
+		found = lookup_index( q, list, index );
+
+	if ( found ) {
+		entry = xml_index_check( found, id );
+		return entry != NULL;
+	}
+
+	for ( struct xml_element* i = list; i; i = i->next ) {
+
+		q->visited++;
+
+		if ( id != ANY_NAME && i->name_id != id ) continue;
+		if ( !pred->value ) return true;
+
+		int len;
+		const char* value = xml_value( i, &len );
+
+		if ( len == pred->value_len &&
+		     memcmp( value, pred->value, pred->value_len ) == 0 )
+			return true;
+	}
+
+	return false;
+}
+
+
+static bool pred_test ( struct query* q, const struct xml_pred* pred, int id,
+                        struct xml_element* node ) {
+
+	if ( node->status & IS_ATTRIBUTE_STATUS ) return false;
+
+	if ( pred->type == PRED_CHILD )
+		return has_named( q, node->son, &node->sons_index, id, pred );
+
+	return has_named( q, node->attr, &node->attr_index, id, pred );
+}
+
+
+/*
+ * runs node through the predicates from the one at first; false when the
+ * context has nothing more to give
+ */
+static bool pred_pass ( struct pred_run* run, void* node, int first ) {
+
+	bool done = false, holding = false;
+
+	for ( int i = 0; i < first; i++ )
+		holding = holding || run->preds[i].type == PRED_LAST;
+
+	for ( int i = first; i < run->len; i++ ) {
+
+		const struct xml_pred* pred = run->preds + i;
+
+		switch ( pred->type ) {
+
+			case PRED_POSITION:
+				if ( ++run->count[i] != pred->position )
+					return run->count[i] < pred->position || holding;
+				done = done || !holding;
+				break;
+
+			case PRED_LAST:
+				run->held[i] = node;
+				return true;
+
+			default:
+				if ( !pred_test( run->q, pred, run->ids[i], node ) )
+					return !done;
+		}
+	}
+
+	if ( run->cands && !bsearch( &node, run->cands->list, run->cands->len,
+	                             sizeof( void* ), cmp_order ) )
+		return !done;
+
+	if ( !emit( run->out, node ) ) {
+		run->failed = true;
+		return false;
+	}
+
+	return !done;
+}
+
+
+static int pred_each ( void* node, void* ctx ) {
+
+	return !pred_pass( ctx, node, 0 );
+}
+
+
+static void pred_context ( struct pred_run* run, int axe,
+                           struct xml_element* context, int id ) {
+
+	struct xml_element* list[2] = { context, NULL };
+
+	memset( run->count, 0, run->len * sizeof( int ) );
+	memset( run->held, 0, run->len * sizeof( void* ) );
+
+	if ( axe == ANCESTOR_AXE || axe == ANCESTOR_OR_SELF_AXE ||
+	     axe == PRECEDING_AXE || axe == PRECEDING_SIBLING_AXE ) {
+
+		// reverse axes count from the context backwards
+		struct ptr_list found = init_ptr_list;
+
+		axe_handlers[ axe ]( run->q, &found, list, id );
+
+		if ( found.failed ) run->failed = true;
+
+		for ( int i = found.len - 1; i >= 0; i-- )
+			if ( !pred_pass( run, found.list[i], 0 ) ) break;
+
+		free( found.list );
+
+	} else {
+
+		struct ptr_list sink = init_ptr_list;
+
+		sink.each = pred_each;
+		sink.ctx = run;
+
+		axe_handlers[ axe ]( run->q, &sink, list, id );
+	}
+
+	for ( int i = 0; i < run->len; i++ )
+		if ( run->preds[i].type == PRED_LAST && run->held[i] ) {
+			void* node = run->held[i];
+			run->held[i] = NULL;
+			pred_pass( run, node, i + 1 );
+		}
+}
+
+
+static void pred_step ( struct query* q, struct ptr_list* out,
+                        struct xml_element** list, const struct xml_plan* plan,
+                        const struct xml_step* step, const int* ids ) {
+
+	int id = ids ? ids[ step - plan->steps ] : step->id;
+	int pred_ids[ step->preds ];
+
+	for ( int i = 0; i < step->preds; i++ )
+		pred_ids[i] = ids ? ids[ plan->len + step->pred + i ]
+		                  : plan->pred[ step->pred + i ].id;
+
+	int count[ step->preds ];
+	void* held[ step->preds ];
+
+	struct pred_run run = { q, plan->pred + step->pred, pred_ids,
+	                        step->preds, count, held, NULL, out, false };
+
+	if ( !step->by_father ) {
+
+		for ( ; *list && !run.failed; list++ )
+			pred_context( &run, step->axe, *list, id );
+
+		if ( run.failed ) ptr_list_fail( out );
+		return;
+	}
+
+	// the nodes the step finds, counted among the same named sons of
+	// their fathers
+	struct ptr_list cands = init_ptr_list;
+	struct ptr_list fathers = init_ptr_list;
+
+	axe_handlers[ step->axe ]( q, &cands, list, id );
+	ptr_list_normalize( &cands );
+
+	run.failed = cands.failed;
+
+	for ( int i = 0; i < cands.len && !run.failed; i++ )
+		if ( ptr_list_push_back( ((struct xml_element*)cands.list[i])->father,
+		                         &fathers ) != OK )
+			run.failed = true;
+
+	ptr_list_normalize( &fathers );
+
+	run.cands = &cands;
+
+	for ( int i = 0; i < fathers.len && !run.failed; i++ )
+		pred_context( &run, CHILD_AXE, fathers.list[i], id );
+
+	if ( run.failed ) ptr_list_fail( out );
+
+	free( cands.list );
+	free( fathers.list );
+}
+
+
+/*
+ * whether an axis finds the nodes of a normalized list in document order
+ * and without duplicates, so they can go straight to a handler
+ */
+static bool ordered_axe ( int axe, struct xml_element** list ) {
+
+	switch ( axe ) {
+
+		case ATTRIBUTE_AXE:
+		case DESCENDANT_AXE:
+		case FOLLOWING_AXE:
+		case PRECEDING_AXE:
+		case SELF_AXE:
+			return true;
+
+		case DESCENDANT_OR_SELF_AXE:
+			for ( ; *list; list++ )
+				if ( (*list)->status & IS_ATTRIBUTE_STATUS ) return false;
+			return true;
+
+		case CHILD_AXE:
+			for ( ; *list && list[1]; list++ )
+				if ( list[1]->order <= node_end( list[0] ) ) return false;
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * Profiles keep their steps and copies of the names tested in one block.
+ */
+static enum STATE profile_init ( struct xml_profile* profile,
+                                 const struct xml_plan* plan ) {
+
+	int first = plan->start == START_DESCENDANTS;
+	size_t names = first ? 2 : 0;
+
+	for ( int i = 0; i < plan->len; i++ )
+		names += plan->steps[i].name_len + 1;
+
+	profile->len = first + plan->len;
+	profile->steps = calloc( 1, profile->len *
+	                            sizeof( struct xml_step_profile ) + names );
+	if ( !profile->steps ) return MEMORY_ERROR;
+
+	char* name = (char*)( profile->steps + profile->len );
+
+	for ( int i = -first; i < plan->len; i++ ) {
+
+		struct xml_step_profile* step = profile->steps + first + i;
+		const char* str = i < 0 ? "*" : plan->steps[i].name;
+		int len = i < 0 ? 1 : plan->steps[i].name_len;
+
+		step->axis = axes[ i < 0 ? DESCENDANT_AXE : plan->steps[i].axe ];
+		step->name = memcpy( name, str, len );
+		step->preds = i < 0 ? 0 : plan->steps[i].preds;
+
+		name[ len ] = 0;
+		name += len + 1;
+	}
+
+	return OK;
+}
+
+
+/*
+ * Runs a plan into out, or into its handler, which gets the last step
+ * straight from the axis when the nodes come out in order. Steps are
+ * measured into profile, if given.
+ */
+static enum STATE exec_plan ( const struct xml_plan* plan,
+                              struct xml_element* element,
+                              struct ptr_list* out,
+                              struct xml_profile* profile ) {
+
+	struct ptr_list list = init_ptr_list;
+
+	struct query q = { document_of( element ), { 0, NULL }, 0, 0 };
+
+	const struct xml_names* names = q.doc->names;
+
+	int* ids = NULL;
+
+	if ( names != plan->names && plan->len ) {
+
+		ids = malloc( ( plan->len + plan->preds ) * sizeof( int ) );
+		if ( !ids ) return MEMORY_ERROR;
+
+		for ( int i = 0; i < plan->len; i++ ) {
+
+			const struct xml_step* step = plan->steps + i;
+
+			ids[i] = name_test( names, step->name, step->name_len );
+		}
+
+		for ( int i = 0; i < plan->preds; i++ ) {
+
+			const struct xml_pred* pred = plan->pred + i;
+
+			ids[ plan->len + i ] = pred->name ? name_test( names, pred->name,
+			                                               pred->name_len )
+			                                  : NO_NAME;
+		}
+	}
+
+	struct xml_element* start = plan->start == START_FIRST_SON ? element->son
+	                                                           : element;
+
+	if ( ptr_list_push_back( start, &list ) != OK ) {
+		free( list.list );
+		free( ids );
+		return MEMORY_ERROR;
+	}
+
+	// a relative query starts with the descendants
+	int i = plan->start == START_DESCENDANTS ? -1 : 0;
+	int first = i;
+
+	for ( ; i < plan->len && list.list; i++ ) {
+
+		struct ptr_list aux = init_ptr_list;
+		double started = profile ? now() : 0;
+		size_t visited = q.visited;
+
+		q.used = 0;
+
+		int axe = i < 0 ? DESCENDANT_AXE : plan->steps[i].axe;
+		int id = i < 0 ? ANY_NAME : ids ? ids[i] : plan->steps[i].id;
+
+		if ( i >= 0 && plan->steps[i].preds ) {
+
+			pred_step( &q, &aux, (void*)list.list, plan, plan->steps + i,
+			           ids );
+
+		} else if ( i == plan->len - 1 && out->each &&
+		            ordered_axe( axe, (void*)list.list ) ) {
+
+			axe_handlers[ axe ]( &q, out, (void*)list.list, id );
+
+			free( list.list );
+			list = init_ptr_list;
+			break;
+
+		} else
+			axe_handlers[ axe ]( &q, &aux, (void*)list.list, id );
+
+		if ( aux.failed || out->failed ) {
+			free( aux.list );
+			free( list.list );
+			free( ids );
+			free( q.scratch.buf );
+			return MEMORY_ERROR;
+		}
+
+		ptr_list_normalize( &aux );
+
+		if ( profile ) {
+
+			struct xml_step_profile* step = profile->steps + i - first;
+
+			step->input = list.len;
+			step->output = aux.len;
+			step->visited = q.visited - visited;
+			step->used = q.used;
+			step->ns = ( now() - started ) * 1e9;
+		}
+
+		free( list.list );
+		list = aux;
+	}
+
+	free( ids );
+	free( q.scratch.buf );
+
+	if ( out->each ) {
+
+		for ( int j = 0; j < list.len && emit( out, list.list[j] ); j++ ) ;
+
+		free( list.list );
+		return out->failed ? MEMORY_ERROR : OK;
+	}
+
+	*out = list;
+	return OK;
+}
+
+
+void** xml_exec ( const struct xml_plan* plan, struct xml_element* element ) {
+
+	struct ptr_list list = init_ptr_list;
+
+	if ( exec_plan( plan, element, &list, NULL ) != OK ||
+	     ptr_list_push_back( NULL, &list ) != OK ) {
+		free( list.list );
+		return NULL;
+	}
+
+	return list.list;
+}
+
+
+int xml_exec_each ( const struct xml_plan* plan, struct xml_element* element,
+                    xml_match_handler handler, void* ctx ) {
+
+	struct ptr_list sink = init_ptr_list;
+
+	sink.each = handler;
+	sink.ctx = ctx;
+
+	return exec_plan( plan, element, &sink, NULL ) == OK ? 0 : -1;
+}
+
+
+void** xml_exec_profiled ( const struct xml_plan* plan,
+                           struct xml_element* element,
+                           struct xml_profile* profile ) {
+
+	struct ptr_list list = init_ptr_list;
+	double started = now();
+
+	memset( profile, 0, sizeof( struct xml_profile ) );
+
+	if ( profile_init( profile, plan ) != OK ||
+	     exec_plan( plan, element, &list, profile ) != OK ||
+	     ptr_list_push_back( NULL, &list ) != OK ) {
+		free( list.list );
+		return NULL;
+	}
+
+	profile->results = list.len - 1;
+	profile->ns = ( now() - started ) * 1e9;
+
+	return list.list;
+}
+
+
+void free_xml_profile ( struct xml_profile* profile ) {
+
+	free( profile->steps );
+	memset( profile, 0, sizeof( struct xml_profile ) );
+}
+
+
+void print_xml_profile ( FILE* out, const struct xml_profile* profile ) {
+
+	static const char* uses[] = { "", "index", "postings", "both" };
+
+	fprintf( out, "%d steps, %zu results, %.3f ms\n", profile->len,
+	         profile->results, profile->ns * 1e-6 );
+	fprintf( out, "  %-18s  %-16s %5s %10s %10s %10s  %-8s %10s\n", "axis",
+	         "name", "preds", "in", "out", "visited", "uses", "ms" );
+
+	for ( int i = 0; i < profile->len; i++ ) {
+
+		const struct xml_step_profile* step = profile->steps + i;
+
+		fprintf( out, "  %-18s  %-16s %5d %10zu %10zu %10zu  %-8s %10.3f\n",
+		         step->axis, step->name, step->preds, step->input,
+		         step->output, step->visited, uses[ step->used & 3 ],
+		         step->ns * 1e-6 );
+	}
+}
+
+
+/*
+ * Streaming evaluation keeps, for every open element, which steps of the
+ * plan it is the context of (it matched all the steps before them) and
+ * which descendant steps its own descendants are under. Elements with
+ * neither, that are not a match themselves, are skipped whole.
+ */
+struct stream_frame {
+
+	const char* value;
+	int value_len;
+	bool match;
+};
+
+struct stream {
+
+	const struct xml_plan* plan;
+	int width; // states per element, plan len + 1
+
+	char* states; // per depth: context states, then inherited ones
+	struct stream_frame* frames;
+	int max_depth;
+};
+
+
+static bool step_test ( const struct xml_step* step, const char* name,
+                        int name_len ) {
+
+	return step->id == ANY_NAME || ( step->name_len == name_len &&
+	                                 !memcmp( step->name, name, name_len ) );
+}
+
+
+static enum STATE stream_grow ( struct stream* st, int depth ) {
+
+	if ( depth < st->max_depth ) return OK;
+
+	int max_depth = 2 * depth + 16;
+
+	void* aux = realloc( st->states, (size_t)max_depth * 2 * st->width );
+	if ( !aux ) return MEMORY_ERROR;
+	st->states = aux;
+
+	aux = realloc( st->frames, max_depth * sizeof( struct stream_frame ) );
+	if ( !aux ) return MEMORY_ERROR;
+	st->frames = aux;
+
+	st->max_depth = max_depth;
+	return OK;
+}
+
+
+/*
+ * works out the states of a new element at depth from those of its father,
+ * and returns whether anything under it may still match
+ */
+static bool stream_enter ( struct stream* st, int depth, bool first,
+                           const struct xml_event* ev ) {
+
+	const struct xml_plan* plan = st->plan;
+	int len = plan->len;
+
+	const char* father = st->states + (size_t)( depth - 1 ) * 2 * st->width;
+	char* context = st->states + (size_t)depth * 2 * st->width;
+	char* inherited = context + st->width;
+
+	bool relevant = plan->start == START_DESCENDANTS;
+
+	memset( context, 0, st->width );
+
+	if ( plan->start == START_DESCENDANTS ||
+	     ( plan->start == START_FIRST_SON && depth == 1 && first ) )
+		context[0] = 1;
+
+	for ( int k = 0; k < len; k++ ) {
+
+		int axe = plan->steps[k].axe;
+
+		inherited[k] = father[ st->width + k ] ||
+		               ( father[k] && ( axe == DESCENDANT_AXE ||
+		                                axe == DESCENDANT_OR_SELF_AXE ) );
+
+		if ( ( inherited[k] || ( father[k] && axe == CHILD_AXE ) ) &&
+		     step_test( plan->steps + k, ev->name, ev->name_len ) )
+			context[ k + 1 ] = 1;
+	}
+
+	for ( int k = 0; k < len; k++ ) {
+
+		if ( !context[k] ) continue;
+
+		int axe = plan->steps[k].axe;
+
+		if ( ( axe == SELF_AXE || axe == DESCENDANT_OR_SELF_AXE ) &&
+		     step_test( plan->steps + k, ev->name, ev->name_len ) )
+			context[ k + 1 ] = 1;
+
+		if ( axe != SELF_AXE ) relevant = true;
+	}
+
+	for ( int k = 0; k < len && !relevant; k++ )
+		relevant = inherited[k];
+
+	st->frames[ depth ] = (struct stream_frame){ NULL, 0, context[ len ] };
+
+	return relevant || context[ len ];
+}
+
+
+/*
+ * whether an attribute of the element at depth matches
+ */
+static bool stream_attribute ( struct stream* st, int depth,
+                               const struct xml_event* ev ) {
+
+	const struct xml_plan* plan = st->plan;
+	const char* context = st->states + (size_t)depth * 2 * st->width;
+
+	for ( int k = 0; k < plan->len; k++ ) {
+
+		const struct xml_step* step = plan->steps + k;
+
+		if ( !context[k] || step->axe != ATTRIBUTE_AXE ||
+		     !step_test( step, ev->name, ev->name_len ) )
+			continue;
+
+		// only self steps may follow an attribute
+		int i = k + 1;
+
+		while ( i < plan->len &&
+		        step_test( plan->steps + i, ev->name, ev->name_len ) )
+			i++;
+
+		if ( i == plan->len ) return true;
+	}
+
+	return false;
+}
+
+
+int xml_stream ( const struct xml_plan* plan, struct xml_reader* reader,
+                 xml_event_handler handler, void* ctx ) {
+
+	if ( plan->preds ) return -1;
+
+	for ( int k = 0, attr = false; k < plan->len; k++ ) {
+
+		int axe = plan->steps[k].axe;
+
+		if ( attr ? axe != SELF_AXE
+		          : axe != CHILD_AXE && axe != DESCENDANT_AXE &&
+		            axe != DESCENDANT_OR_SELF_AXE && axe != SELF_AXE &&
+		            axe != ATTRIBUTE_AXE )
+			return -1;
+
+		attr = attr || axe == ATTRIBUTE_AXE;
+	}
+
+	struct stream st = { plan, plan->len + 1, NULL, NULL, 0 };
+
+	if ( stream_grow( &st, 0 ) != OK ) {
+		free( st.states );
+		free( st.frames );
+		return -1;
+	}
+
+	// the meta root: only "/..." queries start there
+	memset( st.states, 0, 2 * st.width );
+	st.states[0] = plan->start == START_SELF;
+	st.frames[0] = (struct stream_frame){ NULL, 0, false };
+
+	struct xml_event ev;
+	bool first = true;
+	int ret = -1;
+
+	while ( true ) {
+
+		enum xml_event_type type = xml_reader_next( reader, &ev );
+
+		if ( type == XML_END_DOCUMENT ) ret = 0;
+		if ( type == XML_END_DOCUMENT || type == XML_ERROR ) break;
+
+		struct stream_frame* frame = st.frames + ev.depth;
+
+		switch ( type ) {
+
+			case XML_START_ELEMENT:
+
+				if ( stream_grow( &st, ev.depth ) != OK ) goto end;
+				frame = st.frames + ev.depth;
+
+				if ( !stream_enter( &st, ev.depth, first, &ev ) )
+					if ( xml_reader_skip( reader ) == XML_ERROR ) goto end;
+
+				first = first && ev.depth != 1;
+				break;
+
+			case XML_ATTRIBUTE:
+
+				if ( stream_attribute( &st, ev.depth, &ev ) )
+					handler( &ev, ctx );
+				break;
+
+			case XML_TEXT:
+
+				frame->value = ev.value;
+				frame->value_len = ev.value_len;
+				break;
+
+			case XML_END_ELEMENT:
+
+				if ( frame->match ) {
+					ev.value = frame->value;
+					ev.value_len = frame->value_len;
+					handler( &ev, ctx );
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+
+end:
+	free( st.states );
+	free( st.frames );
+
+	return ret;
+}
+
+
+void** xml_get ( struct xml_element* element, const char* query ) {
+
+	struct xml_plan* plan = xml_compile( query );
+	if ( !plan ) return NULL;
+
+	void** list = xml_exec( plan, element );
+
+	free_xml_plan( plan );
+
+	return list;
+}
+
+
+void** xml_get_profiled ( struct xml_element* element, const char* query,
+                          struct xml_profile* profile ) {
+
+	memset( profile, 0, sizeof( struct xml_profile ) );
+
+	struct xml_plan* plan = xml_compile( query );
+	if ( !plan ) return NULL;
+
+	void** list = xml_exec_profiled( plan, element, profile );
+
+	free_xml_plan( plan );
+
+	return list;
+}
+
+
+int xml_get_each ( struct xml_element* element, const char* query,
+                   xml_match_handler handler, void* ctx ) {
+
+	struct xml_plan* plan = xml_compile( query );
+	if ( !plan ) return -1;
+
+	int ret = xml_exec_each( plan, element, handler, ctx );
+
+	free_xml_plan( plan );
+
+	return ret;
+}
+
+
+static int first_match ( void* node, void* ctx ) {
+
+	*(void**)ctx = node;
+	return 1;
+}
+
+
+void* xml_get_first ( struct xml_element* element, const char* query ) {
+
+	void* node = NULL;
+
+	if ( xml_get_each( element, query, first_match, &node ) != 0 )
+		return NULL;
+
+	return node;
+}
+
+
+static int count_match ( void* node, void* ctx ) {
+
+	(void)node;
+
+	++*(int*)ctx;
+	return 0;
+}
+
+
+int xml_count ( struct xml_element* element, const char* query ) {
+
+	int count = 0;
+
+	if ( xml_get_each( element, query, count_match, &count ) != 0 )
+		return -1;
+
+	return count;
+}
+
+
+void free_xml_list ( void** list ) {
+
+	free( list );
+}
+
+
+static size_t put_key ( char* key, size_t off, const void* data,
+                        size_t len ) {
+
+	if ( key && len ) memcpy( key + off, data, len );
+
+	return off + len;
+}
+
+
+/*
+ * the compiled steps of a plan as bytes, into key if not NULL, and their
+ * length: what the query does, however it was written
+ */
+static size_t plan_key ( const struct xml_plan* plan, char* key ) {
+
+	size_t off = put_key( key, 0, &plan->start, sizeof( plan->start ) );
+
+	for ( int i = 0; i < plan->len; i++ ) {
+
+		const struct xml_step* step = plan->steps + i;
+
+		off = put_key( key, off, &step->axe, sizeof( int ) );
+		off = put_key( key, off, &step->by_father, sizeof( bool ) );
+		off = put_key( key, off, &step->preds, sizeof( int ) );
+		off = put_key( key, off, &step->name_len, sizeof( int ) );
+		off = put_key( key, off, step->name, step->name_len );
+
+		for ( int j = 0; j < step->preds; j++ ) {
+
+			const struct xml_pred* pred = plan->pred + step->pred + j;
+
+			off = put_key( key, off, &pred->type, sizeof( pred->type ) );
+			off = put_key( key, off, &pred->position, sizeof( int ) );
+			off = put_key( key, off, &pred->name_len, sizeof( int ) );
+			off = put_key( key, off, pred->name, pred->name_len );
+			off = put_key( key, off, &pred->value_len, sizeof( int ) );
+			off = put_key( key, off, pred->value, pred->value_len );
+		}
+	}
+
+	return off;
+}
+
+
+static struct cached* cache_find ( struct result_cache* cache, unsigned hash,
+                                   const struct xml_element* context,
+                                   const char* key, size_t key_len ) {
+
+	struct cached* entry = cache->table[ hash & cache->mask ];
+
+	for ( ; entry; entry = entry->chain )
+		if ( entry->hash == hash && entry->context == context &&
+		     entry->key_len == key_len &&
+		     memcmp( entry->key, key, key_len ) == 0 )
+			return entry;
+
+	return NULL;
+}
+
+
+static void cache_unlink ( struct result_cache* cache, struct cached* entry ) {
+
+	*( entry->newer ? &entry->newer->older : &cache->newest ) = entry->older;
+	*( entry->older ? &entry->older->newer : &cache->oldest ) = entry->newer;
+}
+
+
+static void cache_push ( struct result_cache* cache, struct cached* entry ) {
+
+	entry->newer = NULL;
+	entry->older = cache->newest;
+
+	*( cache->newest ? &cache->newest->newer : &cache->oldest ) = entry;
+	cache->newest = entry;
+}
+
+
+/*
+ * a reference to the entry, now the most recently used; under the lock
+ */
+static struct cached* cache_hit ( struct result_cache* cache,
+                                  struct cached* entry ) {
+
+	cache_unlink( cache, entry );
+	cache_push( cache, entry );
+
+	atomic_add_int( &entry->refs, 1 );
+
+	return entry;
+}
+
+
+static void cache_evict ( struct result_cache* cache ) {
+
+	struct cached* entry = cache->oldest;
+	struct cached** link = &cache->table[ entry->hash & cache->mask ];
+
+	while ( *link != entry )
+		link = &(*link)->chain;
+
+	*link = entry->chain;
+
+	cache_unlink( cache, entry );
+	cache->len--;
+
+	release_cached( entry );
+}
+
+
+/*
+ * Runs the query out of the lock, so a thread that missed the same entry
+ * meanwhile may have added it first: its entry is kept and ours dropped.
+ */
+static struct cached* cache_fill ( struct result_cache* cache,
+                                   const struct xml_plan* plan,
+                                   struct xml_element* element,
+                                   const char* key, size_t key_len,
+                                   unsigned hash ) {
+
+	void** list = xml_exec( plan, element );
+	if ( !list ) return NULL;
+
+	size_t len = 0;
+
+	while ( list[len] ) len++;
+
+	struct cached* entry = malloc( sizeof( struct cached ) +
+	                               ( len + 1 ) * sizeof( void* ) + key_len );
+
+	if ( !entry ) {
+		free( list );
+		return NULL;
+	}
+
+	memcpy( entry->list, list, ( len + 1 ) * sizeof( void* ) );
+	free( list );
+
+	entry->key = memcpy( entry->list + len + 1, key, key_len );
+	entry->key_len = key_len;
+	entry->context = element;
+	entry->hash = hash;
+	entry->refs = 1;
+	entry->chain = entry->newer = entry->older = NULL;
+
+	if ( !cache ) return entry;
+
+	pthread_mutex_lock( &cache->lock );
+
+	struct cached* found = cache_find( cache, hash, element, key, key_len );
+
+	if ( found ) {
+
+		cache_hit( cache, found );
+		pthread_mutex_unlock( &cache->lock );
+
+		free( entry );
+		return found;
+	}
+
+	entry->refs = 2; // the cache's and ours
+	entry->chain = cache->table[ hash & cache->mask ];
+	cache->table[ hash & cache->mask ] = entry;
+
+	cache_push( cache, entry );
+
+	if ( ++cache->len > cache->max_len )
+		cache_evict( cache );
+
+	pthread_mutex_unlock( &cache->lock );
+
+	return entry;
+}
+
+
+void* const* xml_exec_cached ( const struct xml_plan* plan,
+                               struct xml_element* element ) {
+
+	struct result_cache* cache = document_of( element )->cache;
+	struct cached* entry = NULL;
+	char local[256];
+
+	size_t key_len = plan_key( plan, NULL );
+	char* key = key_len <= sizeof( local ) ? local : malloc( key_len );
+	if ( !key ) return NULL;
+
+	plan_key( plan, key );
+
+	unsigned hash = hash_name( key, key_len ) ^
+	                (unsigned)( (uintptr_t)element / sizeof( void* ) ) *
+	                2654435761u;
+
+	if ( cache ) {
+
+		pthread_mutex_lock( &cache->lock );
+
+		entry = cache_find( cache, hash, element, key, key_len );
+
+		if ( entry ) {
+			cache_hit( cache, entry );
+			cache->hits++;
+		} else
+			cache->misses++;
+
+		pthread_mutex_unlock( &cache->lock );
+	}
+
+	if ( !entry )
+		entry = cache_fill( cache, plan, element, key, key_len, hash );
+
+	if ( key != local ) free( key );
+
+	return entry ? entry->list : NULL;
+}
+
+
+void* const* xml_get_cached ( struct xml_element* element,
+                              const char* query ) {
+
+	struct xml_plan* plan = xml_compile( query );
+	if ( !plan ) return NULL;
+
+	void* const* list = xml_exec_cached( plan, element );
+
+	free_xml_plan( plan );
+
+	return list;
+}
+
+
+void free_xml_cached ( void* const* list ) {
+
+	if ( list )
+		release_cached( (struct cached*)( (uintptr_t)list -
+		                                  offsetof( struct cached, list ) ) );
+}
+
+
+void xml_get_cache_stats ( struct xml_element* elem,
+                           struct xml_cache_stats* stats ) {
+
+	struct result_cache* cache = document_of( elem )->cache;
+
+	memset( stats, 0, sizeof( *stats ) );
+
+	if ( !cache ) return;
+
+	pthread_mutex_lock( &cache->lock );
+
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->len = cache->len;
+
+	pthread_mutex_unlock( &cache->lock );
+}
+
+
+
+/*
+ * Snapshots: a document laid out in one file as it is in memory, with
+ * pointers valid at the base address in the header. Opening maps the file
+ * there and the document is ready, or, when that range is taken, maps it
+ * anywhere and moves every pointer by the difference.
+ *
+ * The image holds, in this order, the header, the xml_document, the name
+ * table with its strings, the elements in document order, the attributes,
+ * the indexes already built, their entries and lists, the postings if any
+ * and the values. Its name table is read only.
+ */
+#define SNAPSHOT_MAGIC    "XMLSNAP1"
+#define SNAPSHOT_ENDIAN   0x01020304u
+
+#if UINTPTR_MAX > 0xffffffffu
+#define SNAPSHOT_BASE     ( (uintptr_t)0x100000000000 )
+#define SNAPSHOT_SLOTS    4096
+#define SNAPSHOT_SLOT     ( (uintptr_t)1 << 30 )
+#else
+#define SNAPSHOT_BASE     ( (uintptr_t)0 )
+#define SNAPSHOT_SLOTS    1
+#define SNAPSHOT_SLOT     ( (uintptr_t)0 )
+#endif
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE  0
+#endif
+
+struct snapshot_header {
+
+	char magic[8];
+	uint32_t ptr_size;
+	uint32_t endian;
+
+	uint64_t base;
+	uint64_t size;
+
+	uint64_t doc;
+	uint64_t names;
+	uint64_t elements, n_elements;
+	uint64_t attributes, n_attributes;
+	uint64_t indexes, n_indexes;
+	uint64_t entries, n_entries;
+	uint64_t lists, n_lists;
+	uint64_t postings; // 0 if none
+};
+
+
+struct snapshot {
+
+	struct snapshot_header head;
+
+	char* image;
+	uintptr_t* at; // image address of every node, by order
+
+	size_t values; // image offset of the next value
+};
+
+
+static size_t snapshot_align ( size_t size ) {
+
+	return ( size + ARENA_ALIGN - 1 ) & ~( ARENA_ALIGN - 1 );
+}
+
+
+static uintptr_t snapshot_address ( const struct snapshot* snap,
+                                    const void* node ) {
+
+	return node ? snap->at[ ((const struct xml_element*)node)->order ] : 0;
+}
+
+
+static const char* snapshot_value ( struct snapshot* snap, const char* value,
+                                    int len ) {
+
+	if ( !value ) return NULL;
+
+	memcpy( snap->image + snap->values, value, len );
+	snap->values += len;
+
+	return (const char*)( snap->head.base + snap->values - len );
+}
+
+
+static void snapshot_count_index ( struct snapshot_header* head,
+                                   struct xml_index* index ) {
+
+	if ( !index ) return;
+
+	head->n_indexes++;
+	head->n_entries += index->len;
+
+	for ( int i = 0; i < index->len; i++ )
+		head->n_lists += index->entries[i].len;
+}
+
+
+static struct xml_index* snapshot_index ( struct snapshot* snap,
+                                          struct xml_index* index,
+                                          size_t* indexes, size_t* entries,
+                                          size_t* lists ) {
+
+	if ( !index ) return NULL;
+
+	struct snapshot_header* head = &snap->head;
+
+	struct xml_index* copy = (struct xml_index*)( snap->image +
+	    head->indexes + *indexes * sizeof( struct xml_index ) );
+
+	copy->len = index->len;
+	copy->entries = (struct xml_index_entry*)(uintptr_t)( head->base +
+	    head->entries + *entries * sizeof( struct xml_index_entry ) );
+
+	for ( int i = 0; i < index->len; i++ ) {
+
+		struct xml_index_entry* entry = (struct xml_index_entry*)( snap->image
+		    + head->entries + ( *entries )++ * sizeof( struct xml_index_entry ) );
+
+		entry->id = index->entries[i].id;
+		entry->len = index->entries[i].len;
+		entry->list = (void**)(uintptr_t)( head->base + head->lists +
+		                                   *lists * sizeof( void* ) );
+
+		for ( int j = 0; j < entry->len; j++ ) {
+
+			void** item = (void**)( snap->image + head->lists ) + ( *lists )++;
+			*item = (void*)snapshot_address( snap, index->entries[i].list[j] );
+		}
+	}
+
+	return (struct xml_index*)(uintptr_t)( head->base + head->indexes +
+	                                       ( *indexes )++ *
+	                                       sizeof( struct xml_index ) );
+}
+
+
+/*
+ * lays the image out and places every node in it, then fills it
+ */
+static enum STATE snapshot_layout ( struct snapshot* snap,
+                                    struct xml_document* doc,
+                                    uintptr_t base ) {
+
+	struct snapshot_header* head = &snap->head;
+	struct xml_names* names = doc->names;
+	size_t strings = 0, values = doc->root.value_len;
+
+	snapshot_count_index( head, atomic_load_ptr( &doc->root.sons_index ) );
+	snapshot_count_index( head, atomic_load_ptr( &doc->root.attr_index ) );
+
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) ) {
+
+		head->n_elements++;
+		values += e->value_len;
+
+		snapshot_count_index( head, atomic_load_ptr( &e->sons_index ) );
+		snapshot_count_index( head, atomic_load_ptr( &e->attr_index ) );
+
+		for ( struct xml_attribute* a = e->attr; a; a = a->next ) {
+			head->n_attributes++;
+			values += a->value_len;
+		}
+	}
+
+	for ( int i = 0; i < names->len; i++ )
+		strings += names->entries[i].len + 1;
+
+	size_t off = snapshot_align( sizeof( struct snapshot_header ) );
+
+	head->doc = off;
+	off += snapshot_align( sizeof( struct xml_document ) );
+	head->names = off;
+	off += snapshot_align( sizeof( struct xml_names ) );
+	off += snapshot_align( names->len * sizeof( struct name_entry ) );
+	off += snapshot_align( names->slots_len * sizeof( int ) );
+	off += snapshot_align( strings );
+	head->elements = off;
+	off += head->n_elements * sizeof( struct xml_element );
+	head->attributes = off;
+	off += head->n_attributes * sizeof( struct xml_attribute );
+	head->indexes = off;
+	off += head->n_indexes * sizeof( struct xml_index );
+	head->entries = off;
+	off += head->n_entries * sizeof( struct xml_index_entry );
+	head->lists = off;
+	off += head->n_lists * sizeof( void* );
+
+	if ( doc->postings ) {
+		head->postings = off;
+		off += snapshot_align( postings_size( doc->postings->len,
+		                                      head->n_elements ) );
+	}
+
+	snap->values = off;
+	head->size = off + values;
+	head->base = base;
+
+	snap->image = calloc( 1, head->size );
+	snap->at = malloc( ( doc->root.end + 1 ) * sizeof( uintptr_t ) );
+	if ( !snap->image || !snap->at ) return MEMORY_ERROR;
+
+	snap->at[0] = base + head->doc;
+
+	size_t elements = 0, attributes = 0;
+
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) ) {
+
+		snap->at[ e->order ] = base + head->elements +
+		                       elements++ * sizeof( struct xml_element );
+
+		for ( struct xml_attribute* a = e->attr; a; a = a->next )
+			snap->at[ a->order ] = base + head->attributes +
+			                       attributes++ * sizeof( struct xml_attribute );
+	}
+
+	return OK;
+}
+
+
+static void snapshot_names ( struct snapshot* snap, struct xml_names* names ) {
+
+	struct snapshot_header* head = &snap->head;
+
+	size_t entries = head->names + snapshot_align( sizeof( struct xml_names ) );
+	size_t slots = entries + snapshot_align( names->len *
+	                                         sizeof( struct name_entry ) );
+	size_t strings = slots + snapshot_align( names->slots_len * sizeof( int ) );
+
+	struct xml_names* copy = (struct xml_names*)( snap->image + head->names );
+	struct name_entry* entry = (struct name_entry*)( snap->image + entries );
+
+	copy->len = copy->max_len = names->len;
+	copy->entries = (struct name_entry*)(uintptr_t)( head->base + entries );
+	copy->slots = (int*)(uintptr_t)( head->base + slots );
+	copy->slots_len = names->slots_len;
+
+	if ( names->slots_len )
+		memcpy( snap->image + slots, names->slots,
+		        names->slots_len * sizeof( int ) );
+
+	for ( int i = 0; i < names->len; i++ ) {
+
+		entry[i] = names->entries[i];
+		entry[i].str = (const char*)(uintptr_t)( head->base + strings );
+
+		memcpy( snap->image + strings, names->entries[i].str,
+		        names->entries[i].len + 1 );
+		strings += names->entries[i].len + 1;
+	}
+}
+
+
+static struct postings* snapshot_postings ( struct snapshot* snap,
+                                            const struct postings* postings ) {
+
+	struct snapshot_header* head = &snap->head;
+
+	if ( !postings ) return NULL;
+
+	struct postings* copy = (struct postings*)( snap->image + head->postings );
+	struct xml_element** nodes = (struct xml_element**)( copy + 1 );
+	int* first = (int*)( nodes + head->n_elements );
+
+	copy->len = postings->len;
+	copy->nodes = (struct xml_element**)(uintptr_t)( head->base +
+	    head->postings + sizeof( struct postings ) );
+	copy->first = (int*)(uintptr_t)( head->base + head->postings +
+	    ( (char*)first - (char*)copy ) );
+
+	memcpy( first, postings->first, ( postings->len + 1 ) * sizeof( int ) );
+
+	for ( uint64_t i = 0; i < head->n_elements; i++ )
+		nodes[i] = (struct xml_element*)snapshot_address( snap,
+		                                                  postings->nodes[i] );
+
+	return (struct postings*)(uintptr_t)( head->base + head->postings );
+}
+
+
+/*
+ * copies an element or attribute into the image, with its pointers moved
+ */
+static void snapshot_node ( struct snapshot* snap, struct xml_element* node,
+                            struct xml_element* copy,
+                            const struct name_entry* names ) {
+
+	memcpy( copy, node, node->status & IS_ATTRIBUTE_STATUS
+	                    ? sizeof( struct xml_attribute )
+	                    : sizeof( struct xml_element ) );
+
+	copy->name = names[ node->name_id ].str;
+
+	copy->value = snapshot_value( snap, node->value, node->value_len );
+	copy->father = (struct xml_element*)snapshot_address( snap, node->father );
+	copy->next = (struct xml_element*)snapshot_address( snap, node->next );
+	copy->prev = (struct xml_element*)snapshot_address( snap, node->prev );
+
+	if ( node->status & IS_ATTRIBUTE_STATUS ) return;
+
+	copy->son = (struct xml_element*)snapshot_address( snap, node->son );
+	copy->attr = (struct xml_attribute*)snapshot_address( snap, node->attr );
+}
+
+
+int xml_save_snapshot ( struct xml_element* root, const char* path ) {
+
+	if ( !root || !( root->status & IS_META_ROOT_STATUS ) ) return -1;
+
+	struct xml_document* doc = (struct xml_document*)root;
+	struct snapshot snap;
+	int ret = -1;
+
+	memset( &snap, 0, sizeof( snap ) );
+	memcpy( snap.head.magic, SNAPSHOT_MAGIC, sizeof( snap.head.magic ) );
+	snap.head.ptr_size = sizeof( void* );
+	snap.head.endian = SNAPSHOT_ENDIAN;
+
+	uintptr_t base = SNAPSHOT_BASE + SNAPSHOT_SLOT *
+	                 ( hash_name( path, strlen( path ) ) % SNAPSHOT_SLOTS );
+
+	if ( snapshot_layout( &snap, doc, base ) != OK ) goto end;
+
+	struct snapshot_header* head = &snap.head;
+	const struct name_entry* names = (const struct name_entry*)(
+	    snap.image + head->names + snapshot_align( sizeof( struct xml_names ) ) );
+
+	snapshot_names( &snap, doc->names );
+
+	struct xml_document* copy = (struct xml_document*)( snap.image +
+	                                                    head->doc );
+
+	size_t indexes = 0, entries = 0, lists = 0;
+
+	copy->root = doc->root;
+	copy->root.value = snapshot_value( &snap, doc->root.value,
+	                                   doc->root.value_len );
+	copy->root.son = (struct xml_element*)snapshot_address( &snap,
+	                                                        doc->root.son );
+	copy->root.sons_index = snapshot_index( &snap,
+	    atomic_load_ptr( &doc->root.sons_index ), &indexes, &entries, &lists );
+	copy->root.attr_index = snapshot_index( &snap,
+	    atomic_load_ptr( &doc->root.attr_index ), &indexes, &entries, &lists );
+	copy->names = (struct xml_names*)( base + head->names );
+	copy->index_threshold = doc->index_threshold;
+	copy->postings = snapshot_postings( &snap, doc->postings );
+
+	for ( struct xml_element* e = doc->root.son; e;
+	      e = next_element( e, false ) ) {
+
+		struct xml_element* node = (struct xml_element*)( snap.image +
+		    snapshot_address( &snap, e ) - base );
+
+		snapshot_node( &snap, e, node, names );
+
+		node->sons_index = snapshot_index( &snap,
+		    atomic_load_ptr( &e->sons_index ), &indexes, &entries, &lists );
+		node->attr_index = snapshot_index( &snap,
+		    atomic_load_ptr( &e->attr_index ), &indexes, &entries, &lists );
+
+		for ( struct xml_attribute* a = e->attr; a; a = a->next )
+			snapshot_node( &snap, (struct xml_element*)a,
+			               (struct xml_element*)( snap.image +
+			               snapshot_address( &snap, a ) - base ), names );
+	}
+
+	memcpy( snap.image, head, sizeof( struct snapshot_header ) );
+
+	FILE* file = fopen( path, "wb" );
+	if ( !file ) goto end;
+
+	if ( fwrite( snap.image, 1, head->size, file ) == head->size )
+		ret = 0;
+	if ( fclose( file ) != 0 )
+		ret = -1;
+
+end:
+	free( snap.image );
+	free( snap.at );
+
+	return ret;
+}
+
+
+#define RELOCATE( p, delta ) \
+	do { if ( p ) (p) = (void*)( (uintptr_t)(p) + (delta) ); } while ( 0 )
+
+static void relocate_node ( struct xml_element* node, uintptr_t delta ) {
+
+	RELOCATE( node->name, delta );
+	RELOCATE( node->value, delta );
+	RELOCATE( node->father, delta );
+	RELOCATE( node->next, delta );
+	RELOCATE( node->prev, delta );
+
+	if ( node->status & IS_ATTRIBUTE_STATUS ) return;
+
+	RELOCATE( node->son, delta );
+	RELOCATE( node->attr, delta );
+	RELOCATE( node->sons_index, delta );
+	RELOCATE( node->attr_index, delta );
+}
+
+
+static void relocate_snapshot ( char* image, uintptr_t delta ) {
+
+	const struct snapshot_header* head = (void*)image;
+
+	struct xml_document* doc = (void*)( image + head->doc );
+	relocate_node( &doc->root, delta );
+	RELOCATE( doc->names, delta );
+
+	struct xml_names* names = (void*)( image + head->names );
+	RELOCATE( names->entries, delta );
+	RELOCATE( names->slots, delta );
+
+	for ( int i = 0; i < names->len; i++ )
+		RELOCATE( names->entries[i].str, delta );
+
+	struct xml_element* elements = (void*)( image + head->elements );
+	for ( uint64_t i = 0; i < head->n_elements; i++ )
+		relocate_node( elements + i, delta );
+
+	struct xml_attribute* attributes = (void*)( image + head->attributes );
+	for ( uint64_t i = 0; i < head->n_attributes; i++ )
+		relocate_node( (struct xml_element*)( attributes + i ), delta );
+
+	struct xml_index* indexes = (void*)( image + head->indexes );
+	for ( uint64_t i = 0; i < head->n_indexes; i++ )
+		RELOCATE( indexes[i].entries, delta );
+
+	struct xml_index_entry* entries = (void*)( image + head->entries );
+	for ( uint64_t i = 0; i < head->n_entries; i++ )
+		RELOCATE( entries[i].list, delta );
+
+	void** lists = (void*)( image + head->lists );
+	for ( uint64_t i = 0; i < head->n_lists; i++ )
+		RELOCATE( lists[i], delta );
+
+	if ( !head->postings ) return;
+
+	RELOCATE( doc->postings, delta );
 
-	for ( struct xml_element** l = list; *l; l++ ) {
-		(*l)->status |= IS_TOUCHED_STATUS;
-		_xml_clear_descendant( *l );
-	}
+	struct postings* postings = (void*)( image + head->postings );
+	RELOCATE( postings->first, delta );
+	RELOCATE( postings->nodes, delta );
+
+	struct xml_element** nodes = (void*)( postings + 1 );
+	for ( uint64_t i = 0; i < head->n_elements; i++ )
+		RELOCATE( nodes[i], delta );
 }
 
 
-static void xml_get_descendant_or_self ( struct ptr_list* plist,
-                                         struct xml_element** list,
-                                         const char* name, int name_len ) {
+/*
+ * whether count items of size fit in the image from off
+ */
+static bool snapshot_fits ( const struct snapshot_header* head, uint64_t off,
+                            uint64_t count, size_t size ) {
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	return off <= head->size && count <= ( head->size - off ) / size;
+}
 
-		if ( !( (*l)->status & IS_TOUCHED_STATUS ) ) {
 
-			if ( !_xml_get_descendant( plist, *l, name, name_len ) ) {
+/*
+ * Checks the layout the header describes against the one saving gives, and
+ * the pointers relocation follows, before anything is read through them.
+ * The nodes themselves are trusted.
+ */
+static bool snapshot_valid ( const char* image,
+                             const struct snapshot_header* head ) {
 
-				free( plist->list );
-				*plist = init_ptr_list;
+	uint64_t off = snapshot_align( sizeof( struct snapshot_header ) );
 
-				for ( l = list; *l; l++ )
-					_xml_clear_descendant( *l );
-				return;
-			}
-		}
+	if ( head->doc != off ) return false;
+
+	off += snapshot_align( sizeof( struct xml_document ) );
+
+	if ( head->names != off ||
+	     !snapshot_fits( head, off, 1, sizeof( struct xml_names ) ) )
+		return false;
+
+	const struct xml_document* doc = (const void*)( image + head->doc );
+	const struct xml_names* names = (const void*)( image + head->names );
+
+	if ( names->len < 0 || names->slots_len < 0 ) return false;
+
+	uint64_t entries = off + snapshot_align( sizeof( struct xml_names ) );
+	uint64_t slots = entries + snapshot_align( names->len *
+	                                           sizeof( struct name_entry ) );
+	uint64_t strings = slots + snapshot_align( names->slots_len *
+	                                           sizeof( int ) );
+
+	if ( !snapshot_fits( head, entries, names->len,
+	                     sizeof( struct name_entry ) ) ||
+	     !snapshot_fits( head, slots, names->slots_len, sizeof( int ) ) ||
+	     (uintptr_t)doc->names != head->base + head->names ||
+	     (uintptr_t)names->entries != head->base + entries ||
+	     (uintptr_t)names->slots != head->base + slots ||
+	     !snapshot_fits( head, strings, 0, 1 ) || head->elements < strings )
+		return false;
+
+	const struct name_entry* entry = (const void*)( image + entries );
+
+	for ( int i = 0; i < names->len; i++ )
+		if ( (uintptr_t)entry[i].str < head->base + strings ||
+		     entry[i].len < 0 ||
+		     (uintptr_t)entry[i].str + entry[i].len >=
+		     head->base + head->elements )
+			return false;
+
+	const struct { uint64_t off, count; size_t size; } sections[] = {
+		{ head->elements, head->n_elements, sizeof( struct xml_element ) },
+		{ head->attributes, head->n_attributes,
+		  sizeof( struct xml_attribute ) },
+		{ head->indexes, head->n_indexes, sizeof( struct xml_index ) },
+		{ head->entries, head->n_entries, sizeof( struct xml_index_entry ) },
+		{ head->lists, head->n_lists, sizeof( void* ) }
+	};
+
+	off = head->elements;
+
+	for ( size_t i = 0; i < sizeof( sections ) / sizeof( *sections ); i++ ) {
+
+		if ( sections[i].off != off ||
+		     !snapshot_fits( head, off, sections[i].count, sections[i].size ) )
+			return false;
+
+		off += sections[i].count * sections[i].size;
 	}
 
-	for ( struct xml_element** l = list; *l; l++ )
-		_xml_clear_descendant( *l );
+	if ( !head->postings ) return !doc->postings;
+
+	if ( head->postings != off || (uintptr_t)doc->postings != head->base + off ||
+	     !snapshot_fits( head, off, 1, sizeof( struct postings ) ) )
+		return false;
+
+	const struct postings* postings = (const void*)( image + off );
+	uint64_t nodes = off + sizeof( struct postings );
+	uint64_t first = nodes + head->n_elements * sizeof( void* );
+
+	return postings->len == names->len &&
+	       snapshot_fits( head, nodes, head->n_elements, sizeof( void* ) ) &&
+	       snapshot_fits( head, first, (uint64_t)postings->len + 1,
+	                      sizeof( int ) ) &&
+	       (uintptr_t)postings->nodes == head->base + nodes &&
+	       (uintptr_t)postings->first == head->base + first;
 }
 
 
-static void xml_get_following ( struct ptr_list* plist, struct xml_element** list,
-                                const char* name, int name_len ) {
+struct xml_element* xml_open_snapshot ( const char* path ) {
 
-	struct ptr_list siblist = init_ptr_list;
+	struct snapshot_header head;
+	struct stat st;
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	int fd = open( path, O_RDONLY );
+	if ( fd < 0 ) return NULL;
+
+	if ( fstat( fd, &st ) != 0 ||
+	     pread( fd, &head, sizeof( head ), 0 ) != sizeof( head ) ||
+	     memcmp( head.magic, SNAPSHOT_MAGIC, sizeof( head.magic ) ) != 0 ||
+	     head.ptr_size != sizeof( void* ) || head.endian != SNAPSHOT_ENDIAN ||
+	     head.size != (uint64_t)st.st_size ) {
+		close( fd );
+		return NULL;
+	}
 
-		for ( struct xml_element* elem = (*l)->next; elem; elem = elem->next ) {
+	// private and writable: queries still build indexes into the nodes
+	void* map = MAP_FAILED;
 
-			if ( ptr_list_push_back( elem, &siblist ) != OK ) {
+	if ( head.base )
+		map = mmap( (void*)(uintptr_t)head.base, head.size,
+		            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED_NOREPLACE,
+		            fd, 0 );
 
-				free( siblist.list );
-				free( plist->list );
-				*plist = init_ptr_list;
-				return;
-			}
-		}
+	if ( map != MAP_FAILED && (uintptr_t)map != head.base ) {
+		munmap( map, head.size );
+		map = MAP_FAILED;
+	}
+
+	bool fixed = map != MAP_FAILED;
+
+	if ( !fixed )
+		map = mmap( NULL, head.size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		            fd, 0 );
+
+	close( fd );
+
+	if ( map == MAP_FAILED ) return NULL;
+
+	if ( !snapshot_valid( map, &head ) ) {
+		munmap( map, head.size );
+		return NULL;
 	}
-	xml_get_descendant_or_self( plist, (void*)siblist.list, name, name_len );
 
-	free( siblist.list );
+	if ( !fixed )
+		relocate_snapshot( map, (uintptr_t)map - head.base );
+
+	struct xml_document* doc = (void*)( (char*)map + head.doc );
+
+	doc->source = (struct source){ "", 0, map, head.size, NULL };
+	doc->snapshot = true;
+
+	return &doc->root;
 }
 
 
-static void xml_get_following_sibling ( struct ptr_list* plist,
-                                        struct xml_element** list,
-                                        const char* name, int name_len ) {
+/*
+ * Node tables: the same tree as a document, without the node structs.
+ * Node i is the one numbered i, so the nodes inside another are the range
+ * up to its end, and the attributes of an element follow it right away,
+ * its first son right after them.
+ */
+struct table {
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	struct xml_table table; // first, see free_xml_table
+	uint32_t max_len;
+	bool own_names;
+};
 
-		if ( !( (*l)->status & IS_ELEMENT_STATUS ) ) continue;
+struct table_frame {
 
-		for ( struct xml_element* elem = (*l)->next; elem; elem = elem->next ) {
+	uint32_t elem;
+	uint32_t last; // son
+};
 
-			if ( elem->status & IS_TOUCHED_STATUS ) break;
 
-			if ( xml_element_check( elem, name, name_len ) ) {
+static enum STATE table_grow ( struct table* t ) {
 
-				elem->status |= IS_TOUCHED_STATUS;
+	struct xml_table* table = &t->table;
 
-				if ( ptr_list_push_back( elem, plist ) != OK ) {
+	if ( t->max_len > ( XML_NIL - 1 ) / 2 ) return MEMORY_ERROR;
 
-					free( plist->list );
-					*plist = init_ptr_list;
+	uint32_t max_len = t->max_len ? 2 * t->max_len : 1024;
+	void* aux;
 
-					for ( l = list; *l; l++ )
-						for ( elem = (*l)->next; elem; elem = elem->next )
-							if ( !( elem->status & IS_TOUCHED_STATUS ) )
-								break;
-							else
-								elem->status ^= IS_TOUCHED_STATUS;
-					return;
-				}
-			}
+#define TABLE_GROW( array ) \
+	do { \
+		aux = realloc( table->array, max_len * sizeof( *table->array ) ); \
+		if ( !aux ) return MEMORY_ERROR; \
+		table->array = aux; \
+	} while ( 0 )
+
+	TABLE_GROW( father );
+	TABLE_GROW( next );
+	TABLE_GROW( end );
+	TABLE_GROW( name_id );
+	TABLE_GROW( value );
+	TABLE_GROW( value_len );
+	TABLE_GROW( kind );
+
+#undef TABLE_GROW
+
+	t->max_len = max_len;
+	return OK;
+}
+
+
+static enum STATE table_add ( struct table* t, uint32_t father,
+                              unsigned char kind, const struct xml_event* ev,
+                              uint32_t* node ) {
+
+	struct xml_table* table = &t->table;
+
+	if ( table->len == t->max_len && table_grow( t ) != OK )
+		return MEMORY_ERROR;
+
+	uint32_t i = table->len++;
+
+	table->father[i] = father;
+	table->next[i] = XML_NIL;
+	table->end[i] = i;
+	table->name_id[i] = NO_NAME;
+	table->value[i] = XML_NIL;
+	table->value_len[i] = 0;
+	table->kind[i] = kind;
+
+	if ( ev ) {
+
+		table->name_id[i] = names_intern( table->names, ev->name,
+		                                  ev->name_len, NULL );
+		if ( table->name_id[i] == NO_NAME ) return MEMORY_ERROR;
+
+		if ( ev->value ) {
+			table->value[i] = ev->value - table->buffer;
+			table->value_len[i] = ev->value_len;
 		}
 	}
 
-	for ( struct xml_element** l = list; *l; l++ )
-		for ( struct xml_element* elem = (*l)->next; elem; elem = elem->next )
-			if ( !( elem->status & IS_TOUCHED_STATUS ) )
-				break;
-			else
-				elem->status ^= IS_TOUCHED_STATUS;
+	*node = i;
+	return OK;
 }
 
 
-static void xml_get_namespace ( struct ptr_list* plist, struct xml_element** list,
-                                const char* name, int name_len ) {
+static enum STATE read_table ( struct xml_reader* reader, struct table* t,
+                               int max_depth ) {
 
-	free( plist->list );
-	*plist = init_ptr_list;
-	(void)list;
-	(void)name;
-	(void)name_len;
-}
+	struct xml_table* table = &t->table;
+	struct xml_event ev;
+	uint32_t attr = XML_NIL, node;
 
+	// the open elements, the meta root first
+	int depth = 1, stack_len = 16;
+	struct table_frame* stack = malloc( stack_len *
+	                                    sizeof( struct table_frame ) );
+	if ( !stack ) return MEMORY_ERROR;
 
-static void xml_get_parent ( struct ptr_list* plist, struct xml_element** list,
-                             const char* name, int name_len ) {
+	stack[0] = (struct table_frame){ 0, XML_NIL };
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	enum STATE state = table_add( t, XML_NIL, IS_META_ROOT_STATUS, NULL,
+	                              &node );
 
-		if ( !( (*l)->father->status & IS_TOUCHED_STATUS ) ) {
+	while ( state == OK ) {
 
-			(*l)->father->status |= IS_TOUCHED_STATUS;
+		struct table_frame* top = stack + depth - 1;
 
-			if ( xml_element_check( (*l)->father, name, name_len ) ) {
+		switch ( xml_reader_next( reader, &ev ) ) {
 
-				if ( ptr_list_push_back( (*l)->father, plist ) != OK ) {
+			case XML_START_ELEMENT:
 
-					free( plist->list );
-					*plist = init_ptr_list;
+				if ( depth - 1 == max_depth ) {
+					state = PARSE_ERROR;
+					break;
+				}
 
-					for ( l = list; *l; l++ )
-						(*l)->father->status ^= IS_TOUCHED_STATUS;
-					return;
+				if ( depth == stack_len ) {
+
+					void* aux = realloc( stack, 2 * stack_len *
+					                     sizeof( struct table_frame ) );
+					if ( !aux ) {
+						state = MEMORY_ERROR;
+						break;
+					}
+					stack = aux;
+					stack_len *= 2;
+					top = stack + depth - 1;
 				}
-			}
+
+				state = table_add( t, top->elem, IS_ELEMENT_STATUS, &ev,
+				                   &node );
+				if ( state != OK ) break;
+
+				if ( top->last != XML_NIL ) table->next[ top->last ] = node;
+				top->last = node;
+
+				stack[ depth++ ] = (struct table_frame){ node, XML_NIL };
+				attr = XML_NIL;
+				break;
+
+			case XML_ATTRIBUTE:
+
+				state = table_add( t, top->elem, IS_ATTRIBUTE_STATUS, &ev,
+				                   &node );
+				if ( state != OK ) break;
+
+				if ( attr != XML_NIL ) table->next[ attr ] = node;
+				attr = node;
+				break;
+
+			case XML_TEXT:
+
+				table->value[ top->elem ] = ev.value - table->buffer;
+				table->value_len[ top->elem ] = ev.value_len;
+				break;
+
+			case XML_END_ELEMENT:
+
+				table->end[ top->elem ] = table->len - 1;
+				depth--;
+				break;
+
+			case XML_SPECIAL_TAG:
+				break;
+
+			case XML_END_DOCUMENT:
+
+				table->end[0] = table->len - 1;
+				free( stack );
+				return OK;
+
+			default:
+				state = PARSE_ERROR;
 		}
 	}
-	for ( struct xml_element** l = list; *l; l++ )
-		(*l)->father->status ^= IS_TOUCHED_STATUS;
+
+	free( stack );
+	return state;
 }
 
 
-static void xml_get_preceding ( struct ptr_list* plist, struct xml_element** list,
-                                const char* name, int name_len ) {
+struct xml_table* load_xml_table ( const char* buffer, size_t len,
+                                   const struct xml_options* opt ) {
 
-	struct ptr_list siblist = init_ptr_list;
+	if ( len >= XML_NIL ) return NULL;
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	struct table* t = calloc( 1, sizeof( struct table ) );
+	if ( !t ) return NULL;
 
-		struct xml_element* elem;
+	struct xml_table* table = &t->table;
+	struct xml_reader reader;
 
-		for ( elem = *l; elem->prev; elem = elem->prev ) ;
-		for ( ; elem != *l; elem = elem->next ) {
+	table->buffer = buffer;
 
-			if ( ptr_list_push_back( elem, &siblist ) != OK ) {
+	if ( opt && opt->names ) {
+		table->names = opt->names;
+	} else {
+		table->names = new_xml_names();
+		t->own_names = true;
+	}
 
-				free( siblist.list );
-				free( plist->list );
-				*plist = init_ptr_list;
-				return;
-			}
-		}
+	enum STATE state = table->names ? OK : MEMORY_ERROR;
+
+	if ( state == OK ) {
+
+		reader_init( &reader, buffer, len );
+		state = read_table( &reader, t, opt && opt->max_depth > 0
+		                                ? opt->max_depth : -1 );
+		reader_release( &reader );
+	}
+
+	if ( state != OK ) {
+		free_xml_table( table );
+		return NULL;
 	}
-	xml_get_descendant_or_self( plist, (void*)siblist.list, name, name_len );
 
-	free( siblist.list );
+	return table;
 }
 
 
-static void xml_get_preceding_sibling ( struct ptr_list* plist,
-                                        struct xml_element** list,
-                                        const char* name, int name_len ) {
+void free_xml_table ( struct xml_table* table ) {
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	if ( !table ) return;
+
+	struct table* t = (struct table*)table;
 
-		if ( !( (*l)->status & IS_ELEMENT_STATUS ) ) continue;
+	free( table->father );
+	free( table->next );
+	free( table->end );
+	free( table->name_id );
+	free( table->value );
+	free( table->value_len );
+	free( table->kind );
 
-		struct xml_element* elem;
+	if ( t->own_names ) free_xml_names( table->names );
+
+	free( t );
+}
 
-		for ( elem = *l; elem->prev; elem = elem->prev )
 
-			if ( elem->prev->status & IS_TOUCHED_STATUS ) break;
+/*
+ * Queries over a table run the axes of xml_exec on lists of node numbers,
+ * which sorted are in document order.
+ */
+struct node_list {
 
-		for ( ; elem != *l; elem = elem->next ) {
+	uint32_t* list;
+	size_t len;
+	size_t max_len;
+	bool failed;
+};
 
-			if ( xml_element_check( elem, name, name_len ) ) {
 
-				elem->status |= IS_TOUCHED_STATUS;
+static void node_list_push ( struct node_list* nl, uint32_t node ) {
 
-				if ( ptr_list_push_back( elem, plist ) != OK ) {
+	if ( nl->len == nl->max_len ) {
 
-					free( plist->list );
-					*plist = init_ptr_list;
+		size_t max_len = 2 * nl->max_len + 16;
 
-					for ( l = list; *l; l++ )
-						for ( elem = (*l)->prev; elem; elem = elem->prev )
-							if ( !( elem->status & IS_TOUCHED_STATUS ) )
-								break;
-							else
-								elem->status ^= IS_TOUCHED_STATUS;
-					return;
-				}
-			}
+		void* aux = realloc( nl->list, max_len * sizeof( uint32_t ) );
+		if ( !aux ) {
+			nl->failed = true;
+			return;
 		}
+
+		nl->list = aux;
+		nl->max_len = max_len;
 	}
 
-	for ( struct xml_element** l = list; *l; l++ )
-		for ( struct xml_element* elem = (*l)->prev; elem; elem = elem->prev )
-			if ( !( elem->status & IS_TOUCHED_STATUS ) )
-				break;
-			else
-				elem->status ^= IS_TOUCHED_STATUS;
+	nl->list[ nl->len++ ] = node;
 }
 
 
-static void xml_get_self ( struct ptr_list* plist, struct xml_element** list,
-                           const char* name, int name_len ) {
+static int cmp_node ( const void* a, const void* b ) {
 
-	for ( struct xml_element** l = list; *l; l++ ) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
 
-		if ( xml_element_check( *l, name, name_len ) ) {
+	return ( x > y ) - ( x < y );
+}
 
-			if ( ptr_list_push_back( *l, plist ) != OK ) {
 
-				free( plist->list );
-				*plist = init_ptr_list;
-				return;
-			}
-		}
-	}
+static void node_list_normalize ( struct node_list* nl ) {
+
+	size_t i, len = 0;
+
+	for ( i = 1; i < nl->len && nl->list[ i - 1 ] < nl->list[i]; i++ ) ;
+
+	if ( i >= nl->len ) return;
+
+	qsort( nl->list, nl->len, sizeof( uint32_t ), cmp_node );
+
+	for ( i = 0; i < nl->len; i++ )
+		if ( !len || nl->list[ len - 1 ] != nl->list[i] )
+			nl->list[ len++ ] = nl->list[i];
+
+	nl->len = len;
 }
 
 
-#define NUM_AXES       13
+static int cmp_sibling_key ( const void* a, const void* b ) {
 
-#define ATTRIBUTE_AXE   2
-#define CHILD_AXE       3
-#define PARENT_AXE      9
-#define SELF_AXE       12
-#define DESCENDANT_OR_SELF_AXE  5
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
 
-static const char* axes[ NUM_AXES ] = {
+	return ( x > y ) - ( x < y );
+}
 
-	"ancestor",   "ancestor-or-self",   "attribute", "child",
-	"descendant", "descendant-or-self", "following", "following-sibling",
-	"namespace",  "parent",             "preceding", "preceding-sibling",
-	"self"
-};
 
-typedef void (*axe_handler) ( struct ptr_list*, struct xml_element**,
-                              const char*, int );
+static bool table_check ( const struct xml_table* table, uint32_t node,
+                          int id ) {
 
-static const axe_handler axe_handlers[ NUM_AXES ] = {
+	return node != XML_NIL && !( table->kind[ node ] & IS_META_ROOT_STATUS ) &&
+	       ( id == ANY_NAME || table->name_id[ node ] == id );
+}
 
-	xml_get_ancestor, xml_get_ancestor_or_self, xml_get_attribute,
-	xml_get_child,    xml_get_descendant,       xml_get_descendant_or_self,
-	xml_get_following,xml_get_following_sibling,xml_get_namespace,
-	xml_get_parent,   xml_get_preceding,        xml_get_preceding_sibling,
-	xml_get_self
-};
 
+static bool is_table_element ( const struct xml_table* table,
+                               uint32_t node ) {
 
-void** xml_get ( struct xml_element* element, const char* query ) {
+	return !( table->kind[ node ] & IS_ATTRIBUTE_STATUS );
+}
 
-	struct ptr_list list = init_ptr_list;
 
-	if ( query[0] != '/' ) {
+// the first son of an element, or XML_NIL
+static uint32_t table_son ( const struct xml_table* table, uint32_t node ) {
 
-		struct ptr_list aux = init_ptr_list;
+	uint32_t son = node + 1;
 
-		if ( ptr_list_push_back( element, &aux ) != OK ) {
-			free( list.list );
-			free( aux.list );
-			return NULL;
-		}
-		xml_get_descendant( &list, (void*)aux.list, "*", 1 );
+	while ( son <= table->end[ node ] && !is_table_element( table, son ) )
+		son++;
 
-		free( aux.list );
-	} else
-	if ( query++[1] != '/' ) {
+	return son <= table->end[ node ] ? son : XML_NIL;
+}
 
-		if ( ptr_list_push_back( element, &list ) != OK ) {
-			free( list.list );
-			return NULL;
-		}
-	} else {
-		if ( ptr_list_push_back( element->son, &list ) != OK ) {
-			free( list.list );
-			return NULL;
-		}
-	}
 
-	while ( *query ) {
+static void table_axe ( const struct xml_table* table, int axe,
+                        const struct node_list* in, struct node_list* out,
+                        int id ) {
 
-		struct ptr_list aux = init_ptr_list;
+	const uint32_t* list = in->list;
+	size_t len = in->len;
 
-		int axe = CHILD_AXE;
+	switch ( axe ) {
 
-		switch ( *query ) {
+		case ANCESTOR_AXE:
+		case ANCESTOR_OR_SELF_AXE: {
 
-			case '/':
-				query++;
-				axe = DESCENDANT_OR_SELF_AXE;
-				break;
+			bool self = axe == ANCESTOR_OR_SELF_AXE;
 
-			case '@':
-				query++;
-				axe = ATTRIBUTE_AXE;
-				break;
+			for ( size_t i = 0; i < len; i++ ) {
 
-			case '.':
-				if ( *++query == '.' ) {
-					query++;
-					axe = PARENT_AXE;
-				} else
-					axe = SELF_AXE;
-				break;
+				uint32_t node = self ? list[i] : table->father[ list[i] ];
+
+				for ( ; node && node != XML_NIL;
+				      node = table->father[ node ] ) {
+
+					// the rest was found from the previous context
+					if ( i && node <= list[ i - 1 ] &&
+					     list[ i - 1 ] <= table->end[ node ] &&
+					     ( self || node != list[ i - 1 ] ) )
+						break;
+
+					if ( table_check( table, node, id ) )
+						node_list_push( out, node );
+				}
+			}
+			break;
 		}
 
-		const char* start = query;
+		case ATTRIBUTE_AXE:
+			for ( size_t i = 0; i < len; i++ ) {
 
-		while( true ) {
+				if ( !is_table_element( table, list[i] ) ) continue;
 
-			if ( *query == ':' ) {
+				for ( uint32_t node = list[i] + 1; node < table->len &&
+				      !is_table_element( table, node ); node++ )
+					if ( table_check( table, node, id ) )
+						node_list_push( out, node );
+			}
+			break;
 
-					int m = -1, M = NUM_AXES, med, ret;
+		case CHILD_AXE:
+			for ( size_t i = 0; i < len; i++ ) {
 
-					while ( M - m > 1 ) {
+				if ( !is_table_element( table, list[i] ) ) continue;
 
-						med = ( m + M )/2;
-						ret = strncmp( axes[ med ], start, query - start );
+				for ( uint32_t node = table_son( table, list[i] );
+				      node != XML_NIL; node = table->next[ node ] )
+					if ( table_check( table, node, id ) )
+						node_list_push( out, node );
+			}
+			break;
 
-						if ( ret == 0 && axes[ med ][ query - start ] == 0 ) {
-							axe = med;
-							break;
-						}
-						if ( ret < 0 ) m = med;
-						else M = med;
-					}
+		case DESCENDANT_AXE:
+		case DESCENDANT_OR_SELF_AXE: {
 
-					start = query += 2;
+			bool self = axe == DESCENDANT_OR_SELF_AXE;
+			int64_t walked = -1;
+
+			for ( size_t i = 0; i < len; i++ ) {
+
+				uint32_t top = list[i];
+
+				if ( !is_table_element( table, top ) ) {
+					if ( self && table_check( table, top, id ) )
+						node_list_push( out, top );
 					continue;
-			}
+				}
 
-			if ( *query == 0 ) {
+				if ( top <= walked ) continue;
 
-				axe_handlers[ axe ]( &aux, (void*)list.list, start,
-									 query - start );
-				break;
+				walked = table->end[ top ];
+
+				for ( uint32_t node = self ? top : top + 1;
+				      node <= table->end[ top ]; node++ )
+					if ( is_table_element( table, node ) &&
+					     table_check( table, node, id ) )
+						node_list_push( out, node );
 			}
+			break;
+		}
+
+		case FOLLOWING_AXE: {
+
+			if ( !len ) break;
+
+			uint32_t first = list[0];
+
+			for ( size_t i = 0; i < len; i++ )
+				if ( table->end[ list[i] ] < table->end[ first ] )
+					first = list[i];
+
+			uint32_t node = is_table_element( table, first )
+			                ? table->end[ first ] + 1
+			                : table->father[ first ] + 1;
+
+			for ( ; node < table->len; node++ )
+				if ( is_table_element( table, node ) &&
+				     table_check( table, node, id ) )
+					node_list_push( out, node );
+			break;
+		}
+
+		case PRECEDING_AXE: {
 
-			if ( *query == '/' ) {
+			uint32_t last = 0;
 
-				axe_handlers[ axe ]( &aux, (void*)list.list, start,
-									 query - start );
-				query++;
+			for ( size_t i = 0; i < len; i++ )
+				if ( list[i] > last ) last = list[i];
+
+			for ( uint32_t node = 1; node < last; node++ )
+				if ( is_table_element( table, node ) &&
+				     table->end[ node ] < last &&
+				     table_check( table, node, id ) )
+					node_list_push( out, node );
+			break;
+		}
+
+		case FOLLOWING_SIBLING_AXE:
+		case PRECEDING_SIBLING_AXE: {
+
+			// element contexts by father, then in document order
+			uint64_t* sorted = malloc( len * sizeof( uint64_t ) + 1 );
+			size_t n = 0;
+
+			if ( !sorted ) {
+				out->failed = true;
 				break;
 			}
 
-			if ( *query == '[' ) {
+			for ( size_t i = 0; i < len; i++ )
+				if ( list[i] && is_table_element( table, list[i] ) )
+					sorted[ n++ ] = (uint64_t)table->father[ list[i] ] << 32 |
+					                list[i];
 
-				axe_handlers[ axe ]( &aux, (void*)list.list, start,
-									 query - start );
-				int i = 1;
-				for( ++query; i; ++query )
-					i += ( *query == '[' ) - ( *query == ']' );
-				++query;
-				break;
+			qsort( sorted, n, sizeof( uint64_t ), cmp_sibling_key );
+
+			bool following = axe == FOLLOWING_SIBLING_AXE;
+
+			// the first context of every father has all the others after
+			// it, and the last one all the others before it
+			for ( size_t i = 0; i < n; i++ ) {
+
+				size_t other = following ? i - 1 : i + 1;
+
+				if ( ( following ? i > 0 : i + 1 < n ) &&
+				     sorted[ other ] >> 32 == sorted[i] >> 32 )
+					continue;
+
+				uint32_t node = (uint32_t)sorted[i];
+				uint32_t sib = following
+				               ? table->next[ node ]
+				               : table_son( table, table->father[ node ] );
+
+				for ( ; sib != XML_NIL && sib != node;
+				      sib = table->next[ sib ] )
+					if ( table_check( table, sib, id ) )
+						node_list_push( out, sib );
 			}
 
-			++query;
+			free( sorted );
+			break;
 		}
 
+		case PARENT_AXE:
+			for ( size_t i = 0; i < len; i++ )
+				if ( table_check( table, table->father[ list[i] ], id ) )
+					node_list_push( out, table->father[ list[i] ] );
+			break;
+
+		case SELF_AXE:
+			for ( size_t i = 0; i < len; i++ )
+				if ( table_check( table, list[i], id ) )
+					node_list_push( out, list[i] );
+			break;
+
+		case NAMESPACE_AXE:
+			break;
+	}
+}
+
+
+uint32_t* xml_table_exec ( const struct xml_plan* plan,
+                           const struct xml_table* table, uint32_t node ) {
+
+	struct node_list list = { NULL, 0, 0, false };
+	int* ids = NULL;
+
+	if ( plan->preds ) return NULL;
+
+	if ( table->names != plan->names && plan->len ) {
+
+		ids = malloc( plan->len * sizeof( int ) );
+		if ( !ids ) return NULL;
+
+		for ( int i = 0; i < plan->len; i++ )
+			ids[i] = name_test( table->names, plan->steps[i].name,
+			                    plan->steps[i].name_len );
+	}
+
+	uint32_t start = plan->start == START_FIRST_SON ? table_son( table, node )
+	                                                : node;
+
+	if ( start != XML_NIL )
+		node_list_push( &list, start );
+
+	if ( plan->start == START_DESCENDANTS ) {
+
+		struct node_list aux = { NULL, 0, 0, false };
+
+		table_axe( table, DESCENDANT_AXE, &list, &aux, ANY_NAME );
+
+		free( list.list );
+		list = aux;
+	}
+
+	for ( int i = 0; i < plan->len && !list.failed; i++ ) {
+
+		struct node_list aux = { NULL, 0, 0, false };
+
+		const struct xml_step* step = plan->steps + i;
+
+		table_axe( table, step->axe, &list, &aux, ids ? ids[i] : step->id );
+
+		node_list_normalize( &aux );
+
 		free( list.list );
 		list = aux;
 	}
 
-	if ( ptr_list_push_back( NULL, &list ) != OK ) {
+	free( ids );
+
+	node_list_push( &list, 0 );
+
+	if ( list.failed ) {
 		free( list.list );
 		return NULL;
 	}
@@ -1224,8 +6551,15 @@ void** xml_get ( struct xml_element* element, const char* query ) {
 }
 
 
-void free_xml_list ( void** list ) {
+uint32_t* xml_table_get ( const struct xml_table* table, uint32_t node,
+                          const char* query ) {
 
-	free( list );
-}
+	struct xml_plan* plan = xml_compile( query );
+	if ( !plan ) return NULL;
+
+	uint32_t* list = xml_table_exec( plan, table, node );
 
+	free_xml_plan( plan );
+
+	return list;
+}
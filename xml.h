@@ -6,25 +6,59 @@
 #ifndef _XML_H_
 #define _XML_H_
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Symbol table interning element and attribute names to small integer
+ * ids. Every document has one, either private or shared with others.
+ */
+struct xml_names;
+
 
 /*
- * if letter <= 0 then list is an array of matching elements;
- * else, it is a compressed trie array
+ * children or attributes of an element grouped by name: entry i lists the
+ * len nodes named id, in document order. entries are sorted by id.
  */
-struct trie_node {
+struct xml_index_entry {
+
+	int id;
+	int len;
+	void** list;
+};
+
+
+struct xml_index {
 
-	int letter;
-	void* list;
 	int len;
+	struct xml_index_entry* entries;
 };
 
 
+/*
+ * value is not null terminated: it points, together with its length, into
+ * the buffer the document was loaded from. name is the null terminated
+ * copy kept by the name table, and name_id its id there.
+ * Lengths are ints: names or values longer than INT_MAX bytes make a
+ * document malformed, for every loader and reader.
+ *
+ * order numbers the nodes of a document in document order: every element
+ * comes before its attributes, and these before its descendants. end is
+ * the largest order inside an element.
+ */
 struct xml_element {
 
-	char* name;
-	char* value;
+	const char* name;
+	const char* value;
+	int name_len;
+	int value_len;
+	int name_id;
+	int order;
 
 	char status;
+	char pending; // work left on the value, see xml_value
 
 	struct xml_element* father;
 	struct xml_element* next;
@@ -33,17 +67,25 @@ struct xml_element {
 
 	struct xml_attribute* attr; // first attribute
 
-	struct trie_node* sons_trie;
-	struct trie_node* attr_trie;
+	// built by the first query that needs them, NULL until then
+	struct xml_index* sons_index;
+	struct xml_index* attr_index;
+
+	int end;
 };
 
 
 struct xml_attribute {
 
-	char* name;
-	char* value;
+	const char* name;
+	const char* value;
+	int name_len;
+	int value_len;
+	int name_id;
+	int order;
 
 	char status;
+	char pending;
 
 	struct xml_element* father;
 	struct xml_attribute* next;
@@ -51,12 +93,451 @@ struct xml_attribute {
 };
 
 
+/*
+ * names: table to intern names into, shared between documents; it must
+ * outlive them and not be used by two loads at once. NULL gives the
+ * document a private table.
+ *
+ * index_threshold: queries scan lists of up to this many children or
+ * attributes, and index longer ones the first time they look a name up in
+ * them. 0 picks a default, and a negative value indexes every list.
+ *
+ * threads: parse large documents with up to this many threads; 1 or less
+ * loads on the calling thread. The tree is the same a single thread builds.
+ *
+ * max_depth: refuse documents nesting elements deeper than this, 0 for no
+ * limit. Loading and queries use no recursion, so any depth is safe as far
+ * as memory goes; the limit is for input that is not trusted.
+ *
+ * postings: when non zero, list the elements of every name in document
+ * order once loaded, a pointer per element, so that descendant, following
+ * and preceding steps naming an element take time in the number of matches
+ * rather than in the size of the subtree. Node tables ignore it.
+ *
+ * cache: keep the results of the latest this many xml_get_cached calls,
+ * 0 for none.
+ *
+ * decode: XML_DECODE replaces the entity and character references of text
+ * and attribute values with what they stand for while loading; values
+ * without any still point into the buffer. XML_DECODE_LAZY only notes
+ * which values hold references, for xml_value to decode the first time it
+ * is asked. 0 leaves them as they are.
+ *
+ * lazy_values: loading leaves values as it finds them, trailing whitespace
+ * and references included, for xml_value to trim, and decode if asked to,
+ * the first time each is read. Nodes only note where their values lie; the
+ * values must then be read through xml_value. Node tables ignore decode
+ * and lazy_values.
+ *
+ * stats: when not NULL, the loaders fill it in, failing or not, and push
+ * parsers as they are fed, until finished. Node tables and snapshots
+ * ignore it.
+ */
+#define XML_DECODE       1
+#define XML_DECODE_LAZY  2
+
+struct xml_load_stats;
+
+struct xml_options {
+
+	struct xml_names* names;
+	int index_threshold;
+	int threads;
+	int max_depth;
+	int postings;
+	int cache;
+	int decode;
+	int lazy_values;
+	struct xml_load_stats* stats;
+};
+
+
+/*
+ * load_xml_mmap maps the file and load_xml_buffer uses the caller's buffer,
+ * which must outlive the document. load_xml is load_xml_mmap, falling back
+ * to reading the whole file when it can not be mapped.
+ *
+ * The _opt versions take options, which may be NULL.
+ */
 struct xml_element* load_xml( const char* name );
+struct xml_element* load_xml_mmap( const char* name );
+struct xml_element* load_xml_buffer( const char* buffer, size_t len );
+
+struct xml_element* load_xml_opt( const char* name,
+                                  const struct xml_options* opt );
+struct xml_element* load_xml_mmap_opt( const char* name,
+                                       const struct xml_options* opt );
+struct xml_element* load_xml_buffer_opt( const char* buffer, size_t len,
+                                         const struct xml_options* opt );
+
+/*
+ * Load statistics: the bytes read, what the tree holds, how many objects,
+ * or blocks for the arena, each use of memory takes and their bytes, and
+ * the wall time of every phase in seconds. Values only count when copied
+ * or decoded into the arena; names count the whole table when shared.
+ * Counting takes a test per node.
+ */
+struct xml_alloc_stats {
+
+	size_t count;
+	size_t bytes;
+};
+
+struct xml_load_stats {
+
+	size_t bytes;
+	size_t elements;
+	size_t attributes;
+	size_t texts;
+	int max_depth;
+
+	struct xml_alloc_stats nodes;
+	struct xml_alloc_stats values;
+	struct xml_alloc_stats arena;
+	struct xml_alloc_stats names;
+	struct xml_alloc_stats postings;
+
+	double read_time;      // opening and mapping or reading the file
+	double parse_time;     // tokenizing and building the tree
+	double merge_time;     // naming and stitching the fragments of threads
+	double postings_time;
+	double total_time;
+};
+
+/*
+ * releases a whole document, given the root returned by the loaders
+ */
 void free_xml( struct xml_element* elem );
 
+/*
+ * xml_value returns the value of an element or attribute and its length,
+ * trimming or decoding it first if it is still to be; threads may ask at
+ * once.
+ *
+ * xml_decode writes value with its references decoded to out, which needs
+ * len bytes and may be value itself, and returns the decoded length. It
+ * knows the five predefined entities and character references, and copies
+ * anything else as is.
+ */
+const char* xml_value( void* node, int* len );
+int xml_decode( const char* value, int len, char* out );
+
 void** xml_get( struct xml_element* element, const char* query );
 void free_xml_list( void** list );
 
+/*
+ * The nodes xml_get returns are in document order, without duplicates.
+ * Queries keep their state to themselves and only add indexes to the
+ * document, safely, so any number of threads may query a document at
+ * once, as long as its name table is not being loaded into meanwhile.
+ *
+ * xml_get in two halves: xml_compile parses a query once into a plan that
+ * xml_exec runs against any number of documents, with the same results.
+ * A plan is never modified after compiling, so threads may share it.
+ *
+ * xml_compile_opt resolves the names of the query in opt names, adding the
+ * missing ones; plans run fastest against documents loaded with that same
+ * table. It must not be used while loading into that table.
+ *
+ * Steps may carry predicates: [n], [last()], [@name], [@name='value'] and
+ * [name], a child element. They count positions along the axis from each
+ * context, nearest first on reverse axes, but "//name[...]" counts them
+ * among the sons of each father as XPath does. Queries with any other
+ * predicate do not compile.
+ */
+struct xml_plan;
+
+struct xml_plan* xml_compile( const char* query );
+struct xml_plan* xml_compile_opt( const char* query,
+                                  const struct xml_options* opt );
+void free_xml_plan( struct xml_plan* plan );
+
+void** xml_exec( const struct xml_plan* plan, struct xml_element* element );
+
+/*
+ * Results without a list: xml_get_each calls handler with every node
+ * xml_get would return, in the same order, until it returns non zero.
+ * Evaluation stops there, and the last step of most queries (child,
+ * descendant, attribute, self, following and preceding) never collects
+ * its nodes. Returns 0, or -1 when out of memory or the query is invalid.
+ *
+ * xml_get_first returns the first node xml_get would, or NULL, and
+ * xml_count how many, or -1.
+ */
+typedef int (*xml_match_handler)( void* node, void* ctx );
+
+int xml_exec_each( const struct xml_plan* plan, struct xml_element* element,
+                   xml_match_handler handler, void* ctx );
+int xml_get_each( struct xml_element* element, const char* query,
+                  xml_match_handler handler, void* ctx );
+
+void* xml_get_first( struct xml_element* element, const char* query );
+int xml_count( struct xml_element* element, const char* query );
+
+/*
+ * Cached results: xml_get_cached and xml_exec_cached find what xml_get and
+ * xml_exec would, and keep it in the cache of the document, if it was
+ * loaded with one, by context node and compiled query: different spellings
+ * of the same steps share an entry. Asking again returns the same list,
+ * until it is evicted as the least recently used or the document is freed;
+ * documents never change once loaded.
+ *
+ * Lists are shared between callers and threads, not to be modified, and
+ * released with free_xml_cached, never free_xml_list. Each is freed once
+ * its callers have released it and the cache has dropped it.
+ */
+struct xml_cache_stats {
+
+	size_t hits;
+	size_t misses;
+	int len;
+};
+
+void* const* xml_get_cached( struct xml_element* element, const char* query );
+void* const* xml_exec_cached( const struct xml_plan* plan,
+                              struct xml_element* element );
+void free_xml_cached( void* const* list );
+
+void xml_get_cache_stats( struct xml_element* elem,
+                          struct xml_cache_stats* stats );
+
+/*
+ * Profiles: xml_get_profiled and xml_exec_profiled return what xml_get and
+ * xml_exec would, and fill in profile with a line per step: its axis, name
+ * test and predicates, the context nodes it got and the nodes it kept, how
+ * many nodes its axis looked at, whether it used name indexes or postings,
+ * and how long it took. Relative queries get a first step for the
+ * descendants they start from; steps after one that found nothing do not
+ * run and are left at 0. Profiles are released with free_xml_profile.
+ *
+ * print_xml_profile writes one as a table.
+ */
+#define XML_USED_INDEX     1
+#define XML_USED_POSTINGS  2
+
+struct xml_step_profile {
+
+	const char* axis;
+	const char* name;
+	int preds;
+
+	size_t input;
+	size_t output;
+	size_t visited;
+	int used;
+	uint64_t ns;
+};
+
+struct xml_profile {
+
+	int len;
+	struct xml_step_profile* steps;
+
+	size_t results;
+	uint64_t ns;
+};
+
+void** xml_get_profiled( struct xml_element* element, const char* query,
+                         struct xml_profile* profile );
+void** xml_exec_profiled( const struct xml_plan* plan,
+                          struct xml_element* element,
+                          struct xml_profile* profile );
+void free_xml_profile( struct xml_profile* profile );
+
+void print_xml_profile( FILE* out, const struct xml_profile* profile );
+
+/*
+ * Pull parser: every call to xml_reader_next fills ev with the next event
+ * of the document and returns its type, without building any tree. The
+ * names and values of an event point into the buffer being read.
+ *
+ * For start and end elements ev name is the element name, attributes fill
+ * both name and value, text fills value (trimmed like in the tree) and
+ * special tags (<? > and <! >) get their raw contents in value. depth is
+ * the depth of the element the event belongs to, 1 for the top level ones,
+ * and refs is set when value holds references, left as they are.
+ * After XML_END_DOCUMENT or XML_ERROR every call returns the same type.
+ *
+ * new_xml_reader reads the caller's buffer, which must outlive the reader,
+ * and open_xml_reader a file, mapped like load_xml does.
+ */
+enum xml_event_type {
+
+	XML_START_ELEMENT,
+	XML_ATTRIBUTE,
+	XML_TEXT,
+	XML_END_ELEMENT,
+	XML_SPECIAL_TAG,
+	XML_END_DOCUMENT,
+	XML_ERROR
+};
+
+
+struct xml_event {
+
+	enum xml_event_type type;
+	int depth;
+
+	const char* name;
+	const char* value;
+	int name_len;
+	int value_len;
+
+	int refs;
+};
+
+
+struct xml_reader;
+
+struct xml_reader* new_xml_reader( const char* buffer, size_t len );
+struct xml_reader* open_xml_reader( const char* name );
+void free_xml_reader( struct xml_reader* reader );
+
+enum xml_event_type xml_reader_next( struct xml_reader* reader,
+                                     struct xml_event* ev );
+
+/*
+ * skips the rest of the innermost open element, through its end tag, and
+ * returns XML_END_ELEMENT, or XML_ERROR
+ */
+enum xml_event_type xml_reader_skip( struct xml_reader* reader );
+
+/*
+ * Push parser, for input that arrives in chunks of any size. Chunks are
+ * copied as needed, so they may be reused as soon as xml_parser_feed
+ * returns. Both xml_parser_feed and xml_parser_finish return 0, or -1 once
+ * the document is found to be malformed.
+ *
+ * new_xml_parser builds a tree, which xml_parser_root hands over to the
+ * caller (to be released with free_xml) after a successful finish.
+ * new_xml_event_parser instead calls handler with every event, the same
+ * ones xml_reader_next returns, as soon as it is complete; their names and
+ * values are only valid during the call. Tokens still incomplete after
+ * 4 kB are looked at again once as many bytes follow them, or on finish,
+ * which keeps feeding linear in the input.
+ */
+struct xml_parser;
+
+typedef void (*xml_event_handler)( const struct xml_event* ev, void* ctx );
+
+struct xml_parser* new_xml_parser( const struct xml_options* opt );
+struct xml_parser* new_xml_event_parser( xml_event_handler handler,
+                                         void* ctx );
+void free_xml_parser( struct xml_parser* parser );
+
+int xml_parser_feed( struct xml_parser* parser, const char* bytes,
+                     size_t len );
+int xml_parser_finish( struct xml_parser* parser );
+
+struct xml_element* xml_parser_root( struct xml_parser* parser );
+
+/*
+ * Runs a plan over the rest of a reader's document without building it,
+ * calling handler with every match, in O(depth) memory. Subtrees that can
+ * not hold a match are skipped. Only the child, descendant,
+ * descendant-or-self, self and attribute axes are supported, attribute
+ * followed by self ones only.
+ *
+ * Attributes are reported as their XML_ATTRIBUTE events, and elements as
+ * their XML_END_ELEMENT ones with value set to their text, as in the tree.
+ * Returns 0, or -1 on a malformed document or unsupported plan, which
+ * includes any with predicates.
+ */
+int xml_stream( const struct xml_plan* plan, struct xml_reader* reader,
+                xml_event_handler handler, void* ctx );
+
+/*
+ * Structural index of a buffer: pos lists, in order, the offset of every
+ * '<' and of the '>' ending its tag, and of every '=', '/' and value quote
+ * inside tags; none of text, values or the contents of <? > and <! > tags.
+ * xml_mark only marks, without checking the document is well formed, and
+ * returns NULL for buffers of 4GB or more.
+ *
+ * load_xml_marks builds the tree load_xml_buffer would from the buffer,
+ * which must outlive the document, jumping over text and values.
+ * xml_marks_skip returns the index of the first mark after the element
+ * whose start tag begins at mark i, or count.
+ */
+struct xml_marks {
+
+	const char* buffer;
+	size_t len;
+	uint32_t* pos;
+	size_t count;
+};
+
+struct xml_marks* xml_mark( const char* buffer, size_t len );
+void free_xml_marks( struct xml_marks* marks );
+
+struct xml_element* load_xml_marks( const struct xml_marks* marks,
+                                    const struct xml_options* opt );
+size_t xml_marks_skip( const struct xml_marks* marks, size_t i );
+
+/*
+ * xml_save_snapshot writes a document, with the indexes its queries built
+ * so far, to a file xml_open_snapshot maps back into a document as it was,
+ * without parsing, ready for queries and to be released with free_xml.
+ * Snapshots are only read by the build that wrote them, and the name table
+ * of an opened one must not be added to. Saving returns 0, or -1. Opening
+ * checks the layout of the file, and refuses truncated or garbled ones,
+ * but trusts the nodes in it.
+ */
+int xml_save_snapshot( struct xml_element* root, const char* path );
+struct xml_element* xml_open_snapshot( const char* path );
+
+/*
+ * Node table: a document as parallel arrays indexed by node number, about
+ * a quarter of the size of the node structs. Node i is the one with order
+ * i: 0 is the meta root, the attributes of an element follow it and then
+ * its descendants, up to end. XML_NIL stands for no node, and for no value
+ * in value, which holds offsets into buffer. kind is the status of the
+ * node structs: 1 for elements, 2 for attributes, 4 for the meta root.
+ *
+ * load_xml_table reads the caller's buffer, under 4GB, which must outlive
+ * the table. Of the options it only uses names and max_depth: threads are
+ * not used, and values are left as they are in buffer, references
+ * included, whatever decode and lazy_values say. xml_table_exec and
+ * xml_table_get run a query from node, like xml_exec and xml_get, and
+ * return the node numbers found in document order, ended by 0, to be
+ * released with free. Queries with predicates are not supported and
+ * return NULL.
+ */
+#define XML_NIL  0xffffffffu
+
+struct xml_table {
+
+	const char* buffer;
+	struct xml_names* names;
+	uint32_t len;
+
+	uint32_t* father;
+	uint32_t* next; // sibling, or attribute
+	uint32_t* end;
+	int* name_id;
+	uint32_t* value;
+	uint32_t* value_len;
+	unsigned char* kind;
+};
+
+struct xml_table* load_xml_table( const char* buffer, size_t len,
+                                  const struct xml_options* opt );
+void free_xml_table( struct xml_table* table );
+
+uint32_t* xml_table_exec( const struct xml_plan* plan,
+                          const struct xml_table* table, uint32_t node );
+uint32_t* xml_table_get( const struct xml_table* table, uint32_t node,
+                         const char* query );
+
+/*
+ * xml_names_find returns the id of a name, or -1 if it was never seen;
+ * xml_names_of returns the table of the document elem belongs to.
+ */
+struct xml_names* new_xml_names( void );
+void free_xml_names( struct xml_names* names );
+
+int xml_names_find( const struct xml_names* names, const char* name, int len );
+struct xml_names* xml_names_of( struct xml_element* elem );
+
 
 #endif /* _XML_H_ */
 